@@ -3,6 +3,7 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cctype>
 
 Channel::Channel(int num, const std::string& name, RGBColor col, uint16_t lower, uint16_t upper) 
   : channelNumber(num), channelName(name), color(col), lowerBound(lower), upperBound(upper) {}
@@ -34,6 +35,38 @@ Channel::Channel(const std::string& csvLine) {
   
 }
 
+int ReadPalette(const std::string& file, ChannelVector& channels) {
+
+  std::ifstream in(file);
+  if (!in) {
+    std::cerr << "Error: unable to read palette " << file << std::endl;
+    return 1;
+  }
+
+  std::string line;
+  size_t n = 0;
+  while (std::getline(in, line)) {
+    n++;
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line.at(0) == '#')
+      continue;
+
+    // a header line starts with a column name rather than a number
+    if (channels.empty() && !std::isdigit(static_cast<unsigned char>(line.at(0))))
+      continue;
+
+    try {
+      channels.emplace_back(line);
+    } catch (const std::exception& e) {
+      std::cerr << "Error: unable to parse line " << n << " of palette " << file <<
+	": " << line << std::endl;
+      return 1;
+    }
+  }
+  
+  return 0;
+}
 
 // Overload the << operator for RGBColor
 std::ostream& operator<<(std::ostream& os, const RGBColor& color) {
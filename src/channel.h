@@ -1,3 +1,6 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -33,3 +36,11 @@ struct Channel {
 };
 
 typedef std::vector<Channel> ChannelVector;
+
+// read a palette CSV (number,name,r,g,b,lower,upper per line) into
+// channels. Blank lines, '#' comments and a header line are skipped.
+// Returns 0 on success, or 1 if the file can not be read or a line
+// does not parse
+int ReadPalette(const std::string& file, ChannelVector& channels);
+
+#endif
@@ -28,6 +28,13 @@ namespace opt {
   static std::string greenfile;
   static std::string bluefile;
   static int threads = 1;
+  static bool sparse = false;
+  static int level = 0;
+  static bool sequential = false;
+
+  // --codec, --codec-level and --predictor
+  static std::string codec_name;
+  static CodecOptions codec;
 }
 
 #define DEBUG(x) std::cerr << #x << " = " << (x) << std::endl
@@ -37,7 +44,7 @@ namespace opt {
     std::cerr << msg << std::endl; \
   }
 
-static const char* shortopts = "hvr:g:b:q:c:m:p:C:";
+static const char* shortopts = "hvr:g:b:q:t:m:p:C:";
 static const struct option longopts[] = {
   { "verbose",                    no_argument, NULL, 'v' },
   { "red",                        required_argument, NULL, 'r' },
@@ -45,9 +52,19 @@ static const struct option longopts[] = {
   { "blue",                       required_argument, NULL, 'b' },
   { "quant-file",                 required_argument, NULL, 'q' },
   { "marker-file",                required_argument, NULL, 'm' },  
-  { "threads",                    required_argument, NULL, 'c' },
+  { "threads",                    required_argument, NULL, 't' },
   { "palette",                    required_argument, NULL, 'p' },
   { "channels",                   required_argument, NULL, 'C' },  
+  { "percentiles",                required_argument, NULL, 'P' },
+  { "sparse",                     no_argument, NULL, 's' },
+  { "level",                      required_argument, NULL, 'L' },
+  { "levels",                     required_argument, NULL, 'n' },
+  { "codec",                      required_argument, NULL, 'z' },
+  { "codec-level",                required_argument, NULL, 'l' },
+  { "predictor",                  required_argument, NULL, 'd' },
+  { "sequential",                 no_argument, NULL, 'S' },
+  { "json",                       no_argument, NULL, 'j' },
+  { "cache-mb",                   required_argument, NULL, 'M' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -56,21 +73,38 @@ static const char *RUN_USAGE_MESSAGE =
 "Modules:\n"
 "  compress - Zero out noise-only tiles for better compression\n"
 "  gray2rgb - Convert a 3-channel gray TIFF to a single RGB\n"
+"  interleave - Pack select channels into one multi-sample (pixel interleaved) image\n"
 "  colorize - Colorize select channels from a cycif tiff\n"
-"  mean - Give the mean pixel for each channel\n"
+"  crop - Cut an annotated PNG/JPEG crop out of a cycif tiff\n"
+"  pyramid - Add reduced resolution levels to each channel, as SubIFDs\n"
+"  recompress - Re-encode every tile with another codec, level and predictor\n"
+"  codec-bench - Compare the size and speed of each codec on sampled tiles\n"
+"  mean - Give the mean, std, min, max and percentiles for each channel\n"
+"  info - Print the size, tiling, codec, channel names and levels of each channel\n"
+"\n"
+"-t, --threads sets the worker threads of each module that takes it, 0 for every CPU.\n"
+"Workers are OpenMP threads in every module, so they can be pinned to cores with\n"
+"OMP_PROC_BIND=close (or spread) and OMP_PLACES=cores\n"
   "\n";
 
 static int compress(int argc, char** argv);
 static int gray2rgb(int argc, char** argv);
+static int interleave(int argc, char** argv);
 static int findmean(int argc, char** argv);
 static int colorize(int argc, char** argv);
 static int mask(int argc, char** argv);
+static int crop(int argc, char** argv);
+static int pyramid(int argc, char** argv);
+static int recompress(int argc, char** argv);
+static int codecbench(int argc, char** argv);
+static int info(int argc, char** argv);
 static void parseRunOptions(int argc, char** argv);
 
 // process in and outfile cmd arguments
 static bool in_out_process(int argc, char** argv);
 static bool in_only_process(int argc, char** argv);
 static bool check_readable(const std::string& filename);
+static bool codec_process();
 
 /*
   https://github.com/LuaDist/libtiff/blob/43d5bd6d2da90e9bf254cd42c377e4d99008f00b/libtiff/tiffio.h#L61
@@ -99,6 +133,8 @@ int main(int argc, char **argv) {
   // get the module
   if (opt::module == "gray2rgb") {
     return(gray2rgb(argc, argv));
+  } else if (opt::module == "interleave") {
+    return(interleave(argc, argv));
   } else if (opt::module == "mask") {
     return(mask(argc, argv));
   } else if (opt::module == "compress") {
@@ -107,6 +143,16 @@ int main(int argc, char **argv) {
     return(colorize(argc, argv));
   } else if (opt::module == "mean") {
     return(findmean(argc, argv));
+  } else if (opt::module == "crop") {
+    return(crop(argc, argv));
+  } else if (opt::module == "pyramid") {
+    return(pyramid(argc, argv));
+  } else if (opt::module == "recompress") {
+    return(recompress(argc, argv));
+  } else if (opt::module == "codec-bench") {
+    return(codecbench(argc, argv));
+  } else if (opt::module == "info") {
+    return(info(argc, argv));
   } else {
     assert(false);
   }
@@ -121,7 +167,7 @@ static int mask(int argc, char** argv) {
   long w = 0;
   long h = 0;
   
-  const char* shortopts = "vx:y:w:h:";
+  const char* shortopts = "vx:y:w:h:t:L:z:l:d:S";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
@@ -130,11 +176,17 @@ static int mask(int argc, char** argv) {
     case 'y' : arg >> y; break;
     case 'w' : arg >> w; break;
     case 'h' : arg >> h; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'L' : arg >> opt::level; break;
+    case 'S' : opt::sequential = true; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
     default: die = true;
     }
   }
 
-  if (die || in_out_process(argc, argv)) {
+  if (die || in_out_process(argc, argv) || codec_process()) {
     
     const char *USAGE_MESSAGE =
       "Usage: tiffo mask [tiff] [outputtiff] <options>\n"
@@ -144,6 +196,12 @@ static int mask(int argc, char** argv) {
       "  -y                        Y coordinate of mask\n"
       "  -w                        Width mask\n"
       "  -h                        Height of mask\n"	
+      "  -t, --threads             Number of threads to mask and compress tiles on [1]\n"
+      "  -L, --level               Resolution level to run on, 0 is full [0]\n"
+      "  -S, --sequential          Read tiles in file order with prefetch, for NFS or HDD\n"
+      "  -z, --codec               none, lzw, deflate or zstd [as input]\n"
+      "  -l, --codec-level         Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "  -d, --predictor           1 none, 2 horizontal differencing, 3 floating point [1]\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -159,31 +217,39 @@ static int mask(int argc, char** argv) {
     return 1;
   }
 
-  //assert(TIFFSetField(otif, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE));
-  //assert(TIFFSetField(otif, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL));
- 
-  //LZW, Deflate and LZMA2 compression can be specified together with a predictor value. A predictor value of 2 causes each scanline of the output image to undergo horizontal differencing before it is encoded; a value of 1 forces each scanline to be encoded without differencing. A value 3 is for floating point predictor which you can use if the encoded data are in floating point format. LZW-specific options are specified by appending a :-separated list to the lzw option; e.g. -c lzw:2 for LZW compression with horizontal differencing.
-
   uint64_t xlim2 = x + w;
   uint64_t ylim2 = y + h;
   
   // this routine will handle printing output to stdout
-  Mask(itif, otif, x, y, xlim2, ylim2);
+  int rc = Mask(itif, otif, x, y, xlim2, ylim2, opt::threads, opt::level, opt::codec, opt::sequential);
 
   TIFFClose(otif);
   TIFFClose(itif);
   
-  return 0;
+  return rc;
 }
 
 static int findmean(int argc, char** argv) {
 
   bool die = false;
-  const char* shortopts = "v";
+  std::vector<double> percentiles = {1, 5, 50, 95, 99};
+  
+  const char* shortopts = "vt:P:L:S";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'L' : arg >> opt::level; break;
+    case 'S' : opt::sequential = true; break;
+    case 'P' :
+      {
+	percentiles.clear();
+	std::string token;
+	while (std::getline(arg, token, ','))
+	  percentiles.push_back(std::stod(token));
+      }
+      break;
     default: die = true;
     }
   }
@@ -191,9 +257,13 @@ static int findmean(int argc, char** argv) {
   if (die || in_only_process(argc, argv)) {
     
     const char *USAGE_MESSAGE =
-      "Usage: cytif findmean [tiff] <options>\n"
-      "  Print the mean pixel value of a TIFF\n"
-      "  -v, --verbose             Increase output to stderr"
+      "Usage: cytif mean [tiff] <options>\n"
+      "  Print the mean, std, min, max and percentiles of each channel of a TIFF\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "  -t, --threads             Number of threads to split the tiles over [1]\n"
+      "  -P, --percentiles         Comma-separated percentiles to report [1,5,50,95,99]\n"
+      "  -L, --level               Resolution level to run on, 0 is full [0]\n"
+      "  -S, --sequential          Read tiles in file order with prefetch, for NFS or HDD\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -203,35 +273,74 @@ static int findmean(int argc, char** argv) {
   // the "m" keeps it from being memory mapped, which for
   // a single pass just causes memory overruns from the C memmap func
   TiffReader reader(opt::infile.c_str());
+  if (reader.get() == NULL)
+    return 1;
 
   // this routine will handle printing output to stdout
-  reader.print_means();
-
-  return 0;
+  return reader.print_stats(opt::threads, percentiles, opt::level, opt::sequential);
 }
 
 static int gray2rgb(int argc, char** argv) {
 
   bool die = false;
-  const char* shortopts = "v";
+  int threads = -1;
+  const char* shortopts = "vr:g:b:t:L:z:l:d:";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'r' : arg >> opt::redfile; break;
+    case 'g' : arg >> opt::greenfile; break;
+    case 'b' : arg >> opt::bluefile; break;
+    case 't' : arg >> threads; break;
+    case 'L' : arg >> opt::level; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
     default: die = true;
     }
   }
 
-  if (die || in_out_process(argc, argv)) {
+  // with -r, -g and -b the only argument left is the output, and the
+  // tags are taken from the red file
+  const bool separate = !opt::redfile.empty() || !opt::greenfile.empty() || !opt::bluefile.empty();
+  if (separate) {
+    if (opt::redfile.empty() || opt::greenfile.empty() || opt::bluefile.empty()) {
+      std::cerr << "Error: -r, -g and -b go together" << std::endl;
+      die = true;
+    }
+    for (const auto& f : {opt::greenfile, opt::bluefile})
+      if (!f.empty() && !check_readable(f)) {
+	std::cerr << "Error: File " << f << " not readable/exists" << std::endl;
+	die = true;
+      }
+    opt::infile = opt::redfile;
+  }
+  
+  if (die || in_out_process(argc, argv) || codec_process()) {
     
     const char *USAGE_MESSAGE =
       "Usage: cytif gray2rgb [tiff] [tiff out] <options>\n"
-      "  Convert a 3-channel grayscale image (8-bit) to RGB\n"
+      "       cytif gray2rgb -r [tiff] -g [tiff] -b [tiff] [tiff out] <options>\n"
+      "  Convert a 3-channel grayscale image (8-bit), or three 8-bit grayscale files, to RGB\n"
       "  -v, --verbose             Increase output to stderr\n"
+      "  -r, --red                 Red channel file, with -g and -b\n"
+      "  -g, --green               Green channel file\n"
+      "  -b, --blue                Blue channel file\n"
+      "  -t, --threads             Number of threads to read and merge tiles on [1, 3 with -r/-g/-b]\n"
+      "  -L, --level               Resolution level to run on, 0 is full [0]\n"
+      "  -z, --codec               none, lzw, deflate or zstd [as input]\n"
+      "  -l, --codec-level         Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "  -d, --predictor           1 none, 2 horizontal differencing, 3 floating point [1]\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
+
+  // one thread per file by default, so the three are read together
+  if (threads < 0)
+    threads = separate ? 3 : 1;
+  threads = ResolveThreads(threads);
   
   // open either the red channel or the 3-IFD file
   TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
@@ -243,37 +352,146 @@ static int gray2rgb(int argc, char** argv) {
     return 1;
   }
   
+  // start from the first channel at the requested level
+  std::vector<uint64_t> offsets;
+  if (r_itif == NULL || LevelOffsets(r_itif, opt::level, offsets) ||
+      !TIFFSetSubDirectory(r_itif, offsets[0]))
+    return 1;
+  
   // copy all of the tags from in to out
   tiffcp(r_itif, otif, false);
+  if (opt::level > 0)
+    TIFFSetField(otif, TIFFTAG_SUBFILETYPE, 0);
   
-  // if this is a single 3 IFD file
-  MergeGrayToRGB(r_itif, otif);
+  int rc = 0;
+  if (separate) {
+    rc = MergeGrayToRGB(opt::redfile, opt::greenfile, opt::bluefile, otif,
+			opt::level, threads, opt::codec);
+  } else {
+    // if this is a single 3 IFD file
+    rc = MergeGrayToRGB(r_itif, otif, opt::level, threads, opt::codec);
+  }
   
   TIFFClose(r_itif);
   TIFFClose(otif);
   
-  return 0;
+  return rc;
 }
 
+static int interleave(int argc, char** argv) {
+
+  bool die = false;
+  std::vector<int> channels;
+  
+  const char* shortopts = "vc:t:L:z:l:d:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'L' : arg >> opt::level; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channels.push_back(std::stoi(token));
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || channels.empty() || in_out_process(argc, argv) || codec_process()) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cytif interleave [tiff] [tiff out] -c 0,1,2 <options>\n"
+      "  Pack channels (same size and type, 8, 16 or 32-bit) into one image with a sample\n"
+      "  per channel, e.g. 3 8-bit channels into RGB\n"
+      "  -c, --channels            Comma-separated list of channels, in sample order\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "  -t, --threads             Number of threads to split the tiles over [1]\n"
+      "  -L, --level               Resolution level to run on, 0 is full [0]\n"
+      "  -z, --codec               none, lzw, deflate or zstd [as input]\n"
+      "  -l, --codec-level         Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "  -d, --predictor           1 none, 2 horizontal differencing, 3 floating point [1]\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+  
+  TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
+  if (r_itif == NULL) {
+    fprintf(stderr, "Error opening %s for reading\n", opt::infile.c_str());
+    return 1;
+  }
+
+  // Open the output TIFF file
+  TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
+  if (otif == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", opt::outfile.c_str());
+    return 1;
+  }
+  
+  // take the rest of the tags from the first channel at this level
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(r_itif, opt::level, offsets) ||
+      channels[0] < 0 || channels[0] >= static_cast<int>(offsets.size()) ||
+      !TIFFSetSubDirectory(r_itif, offsets[channels[0]])) {
+    fprintf(stderr, "Error: no channel %d at level %d\n", channels[0], opt::level);
+    return 1;
+  }
+  tiffcp(r_itif, otif, false);
+  if (opt::level > 0)
+    TIFFSetField(otif, TIFFTAG_SUBFILETYPE, 0);
+
+  if (opt::verbose)
+    std::cerr << "...interleaving " << channels.size() << " channels" << std::endl;
+  
+  int rc = Interleave(r_itif, otif, channels, opt::level, opt::threads, opt::codec);
+  
+  TIFFClose(r_itif);
+  TIFFClose(otif);
+  
+  return rc;
+}
 
 static int compress(int argc, char** argv) {
 
   bool die = false;
-  const char* shortopts = "v";
+  const char* shortopts = "vt:sL:z:l:d:";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 's' : opt::sparse = true; break;
+    case 'L' : arg >> opt::level; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
     default: die = true;
     }
   }
 
-  if (die || in_out_process(argc, argv)) {
+  if (die || in_out_process(argc, argv) || codec_process()) {
     
     const char *USAGE_MESSAGE =
       "Usage: cytif compress [tiff in] [tiff out] <options>\n"
-      "  Zero out tiles with low signal, to improve compression ratio\n"
+      "  Zero out tiles with low signal, to improve compression ratio. The output is an\n"
+      "  8-bit mask per channel, 255 on the tiles with signal\n"
       "  -v, --verbose             Increase output to stderr\n"
+      "  -t, --threads             Number of threads to split the tiles over [1]\n"
+      "  -s, --sparse              Copy the signal tiles through unchanged instead, and leave\n"
+      "                            the rest unwritten (zero byte count). Only cytif and other\n"
+      "                            sparse-aware readers can open this; stock libtiff, tiffcp\n"
+      "                            and vips reject the empty tiles\n"
+      "  -L, --level               Resolution level to run on, 0 is full [0]\n"
+      "  -z, --codec               none, lzw, deflate or zstd [as input]\n"
+      "  -l, --codec-level         Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "  -d, --predictor           1 none, 2 horizontal differencing, 3 floating point [1]\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -290,13 +508,265 @@ static int compress(int argc, char** argv) {
     return 1;
   }
 
-  Compress(r_itif, otif);
+  int rc = Compress(r_itif, otif, opt::sparse, opt::verbose, opt::threads, opt::level, opt::codec);
+  
+  TIFFClose(r_itif);
+  TIFFClose(otif);
+
+  return rc;
+
+}
+
+static int pyramid(int argc, char** argv) {
+
+  bool die = false;
+  int levels = -1;
+  
+  const char* shortopts = "vt:n:z:l:d:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'n' : arg >> levels; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_out_process(argc, argv) || codec_process()) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cytif pyramid [tiff in] [tiff out] <options>\n"
+      "  Write each channel with 2x downsampled levels as its SubIFDs (OME-TIFF pyramid).\n"
+      "  The full resolution image is read once, and all levels are built as it streams\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "  -t, --threads             Number of threads to split the tiles over [1]\n"
+      "  -n, --levels              Number of reduced levels [until a level fits in one tile]\n"
+      "  -z, --codec               none, lzw, deflate or zstd [as input]\n"
+      "  -l, --codec-level         Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "  -d, --predictor           1 none, 2 horizontal differencing, 3 floating point [1]\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
+  if (r_itif == NULL) {
+    fprintf(stderr, "Error opening %s for reading\n", opt::infile.c_str());
+    return 1;
+  }
+  
+  // Open the output TIFF file
+  TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
+  if (otif == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", opt::outfile.c_str());
+    return 1;
+  }
+
+  int rc = Pyramid(r_itif, otif, levels, opt::verbose, opt::threads, opt::codec);
   
   TIFFClose(r_itif);
   TIFFClose(otif);
 
+  return rc;
+}
+
+static int recompress(int argc, char** argv) {
+
+  bool die = false;
+  opt::codec_name = "deflate";
+  
+  const char* shortopts = "vt:z:l:d:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_out_process(argc, argv) || codec_process()) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cytif recompress [tiff in] [tiff out] <options>\n"
+      "  Re-encode every tile (and pyramid level) with a new codec, keeping all tags\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "  -t, --threads             Number of threads to split the tiles over [1]\n"
+      "  -z, --codec               none, lzw, deflate or zstd [deflate]\n"
+      "  -l, --codec-level         Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "  -d, --predictor           1 none, 2 horizontal differencing, 3 floating point [1]\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
+  if (r_itif == NULL) {
+    fprintf(stderr, "Error opening %s for reading\n", opt::infile.c_str());
+    return 1;
+  }
+  
+  // Open the output TIFF file
+  TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
+  if (otif == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", opt::outfile.c_str());
+    return 1;
+  }
+
+  int rc = Recompress(r_itif, otif, opt::codec, opt::verbose, opt::threads);
+  
+  TIFFClose(r_itif);
+  TIFFClose(otif);
+
+  return rc;
+}
+
+static int codecbench(int argc, char** argv) {
+
+  bool die = false;
+  int tiles = 16;
+  
+  const char* shortopts = "vn:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'n' : arg >> tiles; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_only_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cytif codec-bench [tiff] <options>\n"
+      "  Sample tiles from each channel and print the compressed size and the encode\n"
+      "  and decode speed (MB/s, one thread) of each codec, level and predictor\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "  -n                        Tiles to sample per channel [16]\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
+  if (r_itif == NULL) {
+    fprintf(stderr, "Error opening %s for reading\n", opt::infile.c_str());
+    return 1;
+  }
+
+  // this routine will handle printing output to stdout
+  int rc = CodecBenchmark(r_itif, tiles, opt::verbose);
+  
+  TIFFClose(r_itif);
+  return rc;
+}
+
+static int info(int argc, char** argv) {
+
+  bool die = false;
+  bool json = false;
+  
+  const char* shortopts = "vj";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'j' : json = true; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_only_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: cytif info [tiff] <options>\n"
+      "  Print the size, tiling, codec, channel names (from the OME-XML) and resolution\n"
+      "  levels of each channel. Only the IFDs are read, no pixel data\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "  -j, --json                Print as JSON\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  // the IFDs are walked straight from the file, without libtiff
+  TiffHeader header(opt::infile);
+  if (header.ReadIFDs())
+    return 1;
+
+  header.print_info(json);
   return 0;
+}
+
+static int crop(int argc, char** argv) {
+
+  bool die = false;
+  std::string palette;
+  std::vector<int> channels;
+  long x = -1;
+  long y = -1;
+  long w = 0;
+  long h = 0;
+  double mpp = 0.325;
+  int quality = 85;
+  uint64_t cache_mb = 0;
+  
+  const char* shortopts = "vc:p:t:x:y:w:h:u:q:L:M:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'x' : arg >> x; break;
+    case 'y' : arg >> y; break;
+    case 'w' : arg >> w; break;
+    case 'h' : arg >> h; break;
+    case 'u' : arg >> mpp; break;
+    case 'q' : arg >> quality; break;
+    case 'L' : arg >> opt::level; break;
+    case 'M' : arg >> cache_mb; break;
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channels.push_back(std::stoi(token));
+      }
+      break;  
+    default: die = true;
+    }
+  }
 
+  if (die || in_out_process(argc, argv) || w <= 0 || h <= 0) {
+    const char *USAGE_MESSAGE =
+      "Usage: cytif crop [tiff] [png or jpg out] <options>\n"
+      "  Cut a window out of a cycif tiff (or an already colorized RGB tiff), colorize it,\n"
+      "  and add a 100 um scale bar and a channel legend. Empty crops are skipped\n"
+      "    -w, -h            Width and height of the crop\n"
+      "    -x, -y            Top left corner of the crop [random]\n"
+      "    -c                Comma-separated list of channels (e.g. 0,1,4,5)\n"
+      "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -u                Microns per full resolution pixel, for the scale bar (0 for none) [0.325]\n"
+      "    -q                JPEG quality [85]\n"
+      "    -t, --threads     Number of threads for decoding tiles [1]\n"
+      "    -L, --level       Resolution level to crop from, 0 is full [0]\n"
+      "    -M, --cache-mb    Read through a tile cache of at most this many MB, so memory\n"
+      "                      for decoded tiles stays capped on huge slides [0, off]\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  return Crop(opt::infile, opt::outfile, palette, channels,
+	      x, y, w, h, mpp, quality, opt::verbose, opt::threads, opt::level, cache_mb);
 }
 
 static int colorize(int argc, char** argv) {
@@ -305,12 +775,18 @@ static int colorize(int argc, char** argv) {
   std::string palette;
   std::vector<int> channels;
   
-  const char* shortopts = "vc:p:";
+  const char* shortopts = "vc:p:t:L:z:l:d:S";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
     case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'L' : arg >> opt::level; break;
+    case 'S' : opt::sequential = true; break;
+    case 'z' : arg >> opt::codec_name; break;
+    case 'l' : arg >> opt::codec.level; break;
+    case 'd' : arg >> opt::codec.predictor; break;
     case 'c' : 
       {
       std::string token;
@@ -324,12 +800,18 @@ static int colorize(int argc, char** argv) {
   }
   
 
-  if (die || in_out_process(argc, argv)) {
+  if (die || in_out_process(argc, argv) || codec_process()) {
     const char *USAGE_MESSAGE =
       "Usage: cytif colorize [16-bit tiff] [rgb tiff] <options>\n"
       "  Color a 16-bit multichannel tiff to certain channels and with pre-specified palette\n"
       "    -c                Comma-separated list of channels (e.g. 0,1,4,5)\n"
       "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -t, --threads     Number of threads to decode, blend and compress tiles on [1]\n"
+      "    -L, --level       Resolution level to colorize, 0 is full [0]\n"
+      "    -S, --sequential  Read tiles in file order with prefetch, for NFS or HDD\n"
+      "    -z, --codec       none, lzw, deflate or zstd [lzw]\n"
+      "    -l, --codec-level Compression level, e.g. 1-9 for deflate [codec default]\n"
+      "    -d, --predictor   1 none, 2 horizontal differencing, 3 floating point [1]\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
@@ -350,6 +832,12 @@ static int colorize(int argc, char** argv) {
 
   //std::cerr << tiffprint(r_itif) << std::endl;
 
+  // the output takes its size from the first channel at this level
+  std::vector<uint64_t> offsets;
+  if (r_itif == NULL || LevelOffsets(r_itif, opt::level, offsets) ||
+      !TIFFSetSubDirectory(r_itif, offsets[0]))
+    return 1;
+  
   uint32_t tileheight, tilewidth, width, height;
   assert(TIFFGetField(r_itif, TIFFTAG_IMAGEWIDTH, &width));
   assert(TIFFGetField(r_itif, TIFFTAG_IMAGELENGTH, &height));
@@ -385,12 +873,12 @@ static int colorize(int argc, char** argv) {
   //std::cerr << tiffprint(otif) << std::endl;
   
   // if this is a single 3 IFD file
-  Colorize(r_itif, otif, palette, channels, opt::verbose);
+  int rc = Colorize(r_itif, otif, palette, channels, opt::verbose, opt::threads, opt::level, opt::codec, opt::sequential);
   
   TIFFClose(r_itif);
   TIFFClose(otif);
   
-  return 0;
+  return rc;
 }
 
 
@@ -419,7 +907,7 @@ static void parseRunOptions(int argc, char** argv) {
     case 'b' : arg >> opt::bluefile; break;
     case 'q' : arg >> opt::quantfile; break;
     case 'm' : arg >> opt::markerfile; break;      
-    case 'c' : arg >> opt::threads; break;      
+    case 't' : arg >> opt::threads; break;      
     case 'h' : help = true; break;
     case 'C' : 
       {
@@ -445,8 +933,9 @@ static void parseRunOptions(int argc, char** argv) {
   }
   */
   
-  if (! (opt::module == "gray2rgb" || opt::module == "mean" || opt::module == "compress" || opt::module == "debug" || opt::module == "colorize"
-	 || opt::module == "mask") ) {
+  if (! (opt::module == "gray2rgb" || opt::module == "interleave" || opt::module == "mean" || opt::module == "compress" || opt::module == "debug" || opt::module == "colorize"
+	 || opt::module == "mask" || opt::module == "crop" || opt::module == "pyramid"
+	 || opt::module == "recompress" || opt::module == "codec-bench" || opt::module == "info") ) {
     std::cerr << "Module " << opt::module << " not implemented" << std::endl;
     die = true;
   }
@@ -480,6 +969,9 @@ static bool in_only_process(int argc, char** argv) {
   // there should be only 1 non-flag input
   if (count > 1)
     return true;
+
+  // -t 0 is every CPU, for every module
+  opt::threads = ResolveThreads(opt::threads);
   
   // die if no inputs provided
   if (count == 0)
@@ -514,6 +1006,9 @@ static bool in_out_process(int argc, char** argv) {
   // there should be only 2 non-flag input
   if (count > 2)
     return true;
+
+  // -t 0 is every CPU, for every module
+  opt::threads = ResolveThreads(opt::threads);
   // die if no inputs provided
   if (count == 0)
     return true;
@@ -529,6 +1024,12 @@ static bool in_out_process(int argc, char** argv) {
 }
 
 
+// turn --codec into opt::codec. Returns true on error
+static bool codec_process() {
+  return !opt::codec_name.empty() &&
+    ParseCodec(opt::codec_name, opt::codec.compression);
+}
+
 static bool check_readable(const std::string& filename) {
 
   std::ifstream file(filename);
@@ -0,0 +1,26 @@
+#ifndef IMAGE_DRAW_H
+#define IMAGE_DRAW_H
+
+#include <cstdint>
+#include <string>
+
+#include "channel.h"
+
+// Minimal drawing on an interleaved 8-bit RGB raster of w x h pixels,
+// for annotating crops (scale bars, channel legends) in memory.
+// Everything is clipped to the raster
+
+// fill the rectangle [x0, x1) x [y0, y1)
+void FillRect(uint8_t* rgb, int w, int h,
+	      int x0, int y0, int x1, int y1, const RGBColor& color);
+
+// draw printable ASCII text with its top left corner at (x, y), using
+// a built-in 5x7 pixel font blown up by an integer scale
+void DrawText(uint8_t* rgb, int w, int h,
+	      int x, int y, const std::string& text, int scale, const RGBColor& color);
+
+// size in pixels of text drawn at this scale
+int TextWidth(const std::string& text, int scale);
+int TextHeight(int scale);
+
+#endif
@@ -0,0 +1,143 @@
+#include "image_io.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <vector>
+
+#include <zlib.h>
+#include <jpeglib.h>
+
+/////////
+// PNG
+/////////
+
+static void __put32(std::vector<uint8_t>& v, uint32_t x) {
+  v.push_back(x >> 24);
+  v.push_back(x >> 16);
+  v.push_back(x >> 8);
+  v.push_back(x);
+}
+
+// length, type, data, then a CRC over the type and data
+static bool __write_chunk(FILE* f, const char* type, const std::vector<uint8_t>& data) {
+  std::vector<uint8_t> c;
+  __put32(c, data.size());
+  c.insert(c.end(), type, type + 4);
+  c.insert(c.end(), data.begin(), data.end());
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, c.data() + 4, c.size() - 4);
+  __put32(c, crc);
+  return fwrite(c.data(), 1, c.size(), f) == c.size();
+}
+
+int WritePNG(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h) {
+
+  // each row is prefixed by its filter type. "Up" (2) stores the
+  // difference from the row above, which suits the smooth, mostly dark
+  // content of colorized crops better than no filter
+  const size_t row = static_cast<size_t>(w) * 3;
+  std::vector<uint8_t> raw((row + 1) * h);
+  for (uint32_t y = 0; y < h; y++) {
+    uint8_t* r = raw.data() + y * (row + 1);
+    const uint8_t* cur = rgb + y * row;
+    r[0] = y ? 2 : 0;
+    if (y == 0) {
+      std::copy(cur, cur + row, r + 1);
+    } else {
+      const uint8_t* up = cur - row;
+      for (size_t i = 0; i < row; i++)
+	r[i + 1] = cur[i] - up[i];
+    }
+  }
+  
+  uLongf zlen = compressBound(raw.size());
+  std::vector<uint8_t> idat(zlen);
+  if (compress2(idat.data(), &zlen, raw.data(), raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+    fprintf(stderr, "Error: PNG compression failed for %s\n", file.c_str());
+    return 1;
+  }
+  idat.resize(zlen);
+  
+  // 8-bit truecolor, deflate, adaptive filtering, no interlace
+  std::vector<uint8_t> ihdr;
+  __put32(ihdr, w);
+  __put32(ihdr, h);
+  ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+
+  FILE* f = fopen(file.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", file.c_str());
+    return 1;
+  }
+  static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  bool ok = fwrite(sig, 1, 8, f) == 8 &&
+    __write_chunk(f, "IHDR", ihdr) &&
+    __write_chunk(f, "IDAT", idat) &&
+    __write_chunk(f, "IEND", {});
+  ok = (fclose(f) == 0) && ok;
+  
+  if (!ok) {
+    fprintf(stderr, "Error writing %s\n", file.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+/////////
+// JPEG
+/////////
+
+int WriteJPEG(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+	      int quality) {
+
+  FILE* f = fopen(file.c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", file.c_str());
+    return 1;
+  }
+  
+  jpeg_compress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, f);
+
+  cinfo.image_width = w;
+  cinfo.image_height = h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, std::min(std::max(quality, 1), 100), TRUE);
+
+  jpeg_start_compress(&cinfo, TRUE);
+  const size_t row = static_cast<size_t>(w) * 3;
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW r = const_cast<uint8_t*>(rgb + cinfo.next_scanline * row);
+    jpeg_write_scanlines(&cinfo, &r, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Error writing %s\n", file.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int WriteImage(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+	       int quality) {
+
+  std::string ext = file.substr(file.find_last_of('.') + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(),
+		 [](unsigned char c) { return std::tolower(c); });
+  
+  if (ext == "png")
+    return WritePNG(file, rgb, w, h);
+  if (ext == "jpg" || ext == "jpeg")
+    return WriteJPEG(file, rgb, w, h, quality);
+
+  fprintf(stderr, "Error: output %s should end in .png, .jpg or .jpeg\n", file.c_str());
+  return 1;
+}
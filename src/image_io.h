@@ -0,0 +1,21 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <cstdint>
+#include <string>
+
+// Encoders for finished 8-bit RGB rasters (w x h, interleaved, row-major)
+// All return 0 on success and print the reason to stderr otherwise
+
+// PNG, written directly with zlib
+int WritePNG(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h);
+
+// baseline JPEG through libjpeg, quality 1-100
+int WriteJPEG(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+	      int quality);
+
+// pick PNG or JPEG from the file extension (.png, .jpg, .jpeg)
+int WriteImage(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+	       int quality);
+
+#endif
@@ -0,0 +1,480 @@
+#include "pixel_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYTIF_X86 1
+#include <immintrin.h>
+#endif
+
+/////////
+// SumMinMaxU16
+/////////
+
+static void __sum_min_max_u16_scalar(const uint16_t* p, size_t n,
+				     uint64_t& sum, uint16_t& mn, uint16_t& mx) {
+  uint64_t s = 0;
+  uint16_t lo = UINT16_MAX, hi = 0;
+  for (size_t i = 0; i < n; i++) {
+    s += p[i];
+    lo = std::min(lo, p[i]);
+    hi = std::max(hi, p[i]);
+  }
+  sum = s;
+  mn = lo;
+  mx = hi;
+}
+
+#ifdef CYTIF_X86
+
+__attribute__((target("avx2")))
+static void __sum_min_max_u16_avx2(const uint16_t* p, size_t n,
+				   uint64_t& sum, uint16_t& mn, uint16_t& mx) {
+
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i vmin = _mm256_set1_epi16(-1);
+  __m256i vmax = zero;
+  __m256i acc64 = zero;
+
+  size_t i = 0;
+  const size_t nv = n / 16;
+  
+  // 32-bit lane sums can take 2^15 vectors of 16-bit values before
+  // they could overflow, so fold into 64-bit lanes once per block
+  const size_t block = 1 << 15;
+  for (size_t b = 0; b < nv; b += block) {
+    __m256i acc32 = zero;
+    const size_t e = std::min(nv, b + block);
+    for (size_t v = b; v < e; v++, i += 16) {
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+      vmin = _mm256_min_epu16(vmin, x);
+      vmax = _mm256_max_epu16(vmax, x);
+      acc32 = _mm256_add_epi32(acc32, _mm256_unpacklo_epi16(x, zero));
+      acc32 = _mm256_add_epi32(acc32, _mm256_unpackhi_epi16(x, zero));
+    }
+    acc64 = _mm256_add_epi64(acc64, _mm256_unpacklo_epi32(acc32, zero));
+    acc64 = _mm256_add_epi64(acc64, _mm256_unpackhi_epi32(acc32, zero));
+  }
+
+  alignas(32) uint64_t s4[4];
+  alignas(32) uint16_t lo16[16], hi16[16];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(s4), acc64);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lo16), vmin);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(hi16), vmax);
+
+  uint64_t s = s4[0] + s4[1] + s4[2] + s4[3];
+  uint16_t lo = UINT16_MAX, hi = 0;
+  for (int k = 0; k < 16; k++) {
+    lo = std::min(lo, lo16[k]);
+    hi = std::max(hi, hi16[k]);
+  }
+
+  // remainder
+  for (; i < n; i++) {
+    s += p[i];
+    lo = std::min(lo, p[i]);
+    hi = std::max(hi, p[i]);
+  }
+
+  sum = s;
+  mn = lo;
+  mx = hi;
+}
+
+__attribute__((target("sse4.1")))
+static void __sum_min_max_u16_sse41(const uint16_t* p, size_t n,
+				    uint64_t& sum, uint16_t& mn, uint16_t& mx) {
+
+  const __m128i zero = _mm_setzero_si128();
+  __m128i vmin = _mm_set1_epi16(-1);
+  __m128i vmax = zero;
+  __m128i acc64 = zero;
+
+  size_t i = 0;
+  const size_t nv = n / 8;
+  const size_t block = 1 << 15;
+  for (size_t b = 0; b < nv; b += block) {
+    __m128i acc32 = zero;
+    const size_t e = std::min(nv, b + block);
+    for (size_t v = b; v < e; v++, i += 8) {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      vmin = _mm_min_epu16(vmin, x);
+      vmax = _mm_max_epu16(vmax, x);
+      acc32 = _mm_add_epi32(acc32, _mm_unpacklo_epi16(x, zero));
+      acc32 = _mm_add_epi32(acc32, _mm_unpackhi_epi16(x, zero));
+    }
+    acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(acc32, zero));
+    acc64 = _mm_add_epi64(acc64, _mm_unpackhi_epi32(acc32, zero));
+  }
+
+  alignas(16) uint64_t s2[2];
+  alignas(16) uint16_t lo8[8], hi8[8];
+  _mm_store_si128(reinterpret_cast<__m128i*>(s2), acc64);
+  _mm_store_si128(reinterpret_cast<__m128i*>(lo8), vmin);
+  _mm_store_si128(reinterpret_cast<__m128i*>(hi8), vmax);
+
+  uint64_t s = s2[0] + s2[1];
+  uint16_t lo = UINT16_MAX, hi = 0;
+  for (int k = 0; k < 8; k++) {
+    lo = std::min(lo, lo8[k]);
+    hi = std::max(hi, hi8[k]);
+  }
+
+  for (; i < n; i++) {
+    s += p[i];
+    lo = std::min(lo, p[i]);
+    hi = std::max(hi, p[i]);
+  }
+
+  sum = s;
+  mn = lo;
+  mx = hi;
+}
+
+#endif
+
+void SumMinMaxU16(const uint16_t* p, size_t n,
+		  uint64_t& sum, uint16_t& mn, uint16_t& mx) {
+#ifdef CYTIF_X86
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  static const bool has_sse41 = __builtin_cpu_supports("sse4.1");
+  if (has_avx2)
+    return __sum_min_max_u16_avx2(p, n, sum, mn, mx);
+  if (has_sse41)
+    return __sum_min_max_u16_sse41(p, n, sum, mn, mx);
+#endif
+  __sum_min_max_u16_scalar(p, n, sum, mn, mx);
+}
+
+/////////
+// TileSummaryU16
+/////////
+
+void TileSummaryU16(const uint16_t* p, size_t n, double q_lo, double q_hi,
+		    uint32_t* hist, uint64_t& sum,
+		    uint16_t& v_lo, uint16_t& v_hi) {
+
+  uint16_t mn, mx;
+  SumMinMaxU16(p, n, sum, mn, mx);
+
+  if (n == 0) {
+    v_lo = v_hi = 0;
+    return;
+  }
+  
+  // counting pass. Two interleaved sub-histograms would halve the
+  // store-to-load stalls on runs of equal values, but cost a second
+  // 256KB buffer per thread, which is not worth it on tile-sized input
+  for (size_t i = 0; i < n; i++)
+    hist[p[i]]++;
+
+  // ranks of the two quantiles, as indices into the sorted values
+  const uint64_t k_lo = std::min<uint64_t>(static_cast<uint64_t>(q_lo * n), n - 1);
+  const uint64_t k_hi = std::min<uint64_t>(static_cast<uint64_t>(q_hi * n), n - 1);
+
+  // only [mn, mx] can be non-zero, so that is all that is scanned
+  // and all that has to be cleared afterwards
+  uint64_t cum = 0;
+  bool got_lo = false;
+  v_lo = v_hi = mx;
+  for (uint32_t v = mn; v <= mx; v++) {
+    cum += hist[v];
+    if (!got_lo && cum > k_lo) {
+      v_lo = v;
+      got_lo = true;
+    }
+    if (cum > k_hi) {
+      v_hi = v;
+      break;
+    }
+  }
+
+  std::memset(hist + mn, 0, (static_cast<size_t>(mx) - mn + 1) * sizeof(uint32_t));
+}
+
+/////////
+// ColorizeU16
+/////////
+
+// pixels per pass, so the level and accumulator buffers stay in L1
+#define COLORIZE_BLOCK 2048
+
+// acc[0..n) += level * c, saturating at UINT16_MAX. The clamp in
+// ColorizeU16 is below that, so saturating early changes nothing
+static void __accumulate_scalar(const uint8_t* level, uint16_t c, size_t n, uint16_t* acc) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t v = acc[i] + static_cast<uint32_t>(level[i]) * c;
+    acc[i] = v > UINT16_MAX ? UINT16_MAX : v;
+  }
+}
+
+// x = min(x, 255 * 255) / 255, with the division done as
+// (x + 1 + (x >> 8)) >> 8, which is exact over that range
+static void __clamp_div255_scalar(uint16_t* acc, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t x = std::min<uint32_t>(acc[i], 255 * 255);
+    acc[i] = (x + 1 + (x >> 8)) >> 8;
+  }
+}
+
+#ifdef CYTIF_X86
+
+__attribute__((target("avx2")))
+static void __accumulate_avx2(const uint8_t* level, uint16_t c, size_t n, uint16_t* acc) {
+  const __m256i vc = _mm256_set1_epi16(c);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i l = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(level + i)));
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+    a = _mm256_adds_epu16(a, _mm256_mullo_epi16(l, vc));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), a);
+  }
+  __accumulate_scalar(level + i, c, n - i, acc + i);
+}
+
+__attribute__((target("avx2")))
+static void __clamp_div255_avx2(uint16_t* acc, size_t n) {
+  const __m256i cap = _mm256_set1_epi16(255 * 255);
+  const __m256i one = _mm256_set1_epi16(1);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+    x = _mm256_min_epu16(x, cap);
+    // x + 1 + (x >> 8) stays below 2^16 for x <= 65025
+    x = _mm256_add_epi16(_mm256_add_epi16(x, one), _mm256_srli_epi16(x, 8));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), _mm256_srli_epi16(x, 8));
+  }
+  __clamp_div255_scalar(acc + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void __accumulate_sse41(const uint8_t* level, uint16_t c, size_t n, uint16_t* acc) {
+  const __m128i vc = _mm_set1_epi16(c);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i l = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(level + i)));
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+    a = _mm_adds_epu16(a, _mm_mullo_epi16(l, vc));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), a);
+  }
+  __accumulate_scalar(level + i, c, n - i, acc + i);
+}
+
+__attribute__((target("sse4.1")))
+static void __clamp_div255_sse41(uint16_t* acc, size_t n) {
+  const __m128i cap = _mm_set1_epi16(255 * 255);
+  const __m128i one = _mm_set1_epi16(1);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+    x = _mm_min_epu16(x, cap);
+    x = _mm_add_epi16(_mm_add_epi16(x, one), _mm_srli_epi16(x, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), _mm_srli_epi16(x, 8));
+  }
+  __clamp_div255_scalar(acc + i, n - i);
+}
+
+#endif
+
+void ColorizeU16(const uint16_t* const* src, const std::vector<ChannelLUT>& luts,
+		 size_t n, uint8_t* rgb, ColorizeScratch& scratch) {
+
+  auto accumulate = __accumulate_scalar;
+  auto clamp_div255 = __clamp_div255_scalar;
+#ifdef CYTIF_X86
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  static const bool has_sse41 = __builtin_cpu_supports("sse4.1");
+  if (has_avx2) {
+    accumulate = __accumulate_avx2;
+    clamp_div255 = __clamp_div255_avx2;
+  } else if (has_sse41) {
+    accumulate = __accumulate_sse41;
+    clamp_div255 = __clamp_div255_sse41;
+  }
+#endif
+  
+  scratch.level.resize(COLORIZE_BLOCK);
+  scratch.acc.resize(3 * COLORIZE_BLOCK);
+  uint8_t* level = scratch.level.data();
+  uint16_t* acc_r = scratch.acc.data();
+  uint16_t* acc_g = acc_r + COLORIZE_BLOCK;
+  uint16_t* acc_b = acc_g + COLORIZE_BLOCK;
+  
+  for (size_t i0 = 0; i0 < n; i0 += COLORIZE_BLOCK) {
+    const size_t m = std::min<size_t>(COLORIZE_BLOCK, n - i0);
+    std::memset(acc_r, 0, 3 * COLORIZE_BLOCK * sizeof(uint16_t));
+
+    for (size_t k = 0; k < luts.size(); k++) {
+
+      // the table lookup is a gather, which does not vectorize well, so
+      // it is done once into a byte buffer and the rest runs in SIMD
+      const uint16_t* s = src[k] + i0;
+      const uint8_t* lut = luts[k].level.data();
+      for (size_t i = 0; i < m; i++)
+	level[i] = lut[s[i]];
+
+      if (luts[k].r)
+	accumulate(level, luts[k].r, m, acc_r);
+      if (luts[k].g)
+	accumulate(level, luts[k].g, m, acc_g);
+      if (luts[k].b)
+	accumulate(level, luts[k].b, m, acc_b);
+    }
+
+    clamp_div255(acc_r, m);
+    clamp_div255(acc_g, m);
+    clamp_div255(acc_b, m);
+    
+    uint8_t* o = rgb + 3 * i0;
+    for (size_t i = 0; i < m; i++) {
+      o[3*i    ] = acc_r[i];
+      o[3*i + 1] = acc_g[i];
+      o[3*i + 2] = acc_b[i];
+    }
+  }
+}
+
+/////////
+// InterleavePlanes
+/////////
+
+template <typename T>
+static void __interleave_scalar(const uint8_t* const* planes, size_t num_planes,
+				size_t i0, size_t n, uint8_t* dst) {
+  T* o = reinterpret_cast<T*>(dst);
+  for (size_t k = 0; k < num_planes; k++) {
+    const T* p = reinterpret_cast<const T*>(planes[k]);
+    for (size_t i = i0; i < n; i++)
+      o[i * num_planes + k] = p[i];
+  }
+}
+
+static void __interleave_scalar_any(const uint8_t* const* planes, size_t num_planes,
+				    size_t i0, size_t n, size_t bytes, uint8_t* dst) {
+  switch (bytes) {
+  case 1 : __interleave_scalar<uint8_t>(planes, num_planes, i0, n, dst); break;
+  case 2 : __interleave_scalar<uint16_t>(planes, num_planes, i0, n, dst); break;
+  case 4 : __interleave_scalar<uint32_t>(planes, num_planes, i0, n, dst); break;
+  default :
+    for (size_t i = i0; i < n; i++)
+      for (size_t k = 0; k < num_planes; k++)
+	std::memcpy(dst + (i * num_planes + k) * bytes, planes[k] + i * bytes, bytes);
+  }
+}
+
+#ifdef CYTIF_X86
+
+// Byte shuffles that interleave NP 16-byte blocks, one from each plane,
+// into NP 16-byte output blocks: output block j is the OR over planes k
+// of pshufb(plane k, mask[j][k]). A mask byte picks the plane byte that
+// lands there, or is 0x80 (zero) where another plane's byte goes
+struct InterleaveMasks {
+  alignas(16) uint8_t m[4][4][16];
+};
+
+static InterleaveMasks __interleave_masks(int np, int bytes) {
+  InterleaveMasks im;
+  for (int j = 0; j < np; j++)
+    for (int k = 0; k < np; k++)
+      for (int p = 0; p < 16; p++) {
+	const int q = 16 * j + p;          // byte of the output
+	const int pixel = q / (np * bytes);
+	const int plane = (q / bytes) % np;
+	im.m[j][k][p] = plane == k ? pixel * bytes + q % bytes : 0x80;
+      }
+  return im;
+}
+
+// masks for np planes (2-4) of 1 or 2 byte samples
+static const InterleaveMasks& __masks(int np, int bytes) {
+  static const InterleaveMasks table[3][2] = {
+    { __interleave_masks(2, 1), __interleave_masks(2, 2) },
+    { __interleave_masks(3, 1), __interleave_masks(3, 2) },
+    { __interleave_masks(4, 1), __interleave_masks(4, 2) } };
+  return table[np - 2][bytes - 1];
+}
+
+// the first multiple of 16 bytes of each plane, of len bytes in all.
+// Returns the bytes per plane done
+template <int NP>
+__attribute__((target("ssse3")))
+static size_t __interleave_ssse3(const uint8_t* const* planes, size_t len,
+				 const InterleaveMasks& im, uint8_t* dst) {
+  __m128i m[NP][NP];
+  for (int j = 0; j < NP; j++)
+    for (int k = 0; k < NP; k++)
+      m[j][k] = _mm_load_si128(reinterpret_cast<const __m128i*>(im.m[j][k]));
+
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i s[NP];
+    for (int k = 0; k < NP; k++)
+      s[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[k] + i));
+    for (int j = 0; j < NP; j++) {
+      __m128i o = _mm_shuffle_epi8(s[0], m[j][0]);
+      for (int k = 1; k < NP; k++)
+	o = _mm_or_si128(o, _mm_shuffle_epi8(s[k], m[j][k]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * NP + 16 * j), o);
+    }
+  }
+  return i;
+}
+
+// same, 32 bytes of each plane at a time. pshufb works within each
+// 128-bit lane, so the low lanes make the first NP output blocks and
+// the high lanes the next NP
+template <int NP>
+__attribute__((target("avx2")))
+static size_t __interleave_avx2(const uint8_t* const* planes, size_t len,
+				const InterleaveMasks& im, uint8_t* dst) {
+  __m256i m[NP][NP];
+  for (int j = 0; j < NP; j++)
+    for (int k = 0; k < NP; k++)
+      m[j][k] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(im.m[j][k])));
+
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i s[NP];
+    for (int k = 0; k < NP; k++)
+      s[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planes[k] + i));
+    uint8_t* o0 = dst + i * NP;
+    uint8_t* o1 = o0 + 16 * NP;
+    for (int j = 0; j < NP; j++) {
+      __m256i o = _mm256_shuffle_epi8(s[0], m[j][0]);
+      for (int k = 1; k < NP; k++)
+	o = _mm256_or_si256(o, _mm256_shuffle_epi8(s[k], m[j][k]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(o0 + 16 * j), _mm256_castsi256_si128(o));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(o1 + 16 * j), _mm256_extracti128_si256(o, 1));
+    }
+  }
+  return i;
+}
+
+#endif
+
+void InterleavePlanes(const uint8_t* const* planes, size_t num_planes, size_t n,
+		      size_t bytes, uint8_t* dst) {
+
+  if (num_planes == 1) {
+    std::memcpy(dst, planes[0], n * bytes);
+    return;
+  }
+  
+  size_t done = 0;
+#ifdef CYTIF_X86
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  static const bool has_ssse3 = __builtin_cpu_supports("ssse3");
+  if (num_planes <= 4 && (bytes == 1 || bytes == 2) && (has_avx2 || has_ssse3)) {
+    const InterleaveMasks& im = __masks(num_planes, bytes);
+    const size_t len = n * bytes;
+    switch (num_planes) {
+    case 2 : done = has_avx2 ? __interleave_avx2<2>(planes, len, im, dst) : __interleave_ssse3<2>(planes, len, im, dst); break;
+    case 3 : done = has_avx2 ? __interleave_avx2<3>(planes, len, im, dst) : __interleave_ssse3<3>(planes, len, im, dst); break;
+    case 4 : done = has_avx2 ? __interleave_avx2<4>(planes, len, im, dst) : __interleave_ssse3<4>(planes, len, im, dst); break;
+    }
+    done /= bytes;
+  }
+#endif
+  __interleave_scalar_any(planes, num_planes, done, n, bytes, dst);
+}
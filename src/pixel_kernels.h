@@ -0,0 +1,58 @@
+#ifndef PIXEL_KERNELS_H
+#define PIXEL_KERNELS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Tight inner loops over tile buffers. Each kernel has a scalar
+// version, and on x86 an SSE4.1 and/or AVX2 version that is picked
+// at runtime from what the CPU supports, so the Makefile does not
+// need any -march flags
+
+// sum, min and max of n uint16 values
+void SumMinMaxU16(const uint16_t* p, size_t n,
+		  uint64_t& sum, uint16_t& mn, uint16_t& mx);
+
+// number of bins needed by TileSummaryU16
+#define U16_HIST_BINS 65536
+
+// One pass summary of a 16-bit tile: the sum, and the values at two
+// quantiles (0-1), with the same convention as sorting the values and
+// taking element floor(q * n). `hist` is U16_HIST_BINS of scratch
+// that must be all zero going in, and is left all zero coming out,
+// so one buffer can be reused for every tile a thread sees
+void TileSummaryU16(const uint16_t* p, size_t n, double q_lo, double q_hi,
+		    uint32_t* hist, uint64_t& sum,
+		    uint16_t& v_lo, uint16_t& v_hi);
+
+// Colorize lookup for one channel. level[v] is the 0-255 display level
+// of raw value v after windowing, and r, g, b is the channel colour that
+// level is scaled by. Keeping the table at 8 bits (64KB) rather than
+// storing the three products lets 8+ channels sit in L2 together
+struct ChannelLUT {
+  std::vector<uint8_t> level;
+  uint16_t r = 0, g = 0, b = 0;
+};
+
+// per-thread buffers for ColorizeU16, reused between calls
+struct ColorizeScratch {
+  std::vector<uint8_t> level;
+  std::vector<uint16_t> acc;
+};
+
+// Blend n pixels of luts.size() channels into interleaved 8-bit RGB.
+// src[k] is the n values of channel k. Each output component is
+// min(sum_k level_k * colour_k, 255 * 255) / 255, which is what the
+// per-pixel combineChannelsToRGB computes
+void ColorizeU16(const uint16_t* const* src, const std::vector<ChannelLUT>& luts,
+		 size_t n, uint8_t* rgb, ColorizeScratch& scratch);
+
+// Interleave n pixels from num_planes planes of `bytes`-byte samples
+// into dst, so that pixel i of dst is sample i of each plane in turn
+// (e.g. three 8-bit planes into RGB). 2 to 4 planes of 8 or 16-bit
+// samples go through byte shuffles, anything else through a plain loop
+void InterleavePlanes(const uint8_t* const* planes, size_t num_planes, size_t n,
+		      size_t bytes, uint8_t* dst);
+
+#endif
@@ -758,7 +758,7 @@ int tiffcpjw(TIFF* in, TIFF* out) {
     
     // copy other
     uint32_t subfile_type = 0, osubfile_type;
-    uint8_t thresholding = 0;
+    uint16_t thresholding = 0;
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_SUBFILETYPE, subfile_type);
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_OSUBFILETYPE, osubfile_type);
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_THRESHHOLDING, thresholding);    
@@ -768,17 +768,17 @@ int tiffcpjw(TIFF* in, TIFF* out) {
     COPY_TIFF_TAG_ASCII_QUIET(in, out, TIFFTAG_IMAGEDESCRIPTION, des_buffer);
     
     // compression
-    uint8_t compression = 0;
+    uint16_t compression = 0;
     COPY_TIFF_TAG(in, out, TIFFTAG_COMPRESSION, compression);
 
     // fill order
-    uint8_t fillorder = 0;
+    uint16_t fillorder = 0;
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_FILLORDER, fillorder);
 
     // cell width and length (probably not used)
     //The width of the dithering or halftoning matrix used to create a dithered or halftoned bilevel file.
     //This field should only be present if Threshholding = 2
-    uint8_t cell_width = 0, cell_length = 0;
+    uint16_t cell_width = 0, cell_length = 0;
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_CELLWIDTH, cell_width);
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_CELLLENGTH, cell_length);    
 
@@ -794,7 +794,7 @@ int tiffcpjw(TIFF* in, TIFF* out) {
     //COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_MAXSAMPLEVALUE, max_sample_value);
 
     // gray response curve (the precision of the info in the GrayResponseCurve)
-    uint8_t gray_response_unit = 0;
+    uint16_t gray_response_unit = 0;
     COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_GRAYRESPONSEUNIT, gray_response_unit);
     // missing GRAYRESPONSECURVE
 
@@ -0,0 +1,269 @@
+#include "tiff_encoder.h"
+
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+
+// an in-memory file for TIFFClientOpen
+struct MemFile {
+  std::vector<uint8_t> data;
+  uint64_t pos = 0;
+};
+
+static tmsize_t __mem_read(thandle_t h, void* buf, tmsize_t size) {
+  MemFile* f = static_cast<MemFile*>(h);
+  if (f->pos >= f->data.size())
+    return 0;
+  tmsize_t n = std::min<uint64_t>(size, f->data.size() - f->pos);
+  std::memcpy(buf, f->data.data() + f->pos, n);
+  f->pos += n;
+  return n;
+}
+
+static tmsize_t __mem_write(thandle_t h, void* buf, tmsize_t size) {
+  MemFile* f = static_cast<MemFile*>(h);
+  if (f->pos + size > f->data.size())
+    f->data.resize(f->pos + size);
+  std::memcpy(f->data.data() + f->pos, buf, size);
+  f->pos += size;
+  return size;
+}
+
+static toff_t __mem_seek(thandle_t h, toff_t off, int whence) {
+  MemFile* f = static_cast<MemFile*>(h);
+  switch (whence) {
+  case SEEK_SET : f->pos = off; break;
+  case SEEK_CUR : f->pos += off; break;
+  case SEEK_END : f->pos = f->data.size() + off; break;
+  }
+  return f->pos;
+}
+
+static int __mem_close(thandle_t) { return 0; }
+
+static toff_t __mem_size(thandle_t h) {
+  return static_cast<MemFile*>(h)->data.size();
+}
+
+static int __mem_map(thandle_t, void**, toff_t*) { return 0; }
+
+static void __mem_unmap(thandle_t, void*, toff_t) {}
+
+int ParseCodec(const std::string& name, uint16_t& compression) {
+
+  if (name == "none")
+    compression = COMPRESSION_NONE;
+  else if (name == "lzw")
+    compression = COMPRESSION_LZW;
+  else if (name == "deflate" || name == "zip")
+    compression = COMPRESSION_ADOBE_DEFLATE;
+  else if (name == "zstd")
+    compression = COMPRESSION_ZSTD;
+  else {
+    fprintf(stderr, "Error: unknown codec %s, use none, lzw, deflate or zstd\n", name.c_str());
+    return 1;
+  }
+
+  if (!TIFFIsCODECConfigured(compression)) {
+    fprintf(stderr, "Error: this libtiff was built without %s\n", name.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+std::string CodecName(uint16_t compression) {
+
+  switch (compression) {
+  case COMPRESSION_NONE : return "none";
+  case COMPRESSION_LZW : return "lzw";
+  case COMPRESSION_DEFLATE :
+  case COMPRESSION_ADOBE_DEFLATE : return "deflate";
+  case COMPRESSION_ZSTD : return "zstd";
+  case COMPRESSION_JPEG : return "jpeg";
+  }
+  return std::to_string(compression);
+}
+
+int SetCodec(TIFF* out, const CodecOptions& c) {
+
+  if (c.compression && !TIFFSetField(out, TIFFTAG_COMPRESSION, c.compression)) {
+    fprintf(stderr, "Error: unable to set compression %d\n", c.compression);
+    return 1;
+  }
+  uint16_t compression = COMPRESSION_NONE;
+  TIFFGetFieldDefaulted(out, TIFFTAG_COMPRESSION, &compression);
+
+  const bool deflate = compression == COMPRESSION_ADOBE_DEFLATE ||
+    compression == COMPRESSION_DEFLATE;
+  if (c.level >= 0) {
+    int ok = 1;
+    if (deflate)
+      ok = TIFFSetField(out, TIFFTAG_ZIPQUALITY, c.level);
+    else if (compression == COMPRESSION_ZSTD)
+      ok = TIFFSetField(out, TIFFTAG_ZSTD_LEVEL, c.level);
+    if (!ok) {
+      fprintf(stderr, "Error: unable to set codec level %d\n", c.level);
+      return 1;
+    }
+  }
+
+  if (c.predictor && (deflate || compression == COMPRESSION_LZW ||
+		      compression == COMPRESSION_ZSTD) &&
+      !TIFFSetField(out, TIFFTAG_PREDICTOR, c.predictor)) {
+    fprintf(stderr, "Error: unable to set predictor %d\n", c.predictor);
+    return 1;
+  }
+  return 0;
+}
+
+TiffTileEncoder::TiffTileEncoder(TIFF* out) {
+
+  if (!TIFFIsTiled(out))
+    return;
+  
+  TIFFGetField(out, TIFFTAG_TILEWIDTH, &m_tilewidth);
+  TIFFGetField(out, TIFFTAG_TILELENGTH, &m_tileheight);
+  TIFFGetFieldDefaulted(out, TIFFTAG_BITSPERSAMPLE, &m_bps);
+  TIFFGetFieldDefaulted(out, TIFFTAG_SAMPLESPERPIXEL, &m_spp);
+  TIFFGetField(out, TIFFTAG_PHOTOMETRIC, &m_photometric);
+  TIFFGetFieldDefaulted(out, TIFFTAG_PLANARCONFIG, &m_planar);
+  TIFFGetFieldDefaulted(out, TIFFTAG_COMPRESSION, &m_compression);
+  TIFFGetField(out, TIFFTAG_PREDICTOR, &m_predictor);
+  TIFFGetFieldDefaulted(out, TIFFTAG_SAMPLEFORMAT, &m_sampleformat);
+
+  // the level is a pseudo tag, that only the matching codec knows
+  if (m_compression == COMPRESSION_ADOBE_DEFLATE || m_compression == COMPRESSION_DEFLATE)
+    TIFFGetField(out, TIFFTAG_ZIPQUALITY, &m_level);
+  else if (m_compression == COMPRESSION_ZSTD)
+    TIFFGetField(out, TIFFTAG_ZSTD_LEVEL, &m_level);
+  m_bigendian = TIFFIsBigEndian(out);
+  
+  m_ok = m_compression != COMPRESSION_JPEG && m_compression != COMPRESSION_OJPEG &&
+    m_tilewidth && m_tileheight;
+}
+
+int TiffTileEncoder::encode(const void* tile, tmsize_t size, std::vector<uint8_t>& encoded) const {
+
+  // each thread keeps its memory file, so that once it has grown to
+  // the size of an encoded tile, encoding does not reallocate it
+  static thread_local MemFile f;
+  f.data.clear();
+  f.pos = 0;
+  TIFF* t = TIFFClientOpen("tile", m_bigendian ? "wb" : "wl", &f,
+			   __mem_read, __mem_write, __mem_seek, __mem_close,
+			   __mem_size, __mem_map, __mem_unmap);
+  if (t == NULL)
+    return 1;
+
+  // a one-tile image with the output's layout
+  TIFFSetField(t, TIFFTAG_IMAGEWIDTH, m_tilewidth);
+  TIFFSetField(t, TIFFTAG_IMAGELENGTH, m_tileheight);
+  TIFFSetField(t, TIFFTAG_TILEWIDTH, m_tilewidth);
+  TIFFSetField(t, TIFFTAG_TILELENGTH, m_tileheight);
+  TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, m_bps);
+  TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL, m_spp);
+  TIFFSetField(t, TIFFTAG_PHOTOMETRIC, m_photometric);
+  TIFFSetField(t, TIFFTAG_PLANARCONFIG, m_planar);
+  TIFFSetField(t, TIFFTAG_SAMPLEFORMAT, m_sampleformat);
+  TIFFSetField(t, TIFFTAG_COMPRESSION, m_compression);
+  if (m_predictor)
+    TIFFSetField(t, TIFFTAG_PREDICTOR, m_predictor);
+  if (m_level >= 0) {
+    if (m_compression == COMPRESSION_ZSTD)
+      TIFFSetField(t, TIFFTAG_ZSTD_LEVEL, m_level);
+    else
+      TIFFSetField(t, TIFFTAG_ZIPQUALITY, m_level);
+  }
+
+  int rc = 1;
+  if (TIFFWriteEncodedTile(t, 0, const_cast<void*>(tile), size) >= 0) {
+    const uint64_t off = TIFFGetStrileOffset(t, 0);
+    const uint64_t bc = TIFFGetStrileByteCount(t, 0);
+    if (off + bc <= f.data.size()) {
+      encoded.assign(f.data.begin() + off, f.data.begin() + off + bc);
+      rc = 0;
+    }
+  }
+
+  TIFFClose(t);
+  return rc;
+}
+
+int BenchCodec(TIFF* in, const std::vector<std::vector<uint8_t>>& tiles,
+	       const CodecOptions& c, CodecBench& result) {
+
+  result = CodecBench();
+  if (tiles.empty())
+    return 0;
+  
+  uint32_t tilewidth = 0, tileheight = 0;
+  uint16_t bps = 8, spp = 1, photometric = PHOTOMETRIC_MINISBLACK;
+  uint16_t planar = PLANARCONFIG_CONTIG, format = SAMPLEFORMAT_UINT;
+  TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth);
+  TIFFGetField(in, TIFFTAG_TILELENGTH, &tileheight);
+  TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bps);
+  TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &photometric);
+  TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG, &planar);
+  TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLEFORMAT, &format);
+  
+  // the tiles go one under the other in a single in-memory image
+  MemFile f;
+  TIFF* t = TIFFClientOpen("bench", "w", &f,
+			   __mem_read, __mem_write, __mem_seek, __mem_close,
+			   __mem_size, __mem_map, __mem_unmap);
+  if (t == NULL)
+    return 1;
+  TIFFSetField(t, TIFFTAG_IMAGEWIDTH, tilewidth);
+  TIFFSetField(t, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(tileheight * tiles.size()));
+  TIFFSetField(t, TIFFTAG_TILEWIDTH, tilewidth);
+  TIFFSetField(t, TIFFTAG_TILELENGTH, tileheight);
+  TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, bps);
+  TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL, spp);
+  TIFFSetField(t, TIFFTAG_PHOTOMETRIC, photometric);
+  TIFFSetField(t, TIFFTAG_PLANARCONFIG, planar);
+  TIFFSetField(t, TIFFTAG_SAMPLEFORMAT, format);
+  if (SetCodec(t, c)) {
+    TIFFClose(t);
+    return 1;
+  }
+
+  const tmsize_t ts = TIFFTileSize(t);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tiles.size(); i++) {
+    if (static_cast<tmsize_t>(tiles[i].size()) != ts ||
+	TIFFWriteEncodedTile(t, i, const_cast<uint8_t*>(tiles[i].data()), ts) < 0) {
+      TIFFClose(t);
+      return 1;
+    }
+  }
+  result.encode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (size_t i = 0; i < tiles.size(); i++)
+    result.encoded_bytes += TIFFGetStrileByteCount(t, i);
+  result.raw_bytes = ts * tiles.size();
+  TIFFClose(t);
+
+  // and read it back
+  f.pos = 0;
+  t = TIFFClientOpen("bench", "r", &f,
+		     __mem_read, __mem_write, __mem_seek, __mem_close,
+		     __mem_size, __mem_map, __mem_unmap);
+  if (t == NULL)
+    return 1;
+  std::vector<uint8_t> tile(ts);
+  int rc = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < tiles.size() && !rc; i++)
+    if (TIFFReadEncodedTile(t, i, tile.data(), ts) != ts)
+      rc = 1;
+  result.decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  TIFFClose(t);
+
+  // a codec that does not round trip is no use, whatever its speed
+  if (!rc && tiles.back() != tile) {
+    fprintf(stderr, "Error: %s does not round trip\n", CodecName(c.compression).c_str());
+    rc = 1;
+  }
+  return rc;
+}
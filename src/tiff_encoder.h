@@ -0,0 +1,84 @@
+#ifndef TIFF_ENCODER_H
+#define TIFF_ENCODER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <tiffio.h>
+
+// output codec settings, e.g. from --codec, --codec-level and --predictor.
+// The defaults leave each setting to whatever the module would write
+struct CodecOptions {
+  uint16_t compression = 0;  // a COMPRESSION_ value, 0 to keep
+  int level = -1;            // -1 is the codec's own default
+  uint16_t predictor = 0;    // 0 leaves the tag unset
+};
+
+// turn a codec name (none, lzw, deflate, zstd) into its COMPRESSION_
+// value. Returns non-zero if the name is unknown or libtiff was built
+// without the codec
+int ParseCodec(const std::string& name, uint16_t& compression);
+
+// name of a COMPRESSION_ value, for printing
+std::string CodecName(uint16_t compression);
+
+// set the compression, level and predictor of c on out. The level and
+// predictor apply to whichever codec out ends up with, and are only
+// set for the codecs that take them. Returns non-zero on error
+int SetCodec(TIFF* out, const CodecOptions& c);
+
+// size and speed of one codec setting on a set of tiles
+struct CodecBench {
+  uint64_t raw_bytes = 0;
+  uint64_t encoded_bytes = 0;
+  double encode_seconds = 0;
+  double decode_seconds = 0;
+};
+
+// encode and then decode tiles (each a full decoded tile in the layout
+// of the current directory of in) in memory with codec c, and time
+// both. The round trip is checked. Returns non-zero on error
+int BenchCodec(TIFF* in, const std::vector<std::vector<uint8_t>>& tiles,
+	       const CodecOptions& c, CodecBench& result);
+
+// Compresses single tiles off the output handle, so that encoding can
+// run on worker threads and the one thread that owns the output TIFF*
+// only has to append the bytes with TIFFWriteRawTile. Each call runs
+// libtiff's own codec on a throwaway in-memory TIFF that carries the
+// same tile layout and compression settings as the output, so the
+// bytes are exactly what TIFFWriteEncodedTile on the output would store.
+// One encoder is safe to use from several threads at once
+class TiffTileEncoder {
+
+ public:
+
+  // take the tile layout and codec settings from out, which must
+  // already have its fields set
+  explicit TiffTileEncoder(TIFF* out);
+
+  // false if the output settings can not be reproduced tile by tile
+  // (JPEG, whose tiles depend on tables stored in the directory)
+  bool ok() const { return m_ok; }
+  
+  // compress one full tile of size bytes into encoded. 0 on success
+  int encode(const void* tile, tmsize_t size, std::vector<uint8_t>& encoded) const;
+  
+ private:
+
+  uint32_t m_tilewidth = 0;
+  uint32_t m_tileheight = 0;
+  uint16_t m_bps = 0;
+  uint16_t m_spp = 1;
+  uint16_t m_photometric = 0;
+  uint16_t m_planar = PLANARCONFIG_CONTIG;
+  uint16_t m_compression = COMPRESSION_NONE;
+  uint16_t m_predictor = 0;
+  int m_level = -1;
+  uint16_t m_sampleformat = SAMPLEFORMAT_UINT;
+  bool m_bigendian = false;
+
+  bool m_ok = false;
+  
+};
+
+#endif
@@ -1,4 +1,18 @@
 #include "tiff_header.h"
+#include "tiff_encoder.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <sstream>
+#include <cstdio>
+#include <tiff.h>
+
+// more IFDs than this in the chain is taken to be a loop or a bad file
+#define MAX_IFDS 1000000
+
+// sanity limits for a single IFD, past which the file is corrupt
+#define MAX_IFD_ENTRIES 4096
+#define MAX_TAG_BYTES (256UL << 20)
 
 TiffHeader::TiffHeader(const char* c) {
 
@@ -17,7 +31,7 @@ int TiffHeader::__construct_header() {
   
   // messing around with the tiff header
   std::ifstream inputFile;
-  inputFile.open(m_filename.c_str());
+  inputFile.open(m_filename.c_str(), std::ios::binary);
   
   // check that file is open
   if (!inputFile.is_open()) {
@@ -26,7 +40,7 @@ int TiffHeader::__construct_header() {
   }
 
   // allocate the buffe
-  m_data.reset(new char[HEADER_BUFF]);
+  m_data.reset(new char[HEADER_BUFF]());
   //  m_data = std::make_unique<char[]>(HEADER_BUFF);
   
   //m_data = std::unique_ptr<char[]> = new char[1024];
@@ -34,25 +48,46 @@ int TiffHeader::__construct_header() {
   // stream in the header
   inputFile.read(m_data.get(), HEADER_BUFF);
 
+  // make sure endianness is specified, everything after it
+  // is in that byte order
+  if (__endianess_error_check())
+    return 1;
+  m_big_endian = std::equal(_big, _big + 2, m_data.get());
+
   // get the tiff id
-  memcpy(&m_tid, m_data.get() + 2, sizeof(uint16_t));
+  m_tid = __u16(reinterpret_cast<const uint8_t*>(m_data.get()) + 2);
 
   // set the offsets
-  __get_offsets();
-
-  // make sure endianness is specified
-  __endianess_error_check();
+  if (__get_offsets())
+    return 1;
 
   // check that the bigTiff main 8 byte header is properly formatted
-  if (m_tid == 43)
-    __big_tiff_error_check();
+  if (m_tid == 43 && __big_tiff_error_check())
+    return 1;
   
   // close the file
   inputFile.close();
 
+  m_ok = true;
   return 0;
 }
 
+uint16_t TiffHeader::__u16(const uint8_t* p) const {
+  return m_big_endian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+uint32_t TiffHeader::__u32(const uint8_t* p) const {
+  return m_big_endian ?
+    (uint32_t(__u16(p)) << 16) | __u16(p + 2) :
+    __u16(p) | (uint32_t(__u16(p + 2)) << 16);
+}
+
+uint64_t TiffHeader::__u64(const uint8_t* p) const {
+  return m_big_endian ?
+    (uint64_t(__u32(p)) << 32) | __u32(p + 4) :
+    __u32(p) | (uint64_t(__u32(p + 4)) << 32);
+}
+
 // get the offsets using a header
 int TiffHeader::__get_offsets() {
 
@@ -72,7 +107,8 @@ int TiffHeader::__get_offsets() {
     return 1;
   }
   
-  memcpy(&m_first_offset, m_data.get() + m_offset_start, m_offset_len);
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(m_data.get()) + m_offset_start;
+  m_first_offset = m_offset_len == 4 ? __u32(p) : __u64(p);
   return 0;
 }
 
@@ -80,8 +116,7 @@ int TiffHeader::__get_offsets() {
 int TiffHeader::__big_tiff_error_check() const {
   
   // ensure that for bigtiff that bytes with offset 6-7 are 0
-  uint16_t _zero;
-  memcpy(&_zero, m_data.get() + 6, sizeof(uint16_t));
+  uint16_t _zero = __u16(reinterpret_cast<const uint8_t*>(m_data.get()) + 6);
   if (_zero) {
     std::cerr << "ERROR: Improperly formatted BigTIFF: Offsets 6-7 should be zero. They are: " << _zero << std::endl;
     return 1;
@@ -121,3 +156,371 @@ void TiffHeader::view_stdout() const {
   
   return;
 }
+
+int TiffHeader::__entry_values(std::ifstream& in, const uint8_t* e,
+			       std::vector<uint64_t>& values, std::string* str) const {
+
+  const uint16_t type = __u16(e + 2);
+  const uint64_t count = BigTiff() ? __u64(e + 4) : __u32(e + 4);
+  const uint8_t* field = e + (BigTiff() ? 12 : 8);
+  const size_t field_len = BigTiff() ? 8 : 4;
+
+  values.clear();
+  
+  size_t size = 0;
+  switch (type) {
+  case TIFF_BYTE : case TIFF_ASCII : case TIFF_SBYTE : case TIFF_UNDEFINED : size = 1; break;
+  case TIFF_SHORT : case TIFF_SSHORT : size = 2; break;
+  case TIFF_LONG : case TIFF_SLONG : case TIFF_IFD : size = 4; break;
+  case TIFF_LONG8 : case TIFF_SLONG8 : case TIFF_IFD8 : size = 8; break;
+  default : return 0; // rationals and floats, none of which are used here
+  }
+  
+  if (count > MAX_TAG_BYTES / size) {
+    std::cerr << "ERROR: tag " << __u16(e) << " has " << count << " values" << std::endl;
+    return 1;
+  }
+
+  // values that fit are stored in the entry itself, else it
+  // holds the offset to them
+  const uint64_t bytes = count * size;
+  std::vector<uint8_t> buf;
+  const uint8_t* p = field;
+  if (bytes > field_len) {
+    buf.resize(bytes);
+    in.clear();
+    in.seekg(field_len == 4 ? __u32(field) : __u64(field));
+    if (!in.read(reinterpret_cast<char*>(buf.data()), bytes)) {
+      std::cerr << "ERROR: unable to read the values of tag " << __u16(e) << std::endl;
+      return 1;
+    }
+    p = buf.data();
+  }
+
+  if (str) {
+    str->assign(reinterpret_cast<const char*>(p), bytes);
+    str->erase(str->find_last_not_of('\0') + 1);
+    return 0;
+  }
+  
+  values.resize(count);
+  for (uint64_t i = 0; i < count; i++) {
+    switch (size) {
+    case 1 : values[i] = p[i]; break;
+    case 2 : values[i] = __u16(p + 2 * i); break;
+    case 4 : values[i] = __u32(p + 4 * i); break;
+    case 8 : values[i] = __u64(p + 8 * i); break;
+    }
+  }
+  return 0;
+}
+
+int TiffHeader::__read_ifd(std::ifstream& in, uint64_t off, HeaderIFD& ifd,
+			   uint64_t& next, bool description) const {
+
+  const size_t count_len = BigTiff() ? 8 : 2;
+  const size_t entry_len = BigTiff() ? 20 : 12;
+  const size_t next_len = BigTiff() ? 8 : 4;
+
+  uint8_t b[8];
+  in.clear();
+  in.seekg(off);
+  if (!in.read(reinterpret_cast<char*>(b), count_len)) {
+    std::cerr << "ERROR: unable to read IFD at offset " << off << std::endl;
+    return 1;
+  }
+  const uint64_t n = BigTiff() ? __u64(b) : __u16(b);
+  if (n == 0 || n > MAX_IFD_ENTRIES) {
+    std::cerr << "ERROR: IFD at offset " << off << " has " << n << " entries" << std::endl;
+    return 1;
+  }
+
+  // the entries and the offset of the next IFD, in one read
+  std::vector<uint8_t> entries(n * entry_len + next_len);
+  if (!in.read(reinterpret_cast<char*>(entries.data()), entries.size())) {
+    std::cerr << "ERROR: unable to read IFD at offset " << off << std::endl;
+    return 1;
+  }
+  const uint8_t* np = entries.data() + n * entry_len;
+  next = BigTiff() ? __u64(np) : __u32(np);
+  
+  ifd.offset = off;
+  
+  std::vector<uint64_t> v;
+  for (uint64_t i = 0; i < n; i++) {
+
+    const uint8_t* e = entries.data() + i * entry_len;
+    const uint16_t tag = __u16(e);
+
+    if (tag == TIFFTAG_PAGENAME || (tag == TIFFTAG_IMAGEDESCRIPTION && description)) {
+      if (__entry_values(in, e, v, tag == TIFFTAG_PAGENAME ? &ifd.page_name : &ifd.description))
+	return 1;
+      continue;
+    }
+
+    // only the values of the tags below are read
+    switch (tag) {
+    case TIFFTAG_SUBFILETYPE : case TIFFTAG_IMAGEWIDTH : case TIFFTAG_IMAGELENGTH :
+    case TIFFTAG_BITSPERSAMPLE : case TIFFTAG_COMPRESSION : case TIFFTAG_PHOTOMETRIC :
+    case TIFFTAG_SAMPLESPERPIXEL : case TIFFTAG_ROWSPERSTRIP : case TIFFTAG_PLANARCONFIG :
+    case TIFFTAG_PREDICTOR : case TIFFTAG_TILEWIDTH : case TIFFTAG_TILELENGTH :
+    case TIFFTAG_SUBIFD : case TIFFTAG_SAMPLEFORMAT :
+      break;
+    default :
+      continue;
+    }
+    
+    if (__entry_values(in, e, v, NULL))
+      return 1;
+    if (v.empty())
+      continue;
+
+    switch (tag) {
+    case TIFFTAG_SUBFILETYPE : ifd.subfile_type = v[0]; break;
+    case TIFFTAG_IMAGEWIDTH : ifd.width = v[0]; break;
+    case TIFFTAG_IMAGELENGTH : ifd.height = v[0]; break;
+    case TIFFTAG_BITSPERSAMPLE : ifd.bits_per_sample = v[0]; break;
+    case TIFFTAG_COMPRESSION : ifd.compression = v[0]; break;
+    case TIFFTAG_PHOTOMETRIC : ifd.photometric = v[0]; break;
+    case TIFFTAG_SAMPLESPERPIXEL : ifd.samples_per_pixel = v[0]; break;
+    case TIFFTAG_ROWSPERSTRIP : ifd.rows_per_strip = v[0]; break;
+    case TIFFTAG_PLANARCONFIG : ifd.planar = v[0]; break;
+    case TIFFTAG_PREDICTOR : ifd.predictor = v[0]; break;
+    case TIFFTAG_TILEWIDTH : ifd.tile_width = v[0]; break;
+    case TIFFTAG_TILELENGTH : ifd.tile_height = v[0]; break;
+    case TIFFTAG_SUBIFD : ifd.subifd_offsets = v; break;
+    case TIFFTAG_SAMPLEFORMAT : ifd.sample_format = v[0]; break;
+    }
+  }
+
+  // a strip covers the whole image unless it says otherwise
+  if (!ifd.tiled() && (ifd.rows_per_strip == 0 || ifd.rows_per_strip > ifd.height))
+    ifd.rows_per_strip = ifd.height;
+  
+  return 0;
+}
+
+int TiffHeader::ReadIFDs(bool description) {
+
+  m_ifds.clear();
+  m_channels.clear();
+
+  if (!m_ok) {
+    std::cerr << "ERROR: " << m_filename << " does not have a valid TIFF header" << std::endl;
+    return 1;
+  }
+  
+  std::ifstream in(m_filename.c_str(), std::ios::binary);
+  if (!in.is_open()) {
+    std::cerr << "Error opening " << m_filename << std::endl;
+    return 1;
+  }
+  
+  std::unordered_set<uint64_t> seen;
+  for (uint64_t off = m_first_offset; off != 0; ) {
+
+    if (!seen.insert(off).second || seen.size() > MAX_IFDS) {
+      std::cerr << "ERROR: IFD chain of " << m_filename << " loops back to offset " << off << std::endl;
+      return 1;
+    }
+    
+    HeaderIFD ifd;
+    uint64_t next = 0;
+    if (__read_ifd(in, off, ifd, next, description && m_ifds.empty()))
+      return 1;
+
+    // OME style pyramid levels
+    for (const auto& s : ifd.subifd_offsets) {
+      HeaderIFD sub;
+      uint64_t unused = 0;
+      if (__read_ifd(in, s, sub, unused, false))
+	return 1;
+      ifd.levels.push_back(std::move(sub));
+    }
+
+    m_ifds.push_back(std::move(ifd));
+    off = next;
+  }
+
+  // channels and levels, grouped as in TiffReader::__build_levels
+  for (const auto& ifd : m_ifds) {
+    if ((ifd.subfile_type & FILETYPE_REDUCEDIMAGE) && !m_channels.empty()) {
+      m_channels.back().levels.push_back(ifd);
+      m_channels.back().levels.back().levels.clear();
+      continue;
+    }
+    m_channels.push_back(ifd);
+  }
+  for (auto& c : m_channels)
+    std::stable_sort(c.levels.begin(), c.levels.end(),
+		     [](const HeaderIFD& a, const HeaderIFD& b) {
+		       return a.width > b.width;
+		     });
+
+  return 0;
+}
+
+// the value of attribute `name` of the XML element that starts at
+// `start`, with the standard entities decoded. Empty if it has none
+static std::string __xml_attribute(const std::string& xml, size_t start,
+				   const std::string& name) {
+
+  const size_t end = xml.find('>', start);
+  const std::string key = " " + name + "=\"";
+  const size_t a = xml.find(key, start);
+  if (a == std::string::npos || a > end)
+    return "";
+  const size_t v = a + key.size();
+  const size_t q = xml.find('"', v);
+  if (q == std::string::npos)
+    return "";
+
+  std::string out;
+  for (size_t i = v; i < q; i++) {
+    if (xml[i] != '&') {
+      out += xml[i];
+      continue;
+    }
+    static const char* ent[][2] = { {"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"},
+				    {"&quot;", "\""}, {"&apos;", "'"} };
+    bool found = false;
+    for (const auto& e : ent) {
+      if (xml.compare(i, strlen(e[0]), e[0]) == 0) {
+	out += e[1];
+	i += strlen(e[0]) - 1;
+	found = true;
+	break;
+      }
+    }
+    if (!found)
+      out += '&';
+  }
+  return out;
+}
+
+std::vector<std::string> TiffHeader::ChannelNames() const {
+
+  std::vector<std::string> names(m_channels.size());
+
+  // <Channel ... Name="..."> elements of the OME-XML, which may carry
+  // a namespace prefix (e.g. <ome:Channel)
+  std::vector<std::string> ome;
+  static const std::string none;
+  const std::string& xml = m_ifds.empty() ? none : m_ifds[0].description;
+  for (size_t p = xml.find("Channel"); p != std::string::npos; p = xml.find("Channel", p + 1)) {
+    const size_t lt = xml.rfind('<', p);
+    if (lt == std::string::npos || p + 7 >= xml.size())
+      continue;
+    const std::string prefix = xml.substr(lt + 1, p - lt - 1);
+    const char after = xml[p + 7];
+    if ((prefix.empty() || (prefix.back() == ':' && prefix.find_first_of(" /") == std::string::npos)) &&
+	(after == ' ' || after == '>' || after == '/' || after == '\n' || after == '\t'))
+      ome.push_back(__xml_attribute(xml, p, "Name"));
+  }
+
+  for (size_t i = 0; i < names.size(); i++)
+    names[i] = i < ome.size() ? ome[i] : m_channels[i].page_name;
+  return names;
+}
+
+// a string as a JSON string literal
+static std::string __json(const std::string& s) {
+  std::ostringstream o;
+  o << '"';
+  for (const char& c : s) {
+    switch (c) {
+    case '"' : o << "\\\""; break;
+    case '\\' : o << "\\\\"; break;
+    case '\n' : o << "\\n"; break;
+    case '\t' : o << "\\t"; break;
+    case '\r' : o << "\\r"; break;
+    default :
+      if (static_cast<unsigned char>(c) < 0x20) {
+	char u[8];
+	snprintf(u, sizeof(u), "\\u%04x", c);
+	o << u;
+      } else {
+	o << c;
+      }
+    }
+  }
+  o << '"';
+  return o.str();
+}
+
+static const char* __sample_format_name(uint16_t f) {
+  switch (f) {
+  case SAMPLEFORMAT_UINT : return "uint";
+  case SAMPLEFORMAT_INT : return "int";
+  case SAMPLEFORMAT_IEEEFP : return "float";
+  }
+  return "other";
+}
+
+void TiffHeader::print_info(bool json) const {
+
+  const std::vector<std::string> names = ChannelNames();
+
+  if (!json) {
+    std::cout << "file\t" << m_filename << " (" << (BigTiff() ? "BigTIFF" : "TIFF") << ", " <<
+      (m_big_endian ? "big" : "little") << " endian, " << m_ifds.size() << " IFDs)" << std::endl;
+    std::cout << "channel\tname\twidth\theight\ttile\tbits\tspp\tformat\tcodec\tlevels" << std::endl;
+    for (size_t i = 0; i < m_channels.size(); i++) {
+      const HeaderIFD& c = m_channels[i];
+      std::cout << i << "\t" << (names[i].empty() ? "NA" : names[i]) << "\t" <<
+	c.width << "\t" << c.height << "\t";
+      if (c.tiled())
+	std::cout << c.tile_width << "x" << c.tile_height;
+      else
+	std::cout << "strip";
+      std::cout << "\t" << c.bits_per_sample << "\t" << c.samples_per_pixel << "\t" <<
+	__sample_format_name(c.sample_format) << "\t" << CodecName(c.compression) << "\t" <<
+	(c.levels.size() + 1);
+      for (const auto& l : c.levels)
+	std::cout << " " << l.width << "x" << l.height;
+      std::cout << std::endl;
+    }
+    return;
+  }
+
+  // levels[0] is the channel itself, so that levels[l] is what
+  // -L l picks in the other modules
+  auto level = [](const HeaderIFD& l) {
+    std::ostringstream o;
+    o << "{\"width\": " << l.width << ", \"height\": " << l.height <<
+      ", \"tile_width\": " << l.tile_width << ", \"tile_height\": " << l.tile_height <<
+      ", \"compression\": " << __json(CodecName(l.compression)) <<
+      ", \"offset\": " << l.offset << "}";
+    return o.str();
+  };
+  
+  std::cout << "{\n";
+  std::cout << "  \"file\": " << __json(m_filename) << ",\n";
+  std::cout << "  \"bigtiff\": " << (BigTiff() ? "true" : "false") << ",\n";
+  std::cout << "  \"byte_order\": \"" << (m_big_endian ? "big" : "little") << "\",\n";
+  std::cout << "  \"num_ifds\": " << m_ifds.size() << ",\n";
+  std::cout << "  \"num_channels\": " << m_channels.size() << ",\n";
+  std::cout << "  \"channels\": [";
+  for (size_t i = 0; i < m_channels.size(); i++) {
+    const HeaderIFD& c = m_channels[i];
+    std::cout << (i ? "," : "") << "\n    {\"index\": " << i <<
+      ", \"name\": " << (names[i].empty() ? std::string("null") : __json(names[i])) <<
+      ", \"width\": " << c.width << ", \"height\": " << c.height <<
+      ", \"tiled\": " << (c.tiled() ? "true" : "false") <<
+      ", \"tile_width\": " << c.tile_width << ", \"tile_height\": " << c.tile_height <<
+      ", \"rows_per_strip\": " << c.rows_per_strip <<
+      ", \"bits_per_sample\": " << c.bits_per_sample <<
+      ", \"samples_per_pixel\": " << c.samples_per_pixel <<
+      ", \"sample_format\": \"" << __sample_format_name(c.sample_format) << "\"" <<
+      ", \"planar\": " << c.planar <<
+      ", \"photometric\": " << c.photometric <<
+      ", \"compression\": " << __json(CodecName(c.compression)) <<
+      ", \"predictor\": " << c.predictor <<
+      ", \"offset\": " << c.offset <<
+      ",\n     \"levels\": [" << level(c);
+    for (const auto& l : c.levels)
+      std::cout << ", " << level(l);
+    std::cout << "]}";
+  }
+  std::cout << "\n  ]\n}" << std::endl;
+}
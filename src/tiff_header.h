@@ -7,9 +7,51 @@
 #include <memory>
 #include <fstream>
 #include <cstring>
+#include <cstdint>
+#include <vector>
 
 #define HEADER_BUFF 1024
 
+// one IFD, as read straight from the file by TiffHeader::ReadIFDs,
+// without going through libtiff. Tags that are missing keep the
+// defaults from the TIFF spec
+struct HeaderIFD {
+
+  uint64_t offset = 0;
+
+  uint64_t width = 0;
+  uint64_t height = 0;
+  uint64_t tile_width = 0;    // 0 for a stripped image
+  uint64_t tile_height = 0;
+  uint64_t rows_per_strip = 0;
+
+  uint16_t bits_per_sample = 1;
+  uint16_t samples_per_pixel = 1;
+  uint16_t sample_format = 1;  // SAMPLEFORMAT_UINT
+  uint16_t compression = 1;    // COMPRESSION_NONE
+  uint16_t predictor = 1;
+  uint16_t photometric = 0;
+  uint16_t planar = 1;         // PLANARCONFIG_CONTIG
+  uint32_t subfile_type = 0;
+
+  // IMAGEDESCRIPTION, which holds the OME-XML of an OME-TIFF. Only read
+  // for the first IFD, since it can be megabytes long
+  std::string description;
+
+  // PAGENAME, which some writers use for the channel name
+  std::string page_name;
+
+  std::vector<uint64_t> subifd_offsets;
+
+  // the reduced resolution copies of this image, largest first: its
+  // SubIFDs, or for older files the FILETYPE_REDUCEDIMAGE IFDs that
+  // follow it in the chain. Only set on the channels
+  std::vector<HeaderIFD> levels;
+
+  bool tiled() const { return tile_width > 0; }
+  
+};
+
 /* 
  // TIFF header
 typedef	struct {
@@ -56,6 +98,35 @@ class TiffHeader {
 
   // send to human readable stdout
   void view_stdout() const;
+
+  // true if the header was read and is a TIFF or BigTIFF
+  bool ok() const { return m_ok; }
+
+  bool BigTiff() const { return m_tid == 43; }
+  bool BigEndian() const { return m_big_endian; }
+
+  // Walk the IFD chain from the first IFD, and the SubIFDs of each
+  // IFD, reading the tags straight from the file (classic TIFF and
+  // BigTIFF, either byte order). This is the fast path for looking at
+  // a file: no codec is set up and nothing goes to stderr but errors.
+  // The IFDs are then grouped into channels and levels the same way
+  // TiffReader does. The first IFD's description (the OME-XML) is
+  // only read if description is set. Returns non-zero on a malformed file
+  int ReadIFDs(bool description = true);
+
+  // every IFD of the main chain, in file order, after ReadIFDs
+  const std::vector<HeaderIFD>& ifds() const { return m_ifds; }
+
+  // the full resolution channels, each with its levels
+  const std::vector<HeaderIFD>& channels() const { return m_channels; }
+
+  // the channel names from the OME-XML of the first IFD, or else the
+  // PAGENAME of each channel. Empty strings where there is no name
+  std::vector<std::string> ChannelNames() const;
+
+  // print the dimensions, tiling, codec, channel names and levels of
+  // every channel to stdout, as JSON or as a table. Call ReadIFDs first
+  void print_info(bool json) const;
     
  private:
 
@@ -76,7 +147,30 @@ class TiffHeader {
   size_t m_offset_start, m_offset_len;
 
   // location of the first IFD;
-  uint64_t m_first_offset;
+  uint64_t m_first_offset = 0;
+
+  bool m_big_endian = false;
+
+  bool m_ok = false;
+
+  std::vector<HeaderIFD> m_ifds;
+  std::vector<HeaderIFD> m_channels;
+
+  // integers in the byte order of the file
+  uint16_t __u16(const uint8_t* p) const;
+  uint32_t __u32(const uint8_t* p) const;
+  uint64_t __u64(const uint8_t* p) const;
+
+  // read the IFD at off into ifd, and the offset of the next one
+  // into next. Returns non-zero on error
+  int __read_ifd(std::ifstream& in, uint64_t off, HeaderIFD& ifd,
+		 uint64_t& next, bool description) const;
+
+  // the values of one tag entry (the entry starts at e), as integers,
+  // or as a string for ASCII. Values that do not fit in the entry are
+  // read from the file. Returns non-zero on error
+  int __entry_values(std::ifstream& in, const uint8_t* e,
+		     std::vector<uint64_t>& values, std::string* str) const;
 
   // call internal routines to make the header
   int __construct_header();
@@ -1,7 +1,10 @@
 #include "tiff_ifd.h"
 #include "tiff_utils.h"
+#include "tiff_stats.h"
+#include "tiff_tiles.h"
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 
 template <typename T>  
 void TiffIFD::__get_sure_tag(int tag, T& value) {
@@ -31,17 +34,34 @@ void TiffIFD::__get_tag(int tag, T& value) {
   return out;
   }*/
 
-void TiffIFD::print() const {
+uint64_t TiffIFD::__switch_to() const {
+
+  uint64_t prev = TIFFCurrentDirOffset(m_tif);
+  
+  // TIFFSetSubDirectory goes straight to the offset, rather than
+  // TIFFSetDirectory which may walk the whole IFD chain to get there
+  if (prev != offset && !TIFFSetSubDirectory(m_tif, offset))
+    fprintf(stderr, "ERROR: unable to switch to IFD %d at offset %llu\n",
+	    dir, (unsigned long long)offset);
+  
+  return prev;
+}
 
-  // store it and then move it back. Kludgy
-  uint16_t cur_dir = TIFFCurrentDirectory(m_tif);
+void TiffIFD::__switch_back(uint64_t prev) const {
+
+  if (prev != offset && prev != 0)
+    TIFFSetSubDirectory(m_tif, prev);
+  
+}
+
+void TiffIFD::print() const {
 
-  TIFFSetDirectory(m_tif, dir);
+  uint64_t prev = __switch_to();
 
   TIFFPrintDirectory(m_tif, stdout);
 
   // and put it back
-  TIFFSetDirectory(m_tif, cur_dir); 
+  __switch_back(prev);
   
 }
 
@@ -57,6 +77,28 @@ TiffIFD::TiffIFD(TIFF* tif) {
   m_tif = tif;
 
   dir = TIFFCurrentDirectory(tif);
+  offset = TIFFCurrentDirOffset(tif);
+
+  __read_tags();
+}
+
+TiffIFD::TiffIFD(TIFF* tif, uint64_t off, uint16_t d) {
+  m_tif = tif;
+  offset = off;
+  dir = d;
+}
+
+void TiffIFD::__load() {
+
+  if (m_loaded)
+    return;
+
+  uint64_t prev = __switch_to();
+  __read_tags();
+  __switch_back(prev);
+}
+
+void TiffIFD::__read_tags() {
 
   // store basic image properties that must be ther
   __get_sure_tag(TIFFTAG_IMAGEWIDTH, width);
@@ -64,7 +106,7 @@ TiffIFD::TiffIFD(TIFF* tif) {
   //__get_sure_tag(TIFFTAG_BITSPERSAMPLE, bits_per_sample);
   //__get_sure_tag(TIFFTAG_SAMPLESPERPIXEL, samples_per_pixel);
 
-  if (!TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel)) {
+  if (!TIFFGetField(m_tif, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel)) {
     fprintf(stderr, "WARNING: image does not have a SAMPLESPERPIXEL tag. Assuming 1\n");
     samples_per_pixel = 1;
   }
@@ -92,164 +134,43 @@ TiffIFD::TiffIFD(TIFF* tif) {
   __get_tag(TIFFTAG_SAMPLEFORMAT, sample_format);
   __get_tag(TIFFTAG_TILEWIDTH, tile_width);
   __get_tag(TIFFTAG_TILELENGTH, tile_height);      
+  __get_tag(TIFFTAG_SUBFILETYPE, subfile_type);
 
-  /*
-   * Check the image to see if TIFFReadRGBAImage can deal with it.
-   * 1/0 is returned according to whether or not the image can
-   * be handled.  If 0 is returned, emsg contains the reason
-   * why it is being rejected.
-   */
-  char emsg[1024];
-  int rgba_ok = TIFFRGBAImageOK(m_tif, emsg);
-  if (!rgba_ok) {
-    fprintf(stderr, "%s", emsg);
+  // cache the tile / strip layout
+  tiled = TIFFIsTiled(m_tif);
+  scanline_size = TIFFScanlineSize(m_tif);
+  if (tiled) {
+    tile_size = TIFFTileSize(m_tif);
+  } else {
+    uint32_t rps = 0;
+    TIFFGetFieldDefaulted(m_tif, TIFFTAG_ROWSPERSTRIP, &rps);
+    rows_per_strip = rps;
+    strip_size = TIFFStripSize(m_tif);
   }
 
-  
-}
-
-bool TiffIFD::isTiled() {
+  // pyramid levels stored as SubIFDs of this directory
+  uint16_t num_sub = 0;
+  uint64_t* sub = NULL;
+  if (TIFFGetField(m_tif, TIFFTAG_SUBIFD, &num_sub, &sub) && sub)
+    subifd_offsets.assign(sub, sub + num_sub);
 
-  // store it and then move it back. Kludgy
-  uint16_t tmp_dir = TIFFCurrentDirectory(m_tif);
-  TIFFSetDirectory(m_tif, dir);
-  
-  bool out = TIFFIsTiled(m_tif);
-  
-  // and put it back
-  TIFFSetDirectory(m_tif, tmp_dir); 
-
-  return out;
-  
+  m_loaded = true;
 }
 
-std::vector<double> TiffIFD::mean() {
-
-  // store it and then move it back. Kludgy
-  uint16_t tmp_dir = TIFFCurrentDirectory(m_tif);
-  TIFFSetDirectory(m_tif, dir);
-  
-  uint8_t mode = GetMode();
-    
-  void* buf;
-  
-  if (isTiled()) {
-    // allocate memory for a single tile
-    buf  = _TIFFmalloc(TIFFTileSize(m_tif));
-  } else {
-    buf  = _TIFFmalloc(TIFFScanlineSize(m_tif));
-  }
-
-  // loop through the tiles
-  int x, y;
-  double np = static_cast<uint64_t>(width) * height;
+const TiffIFD& TiffIFD::Level(size_t l) const {
+  assert(l < NumLevels());
+  if (l == 0)
+    return *this;
+  m_subifds.at(l - 1).__load();
+  return m_subifds.at(l - 1);
+}
 
-  std::vector<double> out = {0,0,0,0}; 
-  
-  /*  if (verbose)
-      std::cerr << "...starting image " <<
-      ifd << " with " << AddCommas(static_cast<uint64_t>(np)) <<
-      " pixels" << std::endl;
-      
-      uint64_t m_pix = 0; // running count for verbose command
-  */
-  
-  
-  if (isTiled()) {
-    for (y = 0; y < height; y += tile_height) {
-      for (x = 0; x < width; x += tile_width) {
-	
-	// Read the tile
-	if (TIFFReadTile(m_tif, buf, x, y, 0, 0) < 0) {
-	  fprintf(stderr, "Error reading tile at (%d, %d)\n", x, y);
-	  return {-1};
-	}
-	
-	// Get the mean
-	for (int ty = 0; ty < tile_height; ty++) {
-	  for (int tx = 0; tx < tile_width; tx++) {
-	    if (x + tx < width && y + ty < height) {
-	      
-	      /*		  ++m_pix;
-		  if (verbose && m_pix % static_cast<uint64_t>(1e9) == 0)
-		    std::cerr << "...working on pixel: " <<
-		      AddCommas(static_cast<uint64_t>(m_pix)) << std::endl;
-	      */  
-	      switch (mode) {
-	      case 8:
-		out[3] += static_cast<uint8_t*>(buf)[ty * tile_width + tx];
-		break;
-	      case 3:
-		out[0] += static_cast<uint8_t*>(buf)[(ty * tile_width + tx) * 3    ];
-		out[1] += static_cast<uint8_t*>(buf)[(ty * tile_width + tx) * 3 + 1];
-		out[2] += static_cast<uint8_t*>(buf)[(ty * tile_width + tx) * 3 + 2];
-		break;
-	      case 32:
-		out[3] += static_cast<uint32_t*>(buf)[ty * tile_width + tx];	      
-		break;
-	      case 16:
-		out[3] += static_cast<uint16_t*>(buf)[(ty * tile_width + tx)];
-		break;
-	      default:
-		std::cerr << "tiffo means - mode of " << static_cast<int>(mode) << " not supported " << std::endl;
-	      }
-		}
-	      } // tile x loop
-	    } // tile y loop
-	  } // image x loop
-	} // image y loop
-      }
-      
-      // lined image
-      else {
-	
-	uint64_t ls = TIFFScanlineSize(m_tif);
-	for (uint64_t y = 0; y < height; y++) {
-	  for (uint64_t x = 0; x < ls; x++) {
-
-	    // Read the line
-	    if (TIFFReadScanline(m_tif, buf, y) < 0) {
-	      fprintf(stderr, "Error reading line at row %llu\n", y);
-	      return {-1};
-	    }
-	    
-	    /*	    ++m_pix;
-	    if (verbose && m_pix % static_cast<uint64_t>(1e9) == 0)
-	      std::cerr << "...working on pixel: " <<
-		AddCommas(static_cast<uint64_t>(m_pix)) << std::endl;
-	    */
-	    
-	    switch (mode) {
-	    case 8:
-	      out[3] += static_cast<uint8_t*>(buf)[x];
-	    break;
-	    case 3:
-	      out[0] += static_cast<uint8_t*>(buf)[x * 3    ];
-	      out[1] += static_cast<uint8_t*>(buf)[x * 3 + 1];
-	      out[2] += static_cast<uint8_t*>(buf)[x * 3 + 2];
-	      break;
-	    case 32:
-	      out[3] += static_cast<uint32_t*>(buf)[x];	      
-	      break;
-	    case 16:
-	      out[3] += static_cast<uint16_t*>(buf)[x];
-	      break;
-	    default:
-	      std::cerr << "tiffo means - mode of " << static_cast<int>(mode) << " not supported " << std::endl;
-	    }
-	  } // x loop
-	} // y loop
-      } //scanline else
-
-  // get the mean
-  for (auto& a : out) {
-    a /= np;
-  }
+int TiffIFD::stats(int threads, std::vector<SampleStats>& out, bool sequential) const {
 
-  // and put it back
-  TIFFSetDirectory(m_tif, tmp_dir); 
+  // the stats engine opens its own handles directly on this IFD's
+  // offset, so m_tif is never switched away from its directory
+  return ComputeIFDStats(TIFFFileName(m_tif), offset, threads, out, sequential);
   
-  return out;
 }
 
 uint8_t TiffIFD::GetMode() const {
@@ -271,7 +192,7 @@ uint8_t TiffIFD::GetMode() const {
 
 void* TiffIFD::ReadRaster() {
 
-  if (isTiled())
+  if (tiled)
     return(__tiled_read());
   else
     return(__lined_read());
@@ -279,31 +200,78 @@ void* TiffIFD::ReadRaster() {
 }
 
 
-void* TiffIFD::__alloc() {
+int TiffIFD::ReadRegion(uint64_t x, uint64_t y, uint64_t w, uint64_t h, int level,
+			void* buf, int threads) const {
+
+  if (level < 0 || level >= static_cast<int>(NumLevels())) {
+    fprintf(stderr, "ERROR: level %d requested, IFD %d has %zu levels\n",
+	    level, dir, NumLevels());
+    return 1;
+  }
+  if (w == 0 || h == 0)
+    return 0;
+  if (threads < 1)
+    threads = 1;
+  
+  // own handles, parked on the level, so m_tif is left alone. Only
+  // the chunks that touch the window are read
+  const uint64_t off = Level(level).offset;
+  TileExec exec;
+  exec.threads = threads;
+  TileRegion region;
+  region.x = x;
+  region.y = y;
+  region.w = w;
+  region.h = h;
+  TileLoop loop(TIFFFileName(m_tif), {off}, exec, region);
+  if (!loop.ok()) {
+    fprintf(stderr, "ERROR: unable to open IFD at offset %llu\n", (unsigned long long)off);
+    return 1;
+  }
+  if (!loop.contig()) {
+    fprintf(stderr, "ERROR: ReadRegion does not handle separate sample planes\n");
+    return 1;
+  }
+
+  const uint64_t lw = loop.width(), lh = loop.height();
+  const uint64_t pixel_bytes = static_cast<uint64_t>(loop.SamplesPerPixel()) * loop.BitsPerSample() / 8;
+  const uint64_t out_row_bytes = w * pixel_bytes;
+  uint8_t* out = static_cast<uint8_t*>(buf);
+
+  // anything hanging off the image stays zero
+  if (x + w > lw || y + h > lh)
+    std::memset(out, 0, out_row_bytes * h);
+
+  // copy the overlapping rows straight into place
+  const int err = loop.run([&](TileView& v) {
+      for (uint64_t r = v.y; r < v.y + v.h; r++)
+	std::memcpy(out + (r - y) * out_row_bytes + (v.x - x) * pixel_bytes,
+		    v.at(0, v.x, r), v.w * pixel_bytes);
+      return 0;
+    });
+
+  if (err) {
+    fprintf(stderr, "ERROR: unable to read region (%llu, %llu) %llu x %llu\n",
+	    (unsigned long long)x, (unsigned long long)y,
+	    (unsigned long long)w, (unsigned long long)h);
+    return 1;
+  }
   
-  size_t mode = GetMode(); 
+  return 0;
+}
 
+void* TiffIFD::__alloc() {
+  
+  const size_t px = PixelBytes(GetPixelType());
+  if (px == 0) {
+    fprintf(stderr, "ERROR: unsupported pixel layout: %llu samples of %llu bits\n",
+	    (unsigned long long)samples_per_pixel, (unsigned long long)bits_per_sample);
+    return NULL;
+  }
+  
   uint64_t pixels = static_cast<uint64_t>(width) * height;
   
-  void* data; 
-  
-  switch (mode) {
-      case 8:
-	data = calloc(pixels, sizeof(uint8_t));
-	//fprintf(stderr, "alloc size %f GB\n", m_pixels / 1e9);
-	break;
-      case 4:
-        data = calloc(pixels, sizeof(uint32_t));
-	//fprintf(stderr, "alloc size %f GB\n", m_pixels * 4 / 1e9);
-	break;
-      case 3:
-        data = calloc(pixels*3, sizeof(uint8_t));
-	//fprintf(stderr, "alloc size %f GB\n", m_pixels * 4 / 1e9);
-	break;
-  default:
-    fprintf(stderr, "mode not recognized: %zu\n", mode);
-    assert(false);
-    }
+  void* data = calloc(pixels, px);
   
   if (data == NULL) {
     fprintf(stderr, "ERROR: unable to allocate image raster\n");
@@ -317,22 +285,24 @@ void* TiffIFD::__alloc() {
 
 void* TiffIFD::__tiled_read() {
 
-  // store it and then move it back. Kludgy
-  uint16_t tmp_dir = TIFFCurrentDirectory(m_tif);
-  TIFFSetDirectory(m_tif, dir);
-
-  uint8_t mode = GetMode();
-  
-  // allocate memory for a single tile
-  void* tile = (void*)calloc(TIFFTileSize(m_tif), sizeof(uint8_t));
-
   // allocate the memory for this buffer
   // IFD object is NOT in charge of storing this
   void* data = __alloc();
+  if (data == NULL)
+    return NULL;
+  
+  uint64_t prev = __switch_to();
 
-  uint64_t tile_size = static_cast<uint64_t>(tile_height) * tile_width;						 
+  // allocate memory for a single tile
+  void* tile = _TIFFmalloc(tile_size);
 
-  // loop through the tiles
+  const PixelType pt = GetPixelType();
+  const size_t px = PixelBytes(pt);
+  
+  bool verbose = true;
+  
+  // loop through the tiles, copying the part of each that is
+  // inside the image a row span at a time
   uint64_t x, y;
   uint64_t m_pix = 0;
   for (y = 0; y < height; y += tile_height) {
@@ -341,48 +311,24 @@ void* TiffIFD::__tiled_read() {
       // Read the tile
       if (TIFFReadTile(m_tif, tile, x, y, 0, 0) < 0) {
 	fprintf(stderr, "Error reading tile at (%llu, %llu)\n", x, y);
+	_TIFFfree(tile);
+	free(data);
+	__switch_back(prev);
 	return NULL;
       }
 
-      bool verbose = true;
-      
-      // Copy the tile data into the image buffer
-      for (uint64_t ty = 0; ty < tile_height; ty++) {
-	for (uint64_t tx = 0; tx < tile_width; tx++) {
-	  uint64_t ind = (y + ty) * width + x + tx;
-	  if (x + tx < width && y + ty < height) {
-
-	    ++m_pix;
-	    if (verbose && m_pix % static_cast<uint64_t>(1e9) == 0)
-	      std::cerr << "...working on pixel: " <<
-		AddCommas(static_cast<uint64_t>(m_pix)) << std::endl;
-
-	    uint64_t tile_ind = ty * tile_width + tx;
-	   
-	    switch (mode) {
-	    case 3:
-	      ind *= 3;
-	      tile_ind *= 3;
-	      assert(static_cast<uint8_t*>(data)[ind] == 0);	      
-	      memcpy(static_cast<uint8_t*>(data)+ind, static_cast<uint8_t*>(tile) + tile_ind, 3);
-	      break;
-	    case 8:
-	      assert(static_cast<uint8_t*>(data)[ind] == 0);	      
-	      memcpy(static_cast<uint8_t*>(data)+ind, static_cast<uint8_t*>(tile) + tile_ind, 1);
-	      break;
-	      //static_cast<uint8_t*>(data)[ind] =
-	      //  static_cast<uint8_t*>(tile)[ty * tile_width + tx];
-	    case 32:
-	      static_cast<uint32_t*>(data)[ind] =
-		static_cast<uint32_t*>(tile)[ty * tile_width + tx];
-	    break;
-          default:
-	    fprintf(stderr, "not able to understand mode %d\n", mode);
-	    assert(false);
-	  }
-	  }
-	} // tile x loop
-      } // tile y loop
+      const uint64_t rows = std::min(tile_height, height - y);
+      const uint64_t cols = std::min(tile_width, width - x);
+      uint8_t* dst = static_cast<uint8_t*>(data) + (y * width + x) * px;
+      DispatchPixel(pt, [&](auto p) {
+	  CopyPixelRows<decltype(p)>(tile, tile_width, dst, width, rows, cols);
+	});
+
+      const uint64_t b = static_cast<uint64_t>(1e9);
+      if (verbose && (m_pix + rows * cols) / b != m_pix / b)
+	std::cerr << "...working on pixel: " <<
+	  AddCommas(static_cast<uint64_t>((m_pix + rows * cols) / b * b)) << std::endl;
+      m_pix += rows * cols;
 
     } // image x loop
   } // image y loop
@@ -390,7 +336,7 @@ void* TiffIFD::__tiled_read() {
   _TIFFfree(tile);
 
   // and put it back
-  TIFFSetDirectory(m_tif, tmp_dir); 
+  __switch_back(prev);
   
   return data;
   
@@ -398,26 +344,34 @@ void* TiffIFD::__tiled_read() {
 
 void* TiffIFD::__lined_read() {
 
-  // store it and then move it back. Kludgy
-  uint16_t tmp_dir = TIFFCurrentDirectory(m_tif);
-  TIFFSetDirectory(m_tif, dir);
-  
-  size_t mode = GetMode();
+  uint64_t ls = scanline_size;
 
+  // the raster rows are the scanlines as they are, so they have to
+  // be the size the pixel type says (not e.g. separate planes)
+  if (ls != width * PixelBytes(GetPixelType())) {
+    fprintf(stderr, "ERROR: scanline of %llu bytes does not match %llu pixels\n",
+	    (unsigned long long)ls, (unsigned long long)width);
+    return NULL;
+  }
+  
   uint8_t* data = static_cast<uint8_t*>(__alloc());
+  if (data == NULL)
+    return NULL;
   
-  uint64_t ls = TIFFScanlineSize(m_tif);
+  uint64_t prev = __switch_to();
 
   // allocate memory for a single line
-  uint8_t* buf = static_cast<uint8_t*>(_TIFFmalloc(TIFFScanlineSize(m_tif)));
+  uint8_t* buf = static_cast<uint8_t*>(_TIFFmalloc(ls));
 
   size_t offset = 0;
-  uint64_t m_pix = 0;
   for (uint64_t y = 0; y < height; y++) {
 
     // Read the line
     if (TIFFReadScanline(m_tif, buf, y) < 0) {
       fprintf(stderr, "Error reading line at row %llu\n", y);
+      _TIFFfree(buf);
+      free(data);
+      __switch_back(prev);
       return NULL;
     }
 
@@ -431,7 +385,7 @@ void* TiffIFD::__lined_read() {
   _TIFFfree(buf);
 
   // and put it back
-  TIFFSetDirectory(m_tif, tmp_dir); 
+  __switch_back(prev);
   
   return data;
 }
@@ -5,19 +5,35 @@
 #include <iostream>
 #include <tiffio.h>
 
+#include "tiff_stats.h"
+#include "tiff_pixel.h"
+
 // this always belongs as a member of the m_ifds vector
 // in TiffReader or as a member of another TiffIFD
 class TiffIFD {
 
  public:
 
+  friend class TiffReader;
+
   TiffIFD() {}
 
+  // the directory tif is on now, with its tags read right away
   TiffIFD(TIFF* tif);
 
+  // The directory at file offset off (number d in the chain), with its
+  // tags left unread until it is first used. TiffReader hands out only
+  // loaded IFDs, so opening a file costs no directory reads beyond
+  // the ones actually asked for
+  TiffIFD(TIFF* tif, uint64_t off, uint16_t d);
+
   // this directory id
   uint16_t dir = 0;
 
+  // file offset of this directory, used to switch to it directly
+  // with TIFFSetSubDirectory rather than walking the IFD chain
+  uint64_t offset = 0;
+
   // directory number of the SUB ifd
   uint16_t curr_ifd = 0;
   
@@ -34,19 +50,54 @@ class TiffIFD {
   uint64_t tile_height = 0;
   uint64_t tile_width  = 0;  
   uint64_t sample_format = 0;
+  uint32_t subfile_type = 0;   // FILETYPE_REDUCEDIMAGE etc
+
+  // cached layout, so that hot loops never have to go back to
+  // libtiff (and its directory state) to ask for it
+  bool tiled = false;
+  uint64_t tile_size = 0;      // bytes in one decoded tile
+  uint64_t rows_per_strip = 0;
+  uint64_t strip_size = 0;     // bytes in one decoded strip
+  uint64_t scanline_size = 0;  // bytes in one decoded row
+
+  // file offsets of the SubIFDs (reduced resolution pyramid levels)
+  std::vector<uint64_t> subifd_offsets;
 
   //friend std::ostream& operator<<(std::ostream& out, const TiffIFD& o);
 
   // print libtiff style info to stdout
   void print() const; 
 
-  bool isTiled();
+  bool isTiled() const { return tiled; }
+
+  // number of resolution levels: this image plus the reduced
+  // resolution copies of it that TiffReader found
+  size_t NumLevels() const { return m_subifds.size() + 1; }
+
+  // resolution level l of this image, 0 being this IFD itself
+  const TiffIFD& Level(size_t l) const;
 
   uint8_t GetMode() const;
 
-  std::vector<double> mean();
+  // typed pixel layout, see tiff_pixel.h
+  PixelType GetPixelType() const {
+    return ::GetPixelType(samples_per_pixel, bits_per_sample, sample_format);
+  }
+
+  // per-sample pixel statistics (mean, std, min, max, percentiles),
+  // with the tiles or strips split across threads, read in file order
+  // if sequential
+  int stats(int threads, std::vector<SampleStats>& out, bool sequential = false) const;
 
   void* ReadRaster();
+
+  // Decode the window [x, x + w) x [y, y + h) of resolution level
+  // `level` (see Level, in that level's own pixel coordinates) into
+  // buf, as w * h row-major pixels of interleaved samples. Only the
+  // tiles or strips that touch the window are read, split across
+  // threads, and pixels past the image edge are zero. Returns 0 on success
+  int ReadRegion(uint64_t x, uint64_t y, uint64_t w, uint64_t h, int level,
+		 void* buf, int threads = 1) const;
   
  private:
 
@@ -60,8 +111,28 @@ class TiffIFD {
   // this is passed to the reader method, which then
   // passes it out. This class does not store raster info
   void* __alloc(); 
+
+  // switch m_tif to this directory (if not already there)
+  // and return the offset of the directory it was on
+  uint64_t __switch_to() const;
+
+  // return m_tif to the directory it was on before __switch_to
+  void __switch_back(uint64_t prev) const;
   
-  std::vector<TiffIFD> m_subifds;
+  // reduced resolution levels, largest first. Filled in by TiffReader
+  // from the SubIFDs, and from REDUCEDIMAGE IFDs in the main chain.
+  // Mutable since they are loaded when first asked for by Level
+  mutable std::vector<TiffIFD> m_subifds;
+
+  // true once the tags below have been read
+  bool m_loaded = false;
+
+  // read the tags, if not already done, switching m_tif to this
+  // directory and back
+  void __load();
+
+  // read the tags of the directory m_tif is on
+  void __read_tags();
 
   // get the tag and if not found, print an error
   template <typename T>
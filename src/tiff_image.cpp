@@ -2,6 +2,7 @@
 #include "tiff_utils.h"
 #include <cassert>
 #include <iostream>
+#include <algorithm>
 
 #include <string.h>
 #define DP(x) fprintf(stderr,"DEBUG %d\n", x)
@@ -42,6 +43,8 @@ TiffImage::TiffImage(const TiffReader& tr) {
   m_planar = m_ifd.planar;
   m_samples_per_pixel = m_ifd.samples_per_pixel;
   m_bits_per_sample = m_ifd.bits_per_sample;
+  if (m_ifd.sample_format)
+    m_sample_format = m_ifd.sample_format;
 
   m_pixels = static_cast<uint64_t>(m_width) * m_height;
   
@@ -52,6 +55,9 @@ TiffImage::TiffImage(const TiffReader& tr) {
 uint8_t TiffImage::pixel(uint64_t x, uint64_t y, int p) const {
 
   assert(p == PIXEL_GRAY || p == PIXEL_RED || p == PIXEL_GREEN || p == PIXEL_BLUE || p == PIXEL_ALPHA);
+
+  if (m_data == NULL && m_tiled)
+    return m_tiled->sample<uint8_t>(x, y, p == PIXEL_GRAY ? 0 : p);
   
   // right now only two types allowed
   //static_assert(std::is_same<T, uint32_t>::value || std::is_same<T, uint8_t>::value,
@@ -77,9 +83,14 @@ uint8_t TiffImage::pixel(uint64_t x, uint64_t y, int p) const {
 template <typename T>
 T TiffImage::element(uint64_t e) const {
 
-  // right now only two types allowed
-  static_assert(std::is_same<T, uint32_t>::value || std::is_same<T, uint8_t>::value,
-                "T must be either uint32_t or uint8_t");
+  static_assert(std::is_same<T, uint8_t>::value || std::is_same<T, uint16_t>::value ||
+		std::is_same<T, uint32_t>::value || std::is_same<T, float>::value,
+                "T must be the sample type of a PixelType");
+
+  if (m_data == NULL && m_tiled) {
+    const int s = m_samples_per_pixel;
+    return m_tiled->sample<T>(e / s % m_width, e / s / m_width, e % s);
+  }
 
   // check that the data has been read
   assert(__is_rasterized());
@@ -95,28 +106,47 @@ T TiffImage::element(uint64_t e) const {
 
 double TiffImage::mean() const {
 
+  if (m_data == NULL && m_tiled) {
+
+    // stream it a chunk at a time, so the cache only ever holds one
+    TiledRaster& r = *m_tiled;
+    const uint64_t cw = r.ChunkWidth(), ch = r.ChunkHeight();
+    const size_t px = PixelBytes(r.GetPixelType());
+    double sum = 0;
+    int samples = 1;
+    for (uint64_t y = 0; y < m_height; y += ch) {
+      for (uint64_t x = 0; x < m_width; x += cw) {
+	const uint32_t c = r.ChunkAt(x, y);
+	const uint8_t* p = r.Pin(c);
+	if (p == NULL)
+	  return -1;
+	const uint64_t rows = std::min<uint64_t>(ch, m_height - y);
+	const uint64_t cols = std::min<uint64_t>(cw, m_width - x);
+	DispatchPixel(r.GetPixelType(), [&](auto t) {
+	    for (uint64_t k = 0; k < rows; k++)
+	      sum += SumPixels<decltype(t)>(p + k * cw * px, cols);
+	    samples = decltype(t)::samples;
+	  });
+	r.Unpin(c);
+      }
+    }
+    return (sum / (static_cast<double>(m_pixels) * samples));
+  }
+
   if (!__is_rasterized()) {
     std::cerr << "ERROR: needs to be read into raster first" << std::endl;
     return -1;
   }
 
-  size_t mode = GetMode();
-  
+  // mean over every sample, so for RGB all three channels
   double sum = 0;
-  
-  switch (mode) {
-  case 8:
-    for (size_t i = 0; i < m_pixels; ++i) {
-      sum += static_cast<uint8_t*>(m_data)[i];
-    }
-    break;
-  case 32:
-    for (size_t i = 0; i < m_pixels; ++i)
-      sum += static_cast<uint32_t*>(m_data)[i];
-    break;
-  }
+  int samples = 1;
+  DispatchPixel(GetPixelType(), [&](auto p) {
+      sum = SumPixels<decltype(p)>(m_data, m_pixels);
+      samples = decltype(p)::samples;
+    });
 
-  return (sum / m_pixels);
+  return (sum / (static_cast<double>(m_pixels) * samples));
 
 }
 /*
@@ -256,7 +286,11 @@ int TiffImage::__alloc() {
 
   assert(m_pixels);
   
-  size_t mode = GetMode(); 
+  const size_t px = PixelBytes(GetPixelType());
+  if (px == 0) {
+    fprintf(stderr, "not able to understand mode %d\n", GetMode());
+    return 1;
+  }
 
   if (m_data) {
     std::cerr << "m_data not empty, freeing. Are you sure you want this?" << std::endl;
@@ -266,23 +300,7 @@ int TiffImage::__alloc() {
   //debug
   //std::cerr << "m_pixels " << m_pixels << " mode " << mode << std::endl;
   
-  switch (mode) {
-      case 8:
-	m_data = calloc(m_pixels, sizeof(uint8_t));
-	//fprintf(stderr, "alloc size %f GB\n", m_pixels / 1e9);
-	break;
-      case 32:
-        m_data = calloc(m_pixels, sizeof(uint32_t));
-	//fprintf(stderr, "alloc size %f GB\n", m_pixels * 4 / 1e9);
-	break;
-  case 3:
-    m_data = calloc(m_pixels * 3, sizeof(uint8_t));
-    break;
-  default:
-    fprintf(stderr, "not able to understand mode %zu\n", mode);
-    assert(false);
-
-    }
+  m_data = calloc(m_pixels, px);
   
   if (m_data == NULL) {
     fprintf(stderr, "ERROR: unable to allocate image raster\n");
@@ -303,6 +321,17 @@ int TiffImage::__alloc() {
 
 //}
 
+int TiffImage::OpenTiled(uint64_t cache_mb) {
+
+  m_tiled = std::make_shared<TiledRaster>(TIFFFileName(m_tr.get()), m_ifd,
+					  cache_mb << 20);
+  if (!m_tiled->ok()) {
+    m_tiled.reset();
+    return 1;
+  }
+  return 0;
+}
+
 int TiffImage::ReadToRaster() {
 
   m_data = m_ifd.ReadRaster();
@@ -315,6 +344,8 @@ int TiffImage::ReadToRaster() {
 
 void TiffImage::clear_raster() {
 
+  m_tiled.reset();
+
   if (m_data == NULL) {
     //fprintf(stderr, "Warning: no raster to clear\n");
     return;
@@ -336,6 +367,27 @@ bool TiffImage::__is_rasterized() const {
 }
 
 
+bool TiffImage::__has_pixels() const {
+
+  if (m_tiled)
+    return true;
+  return __is_rasterized();
+}
+
+int TiffImage::__read_region(uint64_t x, uint64_t y, uint64_t w, uint64_t h,
+			     void* buf, uint64_t stride) const {
+
+  if (m_data == NULL && m_tiled)
+    return m_tiled->ReadRegion(x, y, w, h, buf, stride);
+
+  const size_t px = PixelBytes(GetPixelType());
+  DispatchPixel(GetPixelType(), [&](auto p) {
+      CopyPixelRows<decltype(p)>(static_cast<const uint8_t*>(m_data) + (y * m_width + x) * px,
+				 m_width, buf, stride, h, w);
+    });
+  return 0;
+}
+
 uint8_t TiffImage::GetMode() const {
 
   // RGB
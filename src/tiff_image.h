@@ -11,6 +11,8 @@
 #include "tiff_cp.h"
 #include "tiff_reader.h"
 #include "tiff_utils.h"
+#include "tiff_pixel.h"
+#include "tiff_raster.h"
 
 #define PIXEL_GRAY 999
 #define PIXEL_RED 0
@@ -61,6 +63,15 @@ class TiffImage {
   // read the image tif to a 2D raster
   int ReadToRaster();
 
+  // Instead of ReadToRaster, leave the pixels in the file and decode
+  // tiles only as pixel(), element(), mean() or a TiffWriter ask for
+  // them, holding at most cache_mb MB of them at once. This is for
+  // images that do not fit in memory
+  int OpenTiled(uint64_t cache_mb);
+
+  // the lazily decoded raster from OpenTiled, or NULL
+  TiledRaster* tiled() const { return m_tiled.get(); }
+
   // access a pixel as type T (uint8_t or uint32_t)
   //template <typename T>  
   uint8_t pixel(uint64_t x, uint64_t y, int p) const;
@@ -90,6 +101,11 @@ class TiffImage {
   // get the mode (gray 8-bit, RBG etc)
   uint8_t GetMode() const;
 
+  // typed pixel layout, see tiff_pixel.h
+  PixelType GetPixelType() const {
+    return ::GetPixelType(m_samples_per_pixel, m_bits_per_sample, m_sample_format);
+  }
+
   uint32_t width() const { return m_width; }
   uint32_t height() const { return m_height; }   
 
@@ -108,6 +124,9 @@ class TiffImage {
   // raster of the image
   void* m_data = NULL; 
 
+  // or, after OpenTiled, the tiles it is decoded from as needed
+  std::shared_ptr<TiledRaster> m_tiled;
+
   // flag for whether data is stored as 1 byte or 4 bytes
   uint32_t m_width = 0, m_height = 0;
 
@@ -126,6 +145,7 @@ class TiffImage {
   // PLANARCONFIG_CONTIG 1 -- RGBA RGBA RGBA etc (interleaved)
   // PLANARCONFIG_SEPARATE 2 -- RRRRRR GGGGGG BBBBB etc (separate planes)
   uint16_t m_photometric, m_planar, m_bits_per_sample, m_samples_per_pixel;
+  uint16_t m_sample_format = SAMPLEFORMAT_UINT;
 
   // allocate the memory for the image raster
   // used for starting with a blank image
@@ -134,6 +154,14 @@ class TiffImage {
   // has the image had its raster stored to memory
   bool __is_rasterized() const;
 
+  // true if pixels can be read, from memory or from a TiledRaster
+  bool __has_pixels() const;
+
+  // copy the pixels of [x, x + w) x [y, y + h) to buf, whose rows are
+  // stride pixels apart, from whichever of the two holds them
+  int __read_region(uint64_t x, uint64_t y, uint64_t w, uint64_t h,
+		    void* buf, uint64_t stride) const;
+
 };
 
 #endif
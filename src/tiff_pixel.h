@@ -0,0 +1,142 @@
+#ifndef TIFF_PIXEL_H
+#define TIFF_PIXEL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+
+#include <tiffio.h>
+
+// Typed view of a raster's pixel layout. GetMode() still hands out
+// the old magic numbers (3, 8, 16, 32, 4); a PixelType is resolved
+// once per IFD or image and then dispatched (see DispatchPixel) into
+// kernels compiled for that one layout, so inner loops never switch
+// on the mode per pixel
+enum class PixelType : uint8_t {
+  NONE = 0,
+  U8,
+  U16,
+  U32,
+  F32,
+  RGB8   // interleaved 8-bit RGB
+};
+
+// compile time description of a pixel type: the type of one
+// sample, the samples per pixel, and the matching GetMode value
+template <PixelType P> struct Pixel;
+
+template <> struct Pixel<PixelType::U8> {
+  typedef uint8_t sample;
+  static constexpr int samples = 1;
+  static constexpr uint8_t mode = 8;
+};
+
+template <> struct Pixel<PixelType::U16> {
+  typedef uint16_t sample;
+  static constexpr int samples = 1;
+  static constexpr uint8_t mode = 16;
+};
+
+template <> struct Pixel<PixelType::U32> {
+  typedef uint32_t sample;
+  static constexpr int samples = 1;
+  static constexpr uint8_t mode = 32;
+};
+
+template <> struct Pixel<PixelType::F32> {
+  typedef float sample;
+  static constexpr int samples = 1;
+  static constexpr uint8_t mode = 32;
+};
+
+template <> struct Pixel<PixelType::RGB8> {
+  typedef uint8_t sample;
+  static constexpr int samples = 3;
+  static constexpr uint8_t mode = 3;
+};
+
+// the pixel type of an image with these tags. Signed integer data is
+// carried as the unsigned type of the same width, since the bits are
+// only ever moved around. NONE if it is not one of the above
+inline PixelType GetPixelType(uint64_t samples_per_pixel, uint64_t bits_per_sample,
+			      uint64_t sample_format) {
+
+  if (samples_per_pixel == 3 && bits_per_sample == 8)
+    return PixelType::RGB8;
+  if (samples_per_pixel != 1)
+    return PixelType::NONE;
+
+  if (sample_format == SAMPLEFORMAT_IEEEFP)
+    return bits_per_sample == 32 ? PixelType::F32 : PixelType::NONE;
+
+  switch (bits_per_sample) {
+  case 8 : return PixelType::U8;
+  case 16 : return PixelType::U16;
+  case 32 : return PixelType::U32;
+  }
+  return PixelType::NONE;
+}
+
+// Call f with an empty Pixel<P> for the pixel type t, so that a
+// generic lambda (auto p) can get at decltype(p)::sample and friends
+// and is instantiated once per type. Returns 1, without calling f,
+// for PixelType::NONE
+template <typename F>
+int DispatchPixel(PixelType t, F&& f) {
+  switch (t) {
+  case PixelType::U8 : f(Pixel<PixelType::U8>()); return 0;
+  case PixelType::U16 : f(Pixel<PixelType::U16>()); return 0;
+  case PixelType::U32 : f(Pixel<PixelType::U32>()); return 0;
+  case PixelType::F32 : f(Pixel<PixelType::F32>()); return 0;
+  case PixelType::RGB8 : f(Pixel<PixelType::RGB8>()); return 0;
+  default : return 1;
+  }
+}
+
+// bytes in one pixel of type t, 0 for NONE
+inline size_t PixelBytes(PixelType t) {
+  size_t bytes = 0;
+  DispatchPixel(t, [&](auto p) {
+      typedef decltype(p) P;
+      bytes = sizeof(typename P::sample) * P::samples;
+    });
+  return bytes;
+}
+
+// Copy `rows` rows of `cols` pixels between two row-major buffers
+// whose rows are src_stride and dst_stride pixels apart
+template <typename P>
+void CopyPixelRows(const void* src, uint64_t src_stride,
+		   void* dst, uint64_t dst_stride,
+		   uint64_t rows, uint64_t cols) {
+  typedef typename P::sample T;
+  const T* s = static_cast<const T*>(src);
+  T* d = static_cast<T*>(dst);
+  const uint64_t n = cols * P::samples;
+  for (uint64_t r = 0; r < rows; r++)
+    std::copy(s + r * src_stride * P::samples, s + r * src_stride * P::samples + n,
+	      d + r * dst_stride * P::samples);
+}
+
+// Sum of every sample of n pixels. Integer samples are summed
+// exactly in 64 bits, floats in double
+template <typename P>
+double SumPixels(const void* data, uint64_t n) {
+  typedef typename P::sample T;
+  const T* p = static_cast<const T*>(data);
+  const uint64_t m = n * P::samples;
+  if constexpr (std::is_integral<T>::value) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < m; i++)
+      sum += p[i];
+    return static_cast<double>(sum);
+  } else {
+    double sum = 0;
+    for (uint64_t i = 0; i < m; i++)
+      sum += p[i];
+    return sum;
+  }
+}
+
+#endif
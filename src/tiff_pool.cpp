@@ -0,0 +1,110 @@
+#include "tiff_pool.h"
+
+#include <cassert>
+#include <cstdio>
+
+#include <sys/resource.h>
+
+// the most handles a pool parks, a quarter of the open file limit so
+// that pools, outputs and the rest of the process fit alongside
+static size_t __handle_budget() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+    return 256;
+  return rl.rlim_cur / 4;
+}
+
+TiffHandlePool::TiffHandlePool(const std::string& filename, size_t threads,
+			       const std::vector<int>& dirs) {
+
+  m_filename = filename;
+  m_threads = threads == 0 ? 1 : threads;
+
+  // walk the IFD chain once to turn directory numbers into offsets
+  TIFF* tif = TIFFOpen(m_filename.c_str(), "rm");
+  if (tif == NULL) {
+    fprintf(stderr, "Error opening %s for reading\n", m_filename.c_str());
+    return;
+  }
+
+  std::vector<uint64_t> chain;
+  do {
+    chain.push_back(TIFFCurrentDirOffset(tif));
+  } while (TIFFReadDirectory(tif));
+  TIFFClose(tif);
+  
+  for (const auto& d : dirs) {
+    if (d < 0 || d >= static_cast<int>(chain.size())) {
+      fprintf(stderr, "Error: directory %d requested, but %s has %zu\n",
+	      d, m_filename.c_str(), chain.size());
+      return;
+    }
+    m_offsets.push_back(chain[d]);
+  }
+
+  __open();
+}
+
+TiffHandlePool::TiffHandlePool(const std::string& filename, size_t threads,
+			       const std::vector<uint64_t>& offsets) {
+
+  m_filename = filename;
+  m_threads = threads == 0 ? 1 : threads;
+  m_offsets = offsets;
+
+  __open();
+}
+
+void TiffHandlePool::__open() {
+
+  // a handle per thread, switched on get(), once a row per thread
+  // would not fit
+  m_parked = m_offsets.size() <= 1 || m_threads * m_offsets.size() <= __handle_budget();
+  const size_t cols = m_parked ? m_offsets.size() : 1;
+  m_handles.resize(m_threads * cols, NULL);
+  
+  for (size_t t = 0; t < m_threads; t++) {
+    for (size_t k = 0; k < cols; k++) {
+
+      // the "m" keeps it from being memory mapped, same as the main reader
+      TIFF* tif = TIFFOpen(m_filename.c_str(), "rm");
+      if (tif == NULL) {
+	fprintf(stderr, "Error opening %s for reading (handle %zu,%zu)\n",
+		m_filename.c_str(), t, k);
+	return;
+      }
+      m_handles[t * cols + k] = tif;
+
+      // go straight to the directory by its offset
+      if (TIFFCurrentDirOffset(tif) != m_offsets[k] &&
+	  !TIFFSetSubDirectory(tif, m_offsets[k])) {
+	fprintf(stderr, "Error setting handle %zu to IFD at offset %llu\n",
+		t, (unsigned long long)m_offsets[k]);
+	return;
+      }
+    }
+  }
+
+  m_ok = true;
+}
+
+TiffHandlePool::~TiffHandlePool() {
+  for (auto& h : m_handles)
+    if (h != NULL)
+      TIFFClose(h);
+}
+
+TIFF* TiffHandlePool::get(size_t t, size_t k) const {
+  assert(t < m_threads && k < m_offsets.size());
+  if (m_parked)
+    return m_handles[t * m_offsets.size() + k];
+
+  TIFF* tif = m_handles[t];
+  if (TIFFCurrentDirOffset(tif) != m_offsets[k] &&
+      !TIFFSetSubDirectory(tif, m_offsets[k])) {
+    fprintf(stderr, "Error setting handle %zu to IFD at offset %llu\n",
+	    t, (unsigned long long)m_offsets[k]);
+    return NULL;
+  }
+  return tif;
+}
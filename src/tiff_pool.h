@@ -0,0 +1,82 @@
+#ifndef TIFF_POOL_H
+#define TIFF_POOL_H
+
+#include <string>
+#include <vector>
+#include <tiffio.h>
+
+// A set of independent libtiff handles opened on the same file.
+// A TIFF* is not thread-safe and carries a single "current directory",
+// so each worker thread gets its own row of handles, and each handle
+// in that row stays parked on one directory for its whole life. Reading
+// a tile from any of the requested directories then never requires a
+// directory switch, and different threads never share a handle.
+//
+// threads x dirs handles can run past the open file limit (e.g. 32
+// threads on 40 channels, under the usual 1024), so a pool parks at
+// most RLIMIT_NOFILE / 4 handles (256 if there is no limit). Past
+// that a thread gets a single handle instead, which get() moves to the
+// directory asked for by its offset (see TIFFSetSubDirectory)
+class TiffHandlePool {
+
+ public:
+
+  // create an empty pool
+  TiffHandlePool() {}
+
+  // open threads x dirs.size() handles on filename, with handle (t, k)
+  // set to directory dirs[k]
+  TiffHandlePool(const std::string& filename, size_t threads,
+		 const std::vector<int>& dirs);
+
+  // same, but with the directories given by their file offsets
+  // (e.g. from TiffReader::DirOffset), which also reaches SubIFDs
+  TiffHandlePool(const std::string& filename, size_t threads,
+		 const std::vector<uint64_t>& offsets);
+
+  // close all of the handles
+  ~TiffHandlePool();
+
+  // handles are owned by the pool, so no copying
+  TiffHandlePool(const TiffHandlePool&) = delete;
+  TiffHandlePool& operator=(const TiffHandlePool&) = delete;
+
+  // get the handle for worker thread t that is parked on dirs[k]. With
+  // one handle per thread, this switches it to dirs[k] first, and a
+  // handle from an earlier get() by the same thread may move with it.
+  // NULL if the switch failed
+  TIFF* get(size_t t, size_t k) const;
+
+  // true if every (thread, dir) has a handle of its own
+  bool parked() const { return m_parked; }
+
+  // number of rows of handles (one per worker thread)
+  size_t NumThreads() const { return m_threads; }
+
+  // number of directories each thread has a handle for
+  size_t NumDirs() const { return m_offsets.size(); }
+
+  // true if every handle opened and was set to its directory
+  bool ok() const { return m_ok; }
+  
+ private:
+
+  std::string m_filename;
+
+  size_t m_threads = 0;
+
+  // the file offset of the directory each column of handles is parked on
+  std::vector<uint64_t> m_offsets;
+
+  // open the handles and park them on m_offsets
+  void __open();
+
+  // row-major (thread, dir) handles, or one per thread if not parked
+  std::vector<TIFF*> m_handles;
+  bool m_parked = true;
+
+  bool m_ok = false;
+  
+};
+
+#endif
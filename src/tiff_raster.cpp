@@ -0,0 +1,215 @@
+#include "tiff_raster.h"
+#include "tiff_utils.h"
+
+#include <algorithm>
+#include <cstdio>
+
+TiledRaster::TiledRaster(const std::string& filename, const TiffIFD& ifd,
+			 uint64_t cache_bytes) {
+
+  m_filename = filename;
+  m_offset = ifd.offset;
+  m_width = ifd.width;
+  m_height = ifd.height;
+  m_type = ifd.GetPixelType();
+  m_pixel_bytes = PixelBytes(m_type);
+
+  if (m_pixel_bytes == 0 || ifd.planar == PLANARCONFIG_SEPARATE) {
+    fprintf(stderr, "ERROR: tiled raster of %llu samples of %llu bits (planar %d) not supported\n",
+	    (unsigned long long)ifd.samples_per_pixel,
+	    (unsigned long long)ifd.bits_per_sample, ifd.planar);
+    return;
+  }
+
+  if (ifd.tiled) {
+    m_chunk_w = ifd.tile_width;
+    m_chunk_h = ifd.tile_height;
+    m_chunk_bytes = ifd.tile_size;
+  } else {
+    m_chunk_w = m_width;
+    m_chunk_h = std::min(ifd.rows_per_strip, m_height);
+    m_chunk_bytes = ifd.strip_size;
+  }
+  if (m_chunk_w == 0 || m_chunk_h == 0 ||
+      m_chunk_bytes < m_chunk_w * m_chunk_h * m_pixel_bytes) {
+    fprintf(stderr, "ERROR: bad tile / strip layout for tiled raster\n");
+    return;
+  }
+  m_chunks_across = (m_width + m_chunk_w - 1) / m_chunk_w;
+  m_capacity = std::max<uint64_t>(cache_bytes / m_chunk_bytes, 1);
+
+  DispatchPixel(m_type, [&](auto p) { m_copy = &CopyPixelRows<decltype(p)>; });
+
+  // open one handle up front, to fail early on a bad file
+  TIFF* h = __take_handle();
+  if (h == NULL)
+    return;
+  m_free.push_back(h);
+
+  m_ok = true;
+}
+
+TiledRaster::~TiledRaster() {
+  for (auto& h : m_handles)
+    TIFFClose(h);
+}
+
+uint32_t TiledRaster::ChunkAt(uint64_t x, uint64_t y) const {
+  return static_cast<uint32_t>((y / m_chunk_h) * m_chunks_across + x / m_chunk_w);
+}
+
+TIFF* TiledRaster::__take_handle() {
+
+  if (!m_free.empty()) {
+    TIFF* h = m_free.back();
+    m_free.pop_back();
+    return h;
+  }
+
+  // the "m" keeps it from being memory mapped, same as the main reader
+  TIFF* h = TIFFOpen(m_filename.c_str(), "rm");
+  if (h == NULL) {
+    fprintf(stderr, "Error opening %s for reading\n", m_filename.c_str());
+    return NULL;
+  }
+  if (TIFFCurrentDirOffset(h) != m_offset && !TIFFSetSubDirectory(h, m_offset)) {
+    fprintf(stderr, "Error setting handle to IFD at offset %llu\n",
+	    (unsigned long long)m_offset);
+    TIFFClose(h);
+    return NULL;
+  }
+  m_handles.push_back(h);
+  return h;
+}
+
+void TiledRaster::__evict() {
+
+  auto it = m_lru.end();
+  while (m_chunks.size() >= m_capacity && it != m_lru.begin()) {
+    --it;
+    auto c = m_chunks.find(*it);
+    if (c->second.pins == 0 && c->second.ready) {
+      m_chunks.erase(c);
+      it = m_lru.erase(it);
+    }
+  }
+}
+
+const uint8_t* TiledRaster::Pin(uint32_t c) {
+
+  std::unique_lock<std::mutex> lock(m_mtx);
+
+  // references to map elements survive rehashing, so k stays valid
+  // while the lock is dropped below
+  auto found = m_chunks.find(c);
+  if (found != m_chunks.end()) {
+    Chunk& k = found->second;
+    ++k.pins;
+    ++m_hits;
+    m_lru.splice(m_lru.begin(), m_lru, k.lru);
+    m_cv.wait(lock, [&k] { return k.ready; });
+    if (k.failed) {
+      --k.pins;
+      return NULL;
+    }
+    return k.data.data();
+  }
+
+  ++m_misses;
+  __evict();
+  Chunk& k = m_chunks[c];
+  k.pins = 1;
+  m_lru.push_front(c);
+  k.lru = m_lru.begin();
+  m_peak = std::max(m_peak, m_chunks.size());
+
+  // decode without holding the lock, so other chunks can be served
+  TIFF* h = __take_handle();
+  lock.unlock();
+
+  std::vector<uint8_t> buf(m_chunk_bytes);
+  tmsize_t got = -1;
+  if (h != NULL) {
+    got = ReadEncodedChunk(h, c, buf.data(), m_chunk_bytes);
+    if (got < 0)
+      fprintf(stderr, "Error reading %s %u\n", m_chunk_w == m_width ? "strip" : "tile", c);
+  }
+
+  lock.lock();
+  if (h != NULL)
+    m_free.push_back(h);
+  k.data.swap(buf);
+  k.ready = true;
+  k.failed = got < 0;
+  m_cv.notify_all();
+  if (k.failed) {
+    --k.pins;
+    return NULL;
+  }
+  return k.data.data();
+}
+
+void TiledRaster::Unpin(uint32_t c) {
+
+  std::lock_guard<std::mutex> lock(m_mtx);
+  auto found = m_chunks.find(c);
+  if (found != m_chunks.end() && found->second.pins > 0)
+    --found->second.pins;
+}
+
+template <typename T>
+T TiledRaster::sample(uint64_t x, uint64_t y, int s) {
+
+  if (x >= m_width || y >= m_height) {
+    fprintf(stderr, "ERROR: Accesing out of bound pixel at (%llu,%llu)\n",
+	    (unsigned long long)x, (unsigned long long)y);
+    return 0;
+  }
+
+  const uint32_t c = ChunkAt(x, y);
+  const uint8_t* p = Pin(c);
+  if (p == NULL)
+    return 0;
+
+  const uint64_t i = ((y % m_chunk_h) * m_chunk_w + x % m_chunk_w) * m_pixel_bytes;
+  const T v = reinterpret_cast<const T*>(p + i)[s];
+  Unpin(c);
+  return v;
+}
+
+template uint8_t TiledRaster::sample<uint8_t>(uint64_t, uint64_t, int);
+template uint16_t TiledRaster::sample<uint16_t>(uint64_t, uint64_t, int);
+template uint32_t TiledRaster::sample<uint32_t>(uint64_t, uint64_t, int);
+template float TiledRaster::sample<float>(uint64_t, uint64_t, int);
+
+int TiledRaster::ReadRegion(uint64_t x, uint64_t y, uint64_t w, uint64_t h,
+			    void* buf, uint64_t stride) {
+
+  if (x + w > m_width || y + h > m_height) {
+    fprintf(stderr, "ERROR: region (%llu,%llu) %llu x %llu is outside the image\n",
+	    (unsigned long long)x, (unsigned long long)y,
+	    (unsigned long long)w, (unsigned long long)h);
+    return 1;
+  }
+
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  for (uint64_t cy = y / m_chunk_h * m_chunk_h; cy < y + h; cy += m_chunk_h) {
+    for (uint64_t cx = x / m_chunk_w * m_chunk_w; cx < x + w; cx += m_chunk_w) {
+
+      // the part of this chunk inside the window
+      const uint64_t x0 = std::max(x, cx), x1 = std::min(x + w, cx + m_chunk_w);
+      const uint64_t y0 = std::max(y, cy), y1 = std::min(y + h, cy + m_chunk_h);
+
+      const uint32_t c = ChunkAt(cx, cy);
+      const uint8_t* p = Pin(c);
+      if (p == NULL)
+	return 1;
+      m_copy(p + ((y0 - cy) * m_chunk_w + (x0 - cx)) * m_pixel_bytes, m_chunk_w,
+	     out + ((y0 - y) * stride + (x0 - x)) * m_pixel_bytes, stride,
+	     y1 - y0, x1 - x0);
+      Unpin(c);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef TIFF_RASTER_H
+#define TIFF_RASTER_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <tiffio.h>
+
+#include "tiff_ifd.h"
+#include "tiff_pixel.h"
+
+// A read-only view of one IFD that decodes its tiles (or strips) only
+// when they are asked for, and keeps the most recently used of them in
+// a cache of bounded size. It is the alternative to reading the whole
+// image into memory, for slides that do not fit.
+//
+// All of the methods can be called from many threads at once. Each
+// decode uses its own TIFF handle, so decodes of different chunks run
+// in parallel, and threads asking for a chunk that is being decoded
+// wait for that one decode rather than doing it again
+class TiledRaster {
+
+ public:
+
+  // view of the image described by ifd (any IFD or level of filename),
+  // caching at most cache_bytes of decoded chunks
+  TiledRaster(const std::string& filename, const TiffIFD& ifd, uint64_t cache_bytes);
+
+  // close the handles
+  ~TiledRaster();
+
+  // owns handles, so no copying
+  TiledRaster(const TiledRaster&) = delete;
+  TiledRaster& operator=(const TiledRaster&) = delete;
+
+  // true if the file opened and the pixel layout is supported
+  bool ok() const { return m_ok; }
+
+  uint64_t width() const { return m_width; }
+  uint64_t height() const { return m_height; }
+  PixelType GetPixelType() const { return m_type; }
+
+  // chunk geometry: a tile, or for stripped images a strip that is
+  // the full width of the image
+  uint64_t ChunkWidth() const { return m_chunk_w; }
+  uint64_t ChunkHeight() const { return m_chunk_h; }
+
+  // the chunk that holds pixel (x, y)
+  uint32_t ChunkAt(uint64_t x, uint64_t y) const;
+
+  // Decode chunk c if it is not cached, and keep it in the cache until
+  // the matching Unpin. The pixels are row-major, ChunkWidth() pixels
+  // to a row. Pinned chunks are never evicted, so if more chunks are
+  // pinned at once than fit, the cache goes over its size until they
+  // are unpinned. Returns NULL if the chunk could not be read
+  const uint8_t* Pin(uint32_t c);
+
+  // release a chunk returned by Pin
+  void Unpin(uint32_t c);
+
+  // sample s of pixel (x, y), as the sample type of the image
+  template <typename T>
+  T sample(uint64_t x, uint64_t y, int s);
+
+  // Copy the pixels of [x, x + w) x [y, y + h) into buf, whose rows are
+  // stride pixels apart. The window must be inside the image. Returns
+  // 0 on success
+  int ReadRegion(uint64_t x, uint64_t y, uint64_t w, uint64_t h,
+		 void* buf, uint64_t stride);
+
+  // cache counters
+  uint64_t hits() const { return m_hits; }
+  uint64_t misses() const { return m_misses; }
+
+  // the most decoded bytes held at once
+  uint64_t PeakBytes() const { return m_peak * m_chunk_bytes; }
+
+ private:
+
+  struct Chunk {
+    std::vector<uint8_t> data;
+    int pins = 0;
+    bool ready = false;    // decoded (or failed)
+    bool failed = false;
+    std::list<uint32_t>::iterator lru;
+  };
+
+  std::string m_filename;
+  uint64_t m_offset = 0;
+
+  uint64_t m_width = 0, m_height = 0;
+  uint64_t m_chunk_w = 0, m_chunk_h = 0;
+  uint64_t m_chunks_across = 0;
+  uint64_t m_chunk_bytes = 0;
+  PixelType m_type = PixelType::NONE;
+  size_t m_pixel_bytes = 0;
+
+  // the typed row copy for m_type
+  void (*m_copy)(const void*, uint64_t, void*, uint64_t, uint64_t, uint64_t) = NULL;
+
+  // most chunks the cache holds while none are pinned
+  size_t m_capacity = 1;
+
+  bool m_ok = false;
+
+  std::mutex m_mtx;
+  std::condition_variable m_cv;
+
+  // cached chunks, and their order of use, most recent first
+  std::unordered_map<uint32_t, Chunk> m_chunks;
+  std::list<uint32_t> m_lru;
+
+  // every handle opened, and the ones not decoding right now
+  std::vector<TIFF*> m_handles;
+  std::vector<TIFF*> m_free;
+
+  uint64_t m_hits = 0, m_misses = 0;
+  size_t m_peak = 0;
+
+  // drop least recently used unpinned chunks until there is room for
+  // one more. Called with m_mtx held
+  void __evict();
+
+  // a handle parked on the IFD, opened if none are free. Called with
+  // m_mtx held. NULL if it would not open
+  TIFF* __take_handle();
+
+};
+
+#endif
@@ -1,38 +1,50 @@
 #include "tiff_reader.h"
 
-void TiffReader::print_means() {
+#include <algorithm>
 
-  std::cerr << " num dirs " << m_num_dirs << std::endl;
-  for (int i = 0; i < m_num_dirs; i++) {
+int TiffReader::print_stats(int threads, const std::vector<double>& percentiles,
+			     size_t level, bool sequential) {
 
-    TiffIFD& ifd = m_ifds[i];
+  // header
+  std::cout << "dir\tsample\tcount\tmean\tstd\tmin\tmax";
+  for (const auto& p : percentiles)
+    std::cout << "\tp" << p;
+  std::cout << std::endl;
+
+  // a channel that fails is reported and skipped, and the rest still
+  // printed, but the run as a whole fails
+  int rc = 0;
+  for (size_t i = 0; i < m_channels.size(); i++) {
+
+    if (level >= NumLevels(i)) {
+      std::cerr << "Error: channel " << i << " has no level " << level << std::endl;
+      rc = 1;
+      continue;
+    }
     
-    uint8_t mode = ifd.GetMode();
-
-    switch(mode) {
-    case 32:
-      std::cout << "Dir " << i << " Mean: " << ifd.mean()[3] << std::endl;
-      break;
-    case 16:
-      std::cout << "Dir " << i << " Mean: " << ifd.mean()[3] << std::endl;      
-      break;
-    case 8:
-      std::cout << "Dir " << i << " Mean: " << ifd.mean()[3] << std::endl;            
-      break;
-    case 3:
-      {
-      std::vector<double> d = ifd.mean();
-      std::cout << "Mean: (R) " << d[0] << " (G) " << d[1] <<
-	" (B) " << d[2] << std::endl;
+    std::vector<SampleStats> st;
+    if (Level(i, level).stats(threads, st, sequential)) {
+      std::cerr << "Error: unable to compute stats for dir " << i << std::endl;
+      rc = 1;
+      continue;
+    }
+
+    for (size_t s = 0; s < st.size(); s++) {
+      std::cout << i << "\t" << s << "\t" << st[s].count << "\t" <<
+	st[s].mean() << "\t" << st[s].stdev() << "\t" <<
+	st[s].min << "\t" << st[s].max;
+      for (const auto& p : percentiles) {
+	double v = st[s].percentile(p);
+	if (v < 0)
+	  std::cout << "\tNA";
+	else
+	  std::cout << "\t" << v;
       }
-      break;
-    default:
-      std::cerr << "tiffo means - mode of " << static_cast<int>(mode) << " not supported " << std::endl;
+      std::cout << std::endl;
     }
-    
   }
-    
 
+  return rc;
 }
 
 TiffReader::TiffReader(const char* c) {
@@ -45,28 +57,145 @@ TiffReader::TiffReader(const char* c) {
     return;
   }
   
-  // set the number of directories
-  m_num_dirs = TIFFNumberOfDirectories(m_tif.get());
-
   // set the filename
   m_filename = std::string(c);
   
-  // store the pointers to the individual directories
-  for (size_t i = 0; i < m_num_dirs; i++) {
-    assert(TIFFSetDirectory(m_tif.get(), i));
-    m_ifds.push_back(TiffIFD(m_tif.get()));
-    //std::cerr << " getting pointer for " << i << " with value " << m_ifds.back() << std::endl;    
+  // Walk the IFD chain and the SubIFDs straight from the file, and
+  // keep each directory's file offset, so later switches can jump
+  // straight to an IFD with TIFFSetSubDirectory. The tags of an IFD are
+  // only read through libtiff the first time it is used, so opening a
+  // file with many channels costs no more than opening one
+  TIFF* tif = m_tif.get();
+  TiffHeader header(m_filename);
+  if (header.ok() && !header.ReadIFDs(false)) {
+    const std::vector<HeaderIFD>& h = header.ifds();
+    for (size_t i = 0; i < h.size(); i++) {
+      m_ifds.push_back(__stub(h[i], i));
+      for (const auto& l : h[i].levels)
+	m_ifds.back().m_subifds.push_back(__stub(l, i));
+    }
+  } else {
+    
+    // fall back to libtiff's own walk, reading every directory
+    std::cerr << "Warning: reading every directory of " << m_filename << " through libtiff" << std::endl;
+    do {
+      m_ifds.push_back(TiffIFD(tif));
+    } while (TIFFReadDirectory(tif));
+
+    // OME style: the levels hang off the channel as SubIFDs
+    for (size_t i = 0; i < m_ifds.size(); i++) {
+      for (const auto& off : m_ifds[i].subifd_offsets) {
+	if (!TIFFSetSubDirectory(tif, off)) {
+	  fprintf(stderr, "Error reading SubIFD of dir %zu at offset %llu\n",
+		  i, (unsigned long long)off);
+	  break;
+	}
+	m_ifds[i].m_subifds.push_back(TiffIFD(tif));
+      }
+    }
   }
+
+  // set the number of directories
+  m_num_dirs = m_ifds.size();
+
+  // group everything into channels x levels
+  __build_levels();
+
   // set back to 0
-  assert(TIFFSetDirectory(m_tif.get(), 0));
+  SetDirectory(0);
+  
+}
+
+int TiffReader::SetDirectory(size_t i) {
+
+  assert(i < m_ifds.size());
+  
+  uint64_t off = m_ifds[i].offset;
+  if (TIFFCurrentDirOffset(m_tif.get()) != off &&
+      !TIFFSetSubDirectory(m_tif.get(), off)) {
+    fprintf(stderr, "Error setting directory %zu at offset %llu\n", i, (unsigned long long)off);
+    return 1;
+  }
+  curr_ifd = i;
+  return 0;
+}
+
+uint64_t TiffReader::DirOffset(size_t i) const {
+  assert(i < m_ifds.size());
+  return m_ifds[i].offset;
+}
+
+TiffIFD TiffReader::__stub(const HeaderIFD& h, size_t dir) const {
+
+  // just what __build_levels needs to group and sort the levels,
+  // everything else comes when the IFD is loaded
+  TiffIFD ifd(m_tif.get(), h.offset, dir);
+  ifd.width = h.width;
+  ifd.subfile_type = h.subfile_type;
+  ifd.subifd_offsets = h.subifd_offsets;
+  return ifd;
+}
+
+void TiffReader::__build_levels() {
+
+  for (size_t i = 0; i < m_ifds.size(); i++) {
+
+    // older style: reduced resolution IFDs follow the full resolution
+    // one in the main chain
+    if ((m_ifds[i].subfile_type & FILETYPE_REDUCEDIMAGE) && !m_channels.empty()) {
+      m_ifds[m_channels.back()].m_subifds.push_back(m_ifds[i]);
+      continue;
+    }
+    
+    m_channels.push_back(i);
+  }
+
+  // levels go from largest to smallest, whatever order they were written
+  for (const auto& c : m_channels)
+    std::stable_sort(m_ifds[c].m_subifds.begin(), m_ifds[c].m_subifds.end(),
+		     [](const TiffIFD& a, const TiffIFD& b) {
+		       return a.width > b.width;
+		     });
   
 }
 
+size_t TiffReader::NumLevels(size_t c) const {
+  assert(c < m_channels.size());
+  return m_ifds[m_channels[c]].NumLevels();
+}
+
+const TiffIFD& TiffReader::Level(size_t c, size_t l) const {
+  assert(c < m_channels.size());
+  m_ifds[m_channels[c]].__load();
+  return m_ifds[m_channels[c]].Level(l);
+}
+
+uint64_t TiffReader::LevelOffset(size_t c, size_t l) const {
+  assert(c < m_channels.size() && l < NumLevels(c));
+  const TiffIFD& ifd = m_ifds[m_channels[c]];
+  return l == 0 ? ifd.offset : ifd.m_subifds[l - 1].offset;
+}
+
+int TiffReader::LevelOffsets(size_t l, std::vector<uint64_t>& offsets) const {
+
+  offsets.clear();
+  for (size_t c = 0; c < m_channels.size(); c++) {
+    if (l >= NumLevels(c)) {
+      fprintf(stderr, "Error: level %zu requested, but channel %zu has %zu levels\n",
+	      l, c, NumLevels(c));
+      return 1;
+    }
+    offsets.push_back(LevelOffset(c, l));
+  }
+  return 0;
+}
+
 void TiffReader::print() {
 
   std::cout << "-- Image file: " << m_filename << std::endl;
   std::cout << "-- Num dirs: " << m_num_dirs << std::endl;
   for (auto& i : m_ifds) {
+    i.__load();
     std::cout << " ----- IFD " << i.dir << " -----" << std::endl;
     i.print();
   }
@@ -9,6 +9,7 @@
 #include <memory>
 
 #include "tiff_ifd.h"
+#include "tiff_header.h"
 
 // this class does not store pixel data, but
 // does contain the TIFF pointer to the original image.
@@ -31,11 +32,38 @@ class TiffReader {
   // return the number of IFDs
   size_t NumDirs() const;
 
+  // switch the TIFF to IFD i, using its stored offset
+  int SetDirectory(size_t i);
+
+  // file offset of IFD i, recorded once when the file is opened
+  uint64_t DirOffset(size_t i) const;
+
+  // number of channels, i.e. the full resolution IFDs of the main
+  // chain. Reduced resolution IFDs are not counted, they are levels
+  size_t NumChannels() const { return m_channels.size(); }
+
+  // number of resolution levels of channel c, including level 0
+  size_t NumLevels(size_t c) const;
+
+  // resolution level l of channel c, 0 being full resolution. Levels
+  // come from the SubIFDs of the channel (OME style pyramids) or from
+  // REDUCEDIMAGE IFDs that follow it in the main chain. Its tags are
+  // read from the file the first time it is asked for
+  const TiffIFD& Level(size_t c, size_t l) const;
+
+  // file offset of level l of channel c, without reading its tags
+  uint64_t LevelOffset(size_t c, size_t l) const;
+
+  // file offset of level l of every channel, for TIFFSetSubDirectory.
+  // Returns non-zero if any channel has no such level
+  int LevelOffsets(size_t l, std::vector<uint64_t>& offsets) const;
+
   // print it for debugging
   friend std::ostream& operator<<(std::ostream& out, const TiffReader& o);
 
   TiffIFD CurrentIFD() const {
     assert(curr_ifd < m_ifds.size());
+    m_ifds.at(curr_ifd).__load();
     return m_ifds.at(curr_ifd);
   }
 
@@ -43,7 +71,12 @@ class TiffReader {
 
   void print();
 
-  void print_means();
+  // print the mean, std, min, max and the given percentiles
+  // of every sample of every channel, at resolution level `level`.
+  // sequential reads each channel's tiles in file order, see ChunkSchedule.
+  // Returns non-zero if a channel has no such level or its stats failed
+  int print_stats(int threads, const std::vector<double>& percentiles,
+		   size_t level = 0, bool sequential = false);
 
   uint32_t width() const;
   uint32_t height() const;
@@ -54,11 +87,22 @@ class TiffReader {
   
   std::string m_filename;
 
-  size_t m_num_dirs;
+  size_t m_num_dirs = 0;
 
   std::shared_ptr<TIFF> m_tif;
 
-  std::vector<TiffIFD> m_ifds;
+  // every IFD of the main chain. Mutable, since each is loaded
+  // when it is first handed out
+  mutable std::vector<TiffIFD> m_ifds;
+
+  // index in m_ifds of each full resolution channel
+  std::vector<size_t> m_channels;
+
+  // sort the IFDs into channels and their resolution levels
+  void __build_levels();
+
+  // an unloaded IFD for h, number dir in the chain
+  TiffIFD __stub(const HeaderIFD& h, size_t dir) const;
 
   size_t curr_ifd = 0;
   
@@ -0,0 +1,122 @@
+#include "tiff_schedule.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <numeric>
+#include <fcntl.h>
+
+// prefetch requests for ranges with less than this between them are
+// merged, rather than sent one by one
+#define READAHEAD_GAP (256UL << 10)
+
+ChunkSchedule::ChunkSchedule(TIFF* in, const std::vector<uint64_t>& dirs) {
+
+  m_fd = TIFFFileno(in);
+  const uint64_t start = TIFFCurrentDirOffset(in);
+
+  for (const auto& d : dirs) {
+    if (TIFFCurrentDirOffset(in) != d && !TIFFSetSubDirectory(in, d)) {
+      fprintf(stderr, "Error setting directory at offset %llu for the read schedule\n",
+	      (unsigned long long)d);
+      TIFFSetSubDirectory(in, start);
+      return;
+    }
+
+    const uint32_t n = TIFFIsTiled(in) ? TIFFNumberOfTiles(in) : TIFFNumberOfStrips(in);
+    std::vector<uint64_t> off(n), len(n);
+    for (uint32_t c = 0; c < n; c++) {
+      len[c] = TIFFGetStrileByteCount(in, c);
+      off[c] = len[c] ? TIFFGetStrileOffset(in, c) : 0;
+    }
+    m_offsets.push_back(std::move(off));
+    m_bytes.push_back(std::move(len));
+  }
+
+  if (TIFFCurrentDirOffset(in) != start)
+    TIFFSetSubDirectory(in, start);
+  m_ok = true;
+}
+
+std::vector<uint32_t> ChunkSchedule::FileOrder(size_t k) const {
+
+  const std::vector<uint64_t>& off = m_offsets[k];
+  std::vector<uint32_t> order(off.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+		   [&off](uint32_t a, uint32_t b) { return off[a] < off[b]; });
+  return order;
+}
+
+void ChunkSchedule::DirOrder(uint32_t c, std::vector<uint32_t>& dirs) const {
+
+  dirs.resize(m_offsets.size());
+  std::iota(dirs.begin(), dirs.end(), 0);
+  std::stable_sort(dirs.begin(), dirs.end(), [this, c](uint32_t a, uint32_t b) {
+      return m_offsets[a][c] < m_offsets[b][c];
+    });
+}
+
+void ChunkSchedule::SetOrder(const std::vector<ChunkRef>& order) {
+
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_order = order;
+  m_cum.assign(order.size() + 1, 0);
+  for (size_t i = 0; i < order.size(); i++)
+    m_cum[i + 1] = m_cum[i] + m_bytes[order[i].dir][order[i].chunk];
+  m_next = 0;
+}
+
+void ChunkSchedule::reached(size_t i) {
+
+  std::lock_guard<std::mutex> lock(m_mtx);
+  if (i >= m_order.size())
+    return;
+
+  // nothing behind the reader is worth asking for any more
+  m_next = std::max(m_next, i);
+
+  // only top up once less than half of the lead is left, so that
+  // most calls return here and requests go out in large batches
+  if (m_cum[m_next] - m_cum[i] >= READAHEAD_BYTES / 2)
+    return;
+
+  size_t end = m_next;
+  while (end < m_order.size() && m_cum[end] - m_cum[i] < READAHEAD_BYTES)
+    end++;
+  if (end == m_next)
+    return;
+
+  __advise(m_next, end);
+  m_next = end;
+}
+
+void ChunkSchedule::__advise(size_t i0, size_t i1) const {
+
+#ifdef POSIX_FADV_WILLNEED
+  if (m_fd < 0)
+    return;
+
+  // the byte ranges, in file order, so that neighbours can be merged
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  for (size_t i = i0; i < i1; i++) {
+    const ChunkRef& r = m_order[i];
+    if (m_bytes[r.dir][r.chunk])
+      ranges.emplace_back(m_offsets[r.dir][r.chunk], m_bytes[r.dir][r.chunk]);
+  }
+  std::sort(ranges.begin(), ranges.end());
+
+  size_t j = 0;
+  while (j < ranges.size()) {
+    const uint64_t start = ranges[j].first;
+    uint64_t end = start + ranges[j].second;
+    for (j++; j < ranges.size() && ranges[j].first <= end + READAHEAD_GAP; j++)
+      end = std::max(end, ranges[j].first + ranges[j].second);
+
+    // only a hint, so a failure here costs nothing but speed
+    posix_fadvise(m_fd, start, end - start, POSIX_FADV_WILLNEED);
+  }
+#else
+  (void)i0;
+  (void)i1;
+#endif
+}
@@ -0,0 +1,92 @@
+#ifndef TIFF_SCHEDULE_H
+#define TIFF_SCHEDULE_H
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <tiffio.h>
+
+// how far ahead of the reader to ask the OS to prefetch
+#define READAHEAD_BYTES (64UL << 20)
+
+// one tile or strip of one of the IFDs of a ChunkSchedule
+struct ChunkRef {
+  uint32_t dir;     // index into the IFD offsets the schedule was built from
+  uint32_t chunk;   // tile or strip number within that IFD
+};
+
+// Where the tiles (or strips) of a set of IFDs sit in the file, from
+// their TILEOFFSETS / TILEBYTECOUNTS, for reading them in file order
+// instead of raster order. On NFS or a spinning disk, raster order
+// across a large file, or across channels, turns into random I/O.
+//
+// A schedule can also prefetch. After SetOrder, each reached(i) asks
+// the OS (posix_fadvise WILLNEED) to start reading the byte ranges of
+// the chunks that follow, up to READAHEAD_BYTES past i, with ranges
+// that are next to each other in the file merged into one request
+class ChunkSchedule {
+
+ public:
+
+  // an empty schedule
+  ChunkSchedule() {}
+
+  // the chunk layout of the IFDs at file offsets dirs. in is left on
+  // the directory it started on. Its file descriptor is used for the
+  // prefetch hints, so in must stay open while this is used
+  ChunkSchedule(TIFF* in, const std::vector<uint64_t>& dirs);
+
+  // the schedule holds a mutex, so no copying
+  ChunkSchedule(const ChunkSchedule&) = delete;
+  ChunkSchedule& operator=(const ChunkSchedule&) = delete;
+
+  // true if the layout of every IFD could be read
+  bool ok() const { return m_ok; }
+
+  size_t NumDirs() const { return m_offsets.size(); }
+  uint32_t NumChunks(size_t k) const { return m_offsets[k].size(); }
+
+  // file offset and byte count of chunk c of IFD k. Both are 0 for a
+  // chunk that was never written (a sparse tile)
+  uint64_t offset(size_t k, uint32_t c) const { return m_offsets[k][c]; }
+  uint64_t bytes(size_t k, uint32_t c) const { return m_bytes[k][c]; }
+
+  // every chunk of IFD k, in ascending file offset. Chunks with no
+  // data come first, in raster order
+  std::vector<uint32_t> FileOrder(size_t k) const;
+
+  // the IFDs, in ascending file offset of their chunk c
+  void DirOrder(uint32_t c, std::vector<uint32_t>& dirs) const;
+
+  // the order the chunks will be read in, for reached()
+  void SetOrder(const std::vector<ChunkRef>& order);
+
+  // The reader has got to item i of the order set by SetOrder: prefetch
+  // what comes after it, if that is not already on its way. Can be
+  // called from many threads at once
+  void reached(size_t i);
+
+ private:
+
+  bool m_ok = false;
+
+  int m_fd = -1;
+
+  // per IFD, per chunk
+  std::vector<std::vector<uint64_t>> m_offsets;
+  std::vector<std::vector<uint64_t>> m_bytes;
+
+  // read order, and bytes in it before each item (one extra at the end)
+  std::vector<ChunkRef> m_order;
+  std::vector<uint64_t> m_cum;
+
+  // first item of the order not yet prefetched
+  size_t m_next = 0;
+  std::mutex m_mtx;
+
+  // prefetch items [i0, i1) of the order
+  void __advise(size_t i0, size_t i1) const;
+
+};
+
+#endif
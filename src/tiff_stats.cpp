@@ -0,0 +1,180 @@
+#include "tiff_stats.h"
+#include "tiff_tiles.h"
+#include "tiff_utils.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <tiffio.h>
+
+void SampleStats::merge(const SampleStats& o) {
+
+  count += o.count;
+  sum += o.sum;
+  sumsq += o.sumsq;
+  min = std::min(min, o.min);
+  max = std::max(max, o.max);
+
+  if (hist.size() < o.hist.size())
+    hist.resize(o.hist.size(), 0);
+  for (size_t i = 0; i < o.hist.size(); i++)
+    hist[i] += o.hist[i];
+  
+}
+
+void SampleStats::from_hist() {
+
+  for (size_t v = 0; v < hist.size(); v++) {
+    const uint64_t c = hist[v];
+    if (c == 0)
+      continue;
+    count += c;
+    sum += c * v;
+    sumsq += static_cast<unsigned __int128>(c) * v * v;
+    min = std::min<uint64_t>(min, v);
+    max = std::max<uint64_t>(max, v);
+  }
+  
+}
+
+double SampleStats::mean() const {
+  if (count == 0)
+    return 0;
+  return static_cast<long double>(sum) / count;
+}
+
+double SampleStats::stdev() const {
+  if (count == 0)
+    return 0;
+  long double m = static_cast<long double>(sum) / count;
+  long double var = static_cast<long double>(sumsq) / count - m * m;
+  return var > 0 ? std::sqrt(var) : 0;
+}
+
+double SampleStats::percentile(double p) const {
+
+  if (hist.empty() || count == 0)
+    return -1;
+
+  uint64_t k = static_cast<uint64_t>(p / 100.0 * count);
+  if (k >= count)
+    k = count - 1;
+
+  uint64_t cum = 0;
+  for (size_t v = 0; v < hist.size(); v++) {
+    cum += hist[v];
+    if (cum > k)
+      return v;
+  }
+  return hist.size() - 1;
+}
+
+// add the pixels of one decoded tile or strip to the per-sample stats.
+// buf holds `rows` rows of `row_bytes` each, of which the first `cols`
+// pixels are inside the image. Pixels have `spp` interleaved samples,
+// the first of which is sample `s0` of the IFD
+template <typename T>
+static void __accumulate(const uint8_t* buf, uint64_t rows, uint64_t cols,
+			 uint64_t row_bytes, int spp, int s0, 
+			 std::vector<SampleStats>& st) {
+
+  const bool use_hist = sizeof(T) <= 2;
+  
+  for (int s = 0; s < spp; s++) {
+    SampleStats& a = st[s0 + s];
+
+    if (use_hist) {
+      uint64_t* hist = a.hist.data();
+      for (uint64_t r = 0; r < rows; r++) {
+	const T* row = reinterpret_cast<const T*>(buf + r * row_bytes) + s;
+	for (uint64_t c = 0; c < cols; c++)
+	  hist[row[c * spp]]++;
+      }
+    } else {
+      uint64_t sum = 0, mn = a.min, mx = a.max;
+      unsigned __int128 sumsq = 0;
+      for (uint64_t r = 0; r < rows; r++) {
+	const T* row = reinterpret_cast<const T*>(buf + r * row_bytes) + s;
+	for (uint64_t c = 0; c < cols; c++) {
+	  const uint64_t v = row[c * spp];
+	  sum += v;
+	  sumsq += v * v;
+	  mn = std::min(mn, v);
+	  mx = std::max(mx, v);
+	}
+      }
+      a.count += rows * cols;
+      a.sum += sum;
+      a.sumsq += sumsq;
+      a.min = mn;
+      a.max = mx;
+    }
+  }
+}
+
+int ComputeIFDStats(const std::string& filename, uint64_t offset,
+		    int threads, std::vector<SampleStats>& stats, bool sequential) {
+
+  if (threads < 1)
+    threads = 1;
+
+  // tiles (or strips) in raster order, or in file order with prefetch
+  // if sequential. For separate planes, the chunks of plane s follow
+  // all of those of plane s-1
+  TileExec exec;
+  exec.threads = threads;
+  exec.sequential = sequential;
+  TileLoop loop(filename, {offset}, exec);
+  if (!loop.ok())
+    return 1;
+
+  const uint16_t bps = loop.BitsPerSample();
+  const uint16_t spp = loop.SamplesPerPixel();
+  if (bps != 8 && bps != 16 && bps != 32) {
+    fprintf(stderr, "Error: stats for %d bits per sample not supported\n", bps);
+    return 1;
+  }
+  const int chunk_spp = loop.contig() ? spp : 1;
+
+  // one partial result per thread, merged in thread order at the end
+  const size_t nbins = bps <= 16 ? (size_t(1) << bps) : 0;
+  std::vector<std::vector<SampleStats>> partial(threads, std::vector<SampleStats>(spp));
+  for (auto& p : partial)
+    for (auto& s : p)
+      s.hist.assign(nbins, 0);
+  
+  const int error = loop.run([&](TileView& v) {
+      const int s0 = loop.contig() ? 0 : v.plane;
+      const uint8_t* buf = v.at(0, v.x, v.y);
+      switch (bps) {
+      case 8:
+	__accumulate<uint8_t>(buf, v.h, v.w, v.stride, chunk_spp, s0, partial[v.thread]);
+	break;
+      case 16:
+	__accumulate<uint16_t>(buf, v.h, v.w, v.stride, chunk_spp, s0, partial[v.thread]);
+	break;
+      case 32:
+	__accumulate<uint32_t>(buf, v.h, v.w, v.stride, chunk_spp, s0, partial[v.thread]);
+	break;
+      }
+      return 0;
+    });
+
+  if (error)
+    return 1;
+
+  // deterministic merge, always in thread order
+  stats.assign(spp, SampleStats());
+  for (auto& s : stats)
+    s.hist.assign(nbins, 0);
+  for (int t = 0; t < threads; t++)
+    for (int s = 0; s < spp; s++)
+      stats[s].merge(partial[t][s]);
+
+  // for histogram data the scalar accumulators come from the bins
+  if (nbins)
+    for (auto& s : stats)
+      s.from_hist();
+  
+  return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef TIFF_STATS_H
+#define TIFF_STATS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// pixel statistics for one sample (e.g. the single gray channel
+// of a cycif IFD, or one of R, G, B) of one IFD.
+// All of the accumulators are integers, so merging the partial
+// results from different threads is exact and order independent
+struct SampleStats {
+
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  unsigned __int128 sumsq = 0;
+  uint64_t min = UINT64_MAX;
+  uint64_t max = 0;
+
+  // one bin per possible value, for 8 and 16 bit data only
+  std::vector<uint64_t> hist;
+
+  // fold another partial result into this one
+  void merge(const SampleStats& o);
+
+  // fill count, sum, sumsq, min and max from the histogram
+  void from_hist();
+  
+  double mean() const;
+
+  // population standard deviation
+  double stdev() const;
+
+  // the value at percentile p (0-100), same convention as sorting
+  // the pixels and taking element floor(p/100 * count).
+  // Returns -1 if there is no histogram (e.g. 32-bit data)
+  double percentile(double p) const;
+  
+};
+
+// compute the statistics of every sample in the IFD at file offset
+// `offset` of `filename`, with tiles (or strips) split across threads
+// each with its own TIFF handle. If sequential, the chunks are read in
+// file offset order with prefetch (see ChunkSchedule), which only
+// changes the I/O pattern, not the result. Returns non-zero on error
+int ComputeIFDStats(const std::string& filename, uint64_t offset,
+		    int threads, std::vector<SampleStats>& stats,
+		    bool sequential = false);
+
+#endif
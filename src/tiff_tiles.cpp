@@ -0,0 +1,314 @@
+#include "tiff_tiles.h"
+#include "tiff_schedule.h"
+#include "tiff_utils.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <map>
+
+#include <omp.h>
+
+TileLoop::TileLoop(const std::string& filename, const std::vector<uint64_t>& dirs,
+		   const TileExec& exec, const TileRegion& region)
+  : TileLoop(std::vector<std::string>(dirs.size(), filename), dirs, exec, region) {}
+
+TileLoop::TileLoop(const std::vector<std::string>& files, const std::vector<uint64_t>& dirs,
+		   const TileExec& exec, const TileRegion& region) {
+
+  m_exec = exec;
+  if (m_exec.threads < 1)
+    m_exec.threads = 1;
+  m_batch = m_exec.threads == 1 ? 1 : 2 * m_exec.threads;
+  m_slots = 3 * m_batch;
+  m_dirs = dirs;
+
+  if (dirs.empty() || files.size() != dirs.size()) {
+    fprintf(stderr, "Error: a tile loop needs one file per IFD, and at least one IFD\n");
+    return;
+  }
+
+  // one pool of handles per file, with a column per IFD in it
+  std::map<std::string, size_t> pool_of;
+  std::vector<std::vector<uint64_t>> pool_dirs;
+  std::vector<std::string> pool_files;
+  for (size_t k = 0; k < dirs.size(); k++) {
+    auto it = pool_of.find(files[k]);
+    if (it == pool_of.end()) {
+      it = pool_of.emplace(files[k], pool_files.size()).first;
+      pool_files.push_back(files[k]);
+      pool_dirs.emplace_back();
+    }
+    m_where.emplace_back(it->second, pool_dirs[it->second].size());
+    pool_dirs[it->second].push_back(dirs[k]);
+  }
+  for (size_t p = 0; p < pool_files.size(); p++) {
+    m_pools.emplace_back(new TiffHandlePool(pool_files[p], m_exec.threads, pool_dirs[p]));
+    if (!m_pools.back()->ok()) {
+      fprintf(stderr, "Error: unable to open reader handles on %s\n", pool_files[p].c_str());
+      return;
+    }
+  }
+
+  if (m_exec.sequential && m_pools.size() > 1) {
+    fprintf(stderr, "Warning: tiles of separate files are read in raster order, not file order\n");
+    m_exec.sequential = false;
+  }
+  
+  if (__layout() || __order(region))
+    return;
+
+  m_views.resize(m_slots);
+  m_bufs.resize(m_slots * dirs.size());
+  m_sparse.resize(m_slots * dirs.size());
+  for (size_t s = 0; s < m_slots; s++) {
+    m_views[s].m_bufs = &m_bufs[s * dirs.size()];
+    m_views[s].m_sparse = &m_sparse[s * dirs.size()];
+  }
+  
+  m_ok = true;
+}
+
+TileLoop::~TileLoop() {}
+
+int TileLoop::__layout() {
+
+  for (size_t k = 0; k < m_dirs.size(); k++) {
+    TIFF* tif = handle(k);
+    uint32_t w = 0, h = 0, cw = 0, ch = 0;
+    uint16_t bps = 8, spp = 1, planar = PLANARCONFIG_CONTIG;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    const bool tiled = TIFFIsTiled(tif);
+    if (tiled) {
+      TIFFGetField(tif, TIFFTAG_TILEWIDTH, &cw);
+      TIFFGetField(tif, TIFFTAG_TILELENGTH, &ch);
+    } else {
+      uint32_t rps = 0;
+      TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rps);
+      cw = w;
+      ch = std::min(rps, h);
+    }
+    const bool contig = planar == PLANARCONFIG_CONTIG || spp == 1;
+
+    if (k == 0) {
+      m_width = w;
+      m_height = h;
+      m_tiled = tiled;
+      m_chunk_w = cw;
+      m_chunk_h = ch;
+      m_bps = bps;
+      m_spp = spp;
+      m_contig = contig;
+      m_chunk_bytes = tiled ? TIFFTileSize(tif) : TIFFStripSize(tif);
+    } else if (w != m_width || h != m_height || tiled != m_tiled || cw != m_chunk_w ||
+	       ch != m_chunk_h || bps != m_bps || spp != m_spp || contig != m_contig) {
+      fprintf(stderr, "Error: IFD at offset %llu does not match the size, tiling or samples of the one at %llu\n",
+	      (unsigned long long)m_dirs[k], (unsigned long long)m_dirs[0]);
+      return 1;
+    }
+  }
+
+  if (m_bps % 8) {
+    fprintf(stderr, "Error: tiles need whole-byte samples, not %d bits\n", m_bps);
+    return 1;
+  }
+  if (m_width == 0 || m_height == 0 || m_chunk_w == 0 || m_chunk_h == 0) {
+    fprintf(stderr, "Error: bad image or tile size on IFD at offset %llu\n",
+	    (unsigned long long)m_dirs[0]);
+    return 1;
+  }
+  m_pixel_bytes = static_cast<uint64_t>(m_contig ? m_spp : 1) * m_bps / 8;
+  m_stride = m_chunk_w * m_pixel_bytes;
+  if (m_chunk_bytes < static_cast<tmsize_t>(m_stride * m_chunk_h)) {
+    fprintf(stderr, "Error: bad tile / strip layout on IFD at offset %llu\n",
+	    (unsigned long long)m_dirs[0]);
+    return 1;
+  }
+  return 0;
+}
+
+int TileLoop::__order(const TileRegion& region) {
+
+  // clip the region to the image
+  m_rx0 = std::min(region.x, m_width);
+  m_ry0 = std::min(region.y, m_height);
+  m_rx1 = region.w > m_width - m_rx0 ? m_width : m_rx0 + region.w;
+  m_ry1 = region.h > m_height - m_ry0 ? m_height : m_ry0 + region.h;
+  if (m_rx0 >= m_rx1 || m_ry0 >= m_ry1)
+    return 0;
+
+  // the chunks touching it, plane by plane for separate planes, the
+  // way the chunks of such an IFD are numbered
+  const uint64_t across = (m_width + m_chunk_w - 1) / m_chunk_w;
+  const uint64_t down = (m_height + m_chunk_h - 1) / m_chunk_h;
+  const uint32_t planes = m_contig ? 1 : m_spp;
+  for (uint32_t p = 0; p < planes; p++)
+    for (uint64_t cy = m_ry0 / m_chunk_h; cy <= (m_ry1 - 1) / m_chunk_h; cy++)
+      for (uint64_t cx = m_rx0 / m_chunk_w; cx <= (m_rx1 - 1) / m_chunk_w; cx++)
+	m_order.push_back(static_cast<uint32_t>((p * down + cy) * across + cx));
+
+  if (!m_exec.sequential)
+    return 0;
+
+  // file order, keeping only the chunks in the region, and prefetch
+  // every IFD's chunk of each tile in turn
+  m_sched.reset(new ChunkSchedule(handle(0), m_dirs));
+  if (!m_sched->ok())
+    return 1;
+  std::vector<uint8_t> keep(m_sched->NumChunks(0), 0);
+  for (const auto& c : m_order)
+    if (c < keep.size())
+      keep[c] = 1;
+  m_order.clear();
+  for (const auto& c : m_sched->FileOrder(0))
+    if (keep[c])
+      m_order.push_back(c);
+  
+  std::vector<ChunkRef> refs;
+  for (const auto& c : m_order)
+    for (size_t k = 0; k < m_dirs.size(); k++)
+      refs.push_back({static_cast<uint32_t>(k), c});
+  m_sched->SetOrder(refs);
+  return 0;
+}
+
+void TileLoop::__view(size_t slot, size_t i, int t) {
+
+  const uint32_t c = m_order[i];
+  const uint64_t across = (m_width + m_chunk_w - 1) / m_chunk_w;
+  const uint64_t per_plane = across * ((m_height + m_chunk_h - 1) / m_chunk_h);
+
+  TileView& v = m_views[slot];
+  v.chunk = c;
+  v.plane = c / per_plane;
+  v.x0 = (c % per_plane) % across * m_chunk_w;
+  v.y0 = (c % per_plane) / across * m_chunk_h;
+  v.x = std::max(v.x0, m_rx0);
+  v.y = std::max(v.y0, m_ry0);
+  v.w = std::min(v.x0 + m_chunk_w, m_rx1) - v.x;
+  v.h = std::min(v.y0 + m_chunk_h, m_ry1) - v.y;
+  v.stride = m_stride;
+  v.pixel_bytes = m_pixel_bytes;
+  v.thread = t;
+  v.slot = slot;
+}
+
+int TileLoop::__decode(size_t slot, size_t i, size_t k, int t) {
+
+  if (m_sched)
+    m_sched->reached(i * m_dirs.size() + k);
+
+  const uint32_t c = m_order[i];
+  TIFF* tif = __handle(t, k);
+  if (tif == NULL)
+    return 1;
+  uint8_t* buf = m_buffers->get(slot, k);
+  m_bufs[slot * m_dirs.size() + k] = buf;
+  m_sparse[slot * m_dirs.size() + k] = TIFFGetStrileByteCount(tif, c) == 0;
+  if (ReadEncodedChunk(tif, c, buf, m_chunk_bytes) < 0) {
+    fprintf(stderr, "Error reading %s %u of IFD at offset %llu\n", m_tiled ? "tile" : "strip",
+	    c, (unsigned long long)m_dirs[k]);
+    return 1;
+  }
+  return 0;
+}
+
+int TileLoop::run(const TileFn& fn, const TileFn& done) {
+
+  if (!m_ok)
+    return 1;
+  
+  const int threads = m_exec.threads;
+  const size_t nd = m_dirs.size();
+  const size_t num = m_order.size();
+  std::atomic<int> err(0);
+  
+  // tiles finish in any order: each worker takes a tile, decodes it
+  // into its own row of buffers and runs fn on it
+  if (!done) {
+    m_buffers.reset(new TileBufferPool(threads, nd, m_chunk_bytes));
+    if (!m_buffers->ok())
+      return 1;
+    
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t i = 0; i < num; i++) {
+      if (err)
+	continue;
+      const int t = omp_get_thread_num();
+      __view(t, i, t);
+      int bad = 0;
+      for (size_t k = 0; k < nd && !bad; k++)
+	bad = __decode(t, i, k, t);
+      if (bad || fn(m_views[t]))
+	err = 1;
+    }
+    return err;
+  }
+
+  // in order: batches of m_batch tiles, in three banks of slots that
+  // take turns, so that while batch b is decoded, fn runs on batch
+  // b - 1 and done on batch b - 2. done runs on one worker at a time,
+  // which joins the others when it is through
+  m_buffers.reset(new TileBufferPool(m_slots, nd, m_chunk_bytes));
+  if (!m_buffers->ok())
+    return 1;
+
+  const size_t batches = (num + m_batch - 1) / m_batch;
+  auto count = [&](size_t b) { return std::min(m_batch, num - b * m_batch); };
+  auto slot = [&](size_t b, size_t j) { return b % 3 * m_batch + j; };
+  
+  for (size_t b = 0; b < batches + 2 && !err; b++) {
+
+    // tiles to decode, to run fn on and to finish in this round
+    const size_t n0 = b < batches ? count(b) : 0;
+    const size_t n1 = b >= 1 && b <= batches ? count(b - 1) : 0;
+    const size_t n2 = b >= 2 ? count(b - 2) : 0;
+
+#pragma omp parallel num_threads(threads)
+    {
+      const int t = omp_get_thread_num();
+
+      // append batch b - 2, in order
+#pragma omp single nowait
+      for (size_t j = 0; j < n2 && !err; j++)
+	if (done(m_views[slot(b - 2, j)]))
+	  err = 1;
+
+      // work on batch b - 1
+#pragma omp for schedule(dynamic) nowait
+      for (size_t j = 0; j < n1; j++) {
+	if (err)
+	  continue;
+	TileView& v = m_views[slot(b - 1, j)];
+	v.thread = t;
+	if (fn(v))
+	  err = 1;
+      }
+
+      // decode batch b, the chunk of each IFD of each tile separately
+#pragma omp for schedule(dynamic) nowait
+      for (size_t j = 0; j < n0 * nd; j++) {
+	if (err)
+	  continue;
+	const size_t i = b * m_batch + j / nd;
+	if (__decode(slot(b, j / nd), i, j % nd, t))
+	  err = 1;
+	else if (j % nd == 0)
+	  __view(slot(b, j / nd), i, t);
+      }
+    }
+  }
+  
+  return err;
+}
+
+int ForEachTile(const std::string& filename, const std::vector<uint64_t>& dirs,
+		const TileRegion& region, const TileFn& fn, const TileExec& exec) {
+
+  TileLoop loop(filename, dirs, exec, region);
+  return loop.ok() ? loop.run(fn) : 1;
+}
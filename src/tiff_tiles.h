@@ -0,0 +1,208 @@
+#ifndef TIFF_TILES_H
+#define TIFF_TILES_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tiffio.h>
+
+#include "tiff_pool.h"
+#include "tile_buffer.h"
+
+class ChunkSchedule;
+
+// a window of an image, in pixels. The default is the whole image
+struct TileRegion {
+  uint64_t x = 0;
+  uint64_t y = 0;
+  uint64_t w = UINT64_MAX;
+  uint64_t h = UINT64_MAX;
+};
+
+// how a TileLoop runs its tiles
+struct TileExec {
+
+  // workers, on the OpenMP thread team. 1 runs every tile on the
+  // calling thread, in order, which is the one to debug with
+  int threads = 1;
+
+  // take the tiles in file offset order, with prefetch (see
+  // ChunkSchedule), for files on NFS or spinning disks. Only for loops
+  // whose IFDs are all in one file
+  bool sequential = false;
+};
+
+// One tile (or strip) position, decoded from each IFD of a TileLoop.
+// Buffers hold the whole chunk, padding and all, but only the pixels
+// in [x, x + w) x [y, y + h) are in both the image and the region, so
+// edge tiles are described exactly
+struct TileView {
+
+  uint32_t chunk = 0;        // tile / strip number, the same in every IFD
+  uint32_t plane = 0;        // sample plane, for PLANARCONFIG_SEPARATE
+  uint64_t x0 = 0, y0 = 0;   // top left of the whole chunk, in image pixels
+  uint64_t x = 0, y = 0;     // top left of the part to use
+  uint64_t w = 0, h = 0;     // and its size
+  uint64_t stride = 0;       // bytes from one row of a buffer to the next
+  uint64_t pixel_bytes = 0;  // bytes per pixel of a buffer
+
+  int thread = 0;            // worker running this tile
+  size_t slot = 0;           // row of TileLoop::NumSlots() that is this tile's
+
+  // decoded chunk of IFD k. It belongs to the caller until the tile is
+  // done, and can be changed in place
+  uint8_t* get(size_t k) const { return m_bufs[k]; }
+
+  template <typename T>
+  T* as(size_t k) const { return reinterpret_cast<T*>(m_bufs[k]); }
+
+  // pixel (px, py) of the image, in the buffer of IFD k
+  uint8_t* at(size_t k, uint64_t px, uint64_t py) const {
+    return m_bufs[k] + (py - y0) * stride + (px - x0) * pixel_bytes;
+  }
+
+  // true if the chunk was never written to IFD k (a sparse tile),
+  // which reads back as zeros
+  bool sparse(size_t k) const { return m_sparse[k] != 0; }
+
+ private:
+
+  friend class TileLoop;
+  uint8_t* const* m_bufs = NULL;
+  const uint8_t* m_sparse = NULL;
+};
+
+// runs on a tile, returning non-zero to stop the loop
+using TileFn = std::function<int(TileView&)>;
+
+// The tile loop the modules share: every tile (or strip) position of a
+// set of IFDs with the same layout, optionally just those touching a
+// region, decoded and handed to a function on exec.threads workers.
+// Each worker reads with its own handles (see TiffHandlePool) and
+// decodes into buffers from a TileBufferPool, so the loop allocates
+// nothing per tile. Tiles are shared out dynamically, so a worker that
+// gets cheap tiles takes more of them
+class TileLoop {
+
+ public:
+
+  // the IFDs at file offsets dirs of filename
+  TileLoop(const std::string& filename, const std::vector<uint64_t>& dirs,
+	   const TileExec& exec = TileExec(), const TileRegion& region = TileRegion());
+
+  // IFD k at offset dirs[k] of files[k]
+  TileLoop(const std::vector<std::string>& files, const std::vector<uint64_t>& dirs,
+	   const TileExec& exec = TileExec(), const TileRegion& region = TileRegion());
+
+  ~TileLoop();
+
+  // the loop holds handles and buffers, so no copying
+  TileLoop(const TileLoop&) = delete;
+  TileLoop& operator=(const TileLoop&) = delete;
+
+  // false if a file could not be opened, or the IFDs differ in layout
+  bool ok() const { return m_ok; }
+
+  // layout, the same in every IFD
+  uint64_t width() const { return m_width; }
+  uint64_t height() const { return m_height; }
+  bool tiled() const { return m_tiled; }
+  uint32_t ChunkWidth() const { return m_chunk_w; }
+  uint32_t ChunkHeight() const { return m_chunk_h; }
+  tmsize_t ChunkBytes() const { return m_chunk_bytes; }
+  uint16_t BitsPerSample() const { return m_bps; }
+  uint16_t SamplesPerPixel() const { return m_spp; }
+  bool contig() const { return m_contig; }
+
+  size_t NumDirs() const { return m_dirs.size(); }
+
+  // tiles the loop will visit
+  size_t NumChunks() const { return m_order.size(); }
+
+  // most tiles that can be in flight at once: slot is under this, for
+  // indexing per-tile buffers that need to last until done
+  size_t NumSlots() const { return m_slots; }
+
+  // a handle parked on IFD k, for reading its tags. Not to be used
+  // while the loop runs
+  TIFF* handle(size_t k) const { return __handle(0, k); }
+
+  // Run fn on every tile. Without done, tiles finish in any order.
+  // With done, tiles go through in batches: the chunks of each IFD of
+  // each tile of a batch are decoded together (so that IFDs in
+  // separate files are read at the same time), fn runs on each tile in
+  // parallel, then done on each, in order, one at a time, e.g. to
+  // append the tile to an output TIFF. The three overlap, so a batch
+  // is decoded while the one before it is in fn and the one before
+  // that in done, and done may run on any worker, while fn runs on
+  // others. Returns non-zero if a read failed or fn or done returned
+  // non-zero
+  int run(const TileFn& fn, const TileFn& done = TileFn());
+
+ private:
+
+  bool m_ok = false;
+
+  TileExec m_exec;
+  size_t m_batch = 1;
+  size_t m_slots = 1;
+
+  std::vector<uint64_t> m_dirs;
+
+  // one pool per file, and the pool and column of each IFD's handles
+  std::vector<std::unique_ptr<TiffHandlePool>> m_pools;
+  std::vector<std::pair<size_t, size_t>> m_where;
+
+  uint64_t m_width = 0;
+  uint64_t m_height = 0;
+  bool m_tiled = false;
+  uint32_t m_chunk_w = 0;
+  uint32_t m_chunk_h = 0;
+  tmsize_t m_chunk_bytes = 0;
+  uint16_t m_bps = 0;
+  uint16_t m_spp = 1;
+  bool m_contig = true;
+  uint64_t m_pixel_bytes = 0;
+  uint64_t m_stride = 0;
+
+  // the region, clipped to the image, as [x0, x1) x [y0, y1)
+  uint64_t m_rx0 = 0, m_rx1 = 0, m_ry0 = 0, m_ry1 = 0;
+
+  // chunks to visit, in the order they are taken, and their prefetch
+  std::vector<uint32_t> m_order;
+  std::unique_ptr<ChunkSchedule> m_sched;
+
+  // decode buffers, a row per slot (or per thread, without done)
+  std::unique_ptr<TileBufferPool> m_buffers;
+
+  // per slot: the view and its buffer pointers and sparse flags
+  std::vector<TileView> m_views;
+  std::vector<uint8_t*> m_bufs;
+  std::vector<uint8_t> m_sparse;
+
+  TIFF* __handle(int t, size_t k) const {
+    return m_pools[m_where[k].first]->get(t, m_where[k].second);
+  }
+
+  // read the layout and check the IFDs match
+  int __layout();
+
+  // the chunks touching the region, in raster or file order
+  int __order(const TileRegion& region);
+
+  // set view `slot` up for item i of the order
+  void __view(size_t slot, size_t i, int t);
+
+  // decode IFD k of item i into its slot
+  int __decode(size_t slot, size_t i, size_t k, int t);
+};
+
+// run fn on every tile of the IFDs at offsets dirs of filename that
+// touches region, see TileLoop::run
+int ForEachTile(const std::string& filename, const std::vector<uint64_t>& dirs,
+		const TileRegion& region, const TileFn& fn,
+		const TileExec& exec = TileExec());
+
+#endif
@@ -5,41 +5,33 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
-#include <unordered_set>
 #include <cstring>
 #include <algorithm> // for std::min and std::max and std::fill_n
 #include <cstdint>   // for uint16_t and uint8_t
+#include <array>
+#include <cmath>     // for std::lround
+#include <map>
+#include <memory>
+#include <numeric>   // for std::accumulate and std::iota
+#include <random>
 
 #include <omp.h>
 
 #include "channel.h"
+#include "tiff_pool.h"
+#include "tiff_raster.h"
+#include "tiff_schedule.h"
+#include "tiff_tiles.h"
+#include "tile_buffer.h"
+#include "pixel_kernels.h"
+#include "tiff_encoder.h"
+#include "tiff_reader.h"
+#include "image_draw.h"
+#include "image_io.h"
 
 #define MEAN_THRESHOLD 300
 #define DIFF_THRESHOLD 300
 
-// Define the struct with x and y members
-struct Point {
-    int x, y;
-  
-  // Equality comparison operator is needed for unordered_set
-  bool operator==(const Point& other) const {
-    return x == other.x && y == other.y;
-  }
-};
-
-// Specialize std::hash for the Point struct
-namespace std {
-  template<>
-  struct hash<Point> {
-    std::size_t operator()(const Point& p) const noexcept {
-      // Combine the hash of x and y in some way.
-      // A common approach is to use std::hash<int>() and then combine them.
-      // This example uses the shifting method to combine hashes but there are better methods.
-      return std::hash<int>()(p.x) ^ (std::hash<int>()(p.y) << 1);
-    }
-  };
-}
-
 // Macro to get a TIFF tag from the input and set it on the output.
 // Assumes `in` is the source TIFF* and `out` is the destination TIFF*.
 
@@ -87,6 +79,19 @@ RGBColor combineChannelsToRGB(const std::vector<uint16_t>& values, const std::ve
     return rgb;
 }
 
+// lookup table for the windowing of one channel, for ColorizeU16.
+// Built from affineTransformUint8 itself, so the levels match it exactly
+static ChannelLUT __channel_lut(const Channel& c) {
+  ChannelLUT lut;
+  lut.level.resize(U16_HIST_BINS);
+  for (size_t v = 0; v < lut.level.size(); v++)
+    lut.level[v] = affineTransformUint8(v, c.lowerBound, c.upperBound);
+  lut.r = c.color.r;
+  lut.g = c.color.g;
+  lut.b = c.color.b;
+  return lut;
+}
+
 // Function to allocate memory for N channels, each of a specified size
 uint16_t** allocateChannels(size_t numChannels, size_t tileSize) {
     // Allocate an array of pointers to hold the addresses of the arrays for each channel
@@ -123,6 +128,22 @@ void freeChannels(uint16_t** channels, size_t numChannels) {
     }
 }
 
+tmsize_t ReadEncodedChunk(TIFF* tif, uint32_t c, void* buf, tmsize_t size) {
+
+  const bool tiled = TIFFIsTiled(tif);
+  const tmsize_t full = tiled ? TIFFTileSize(tif) : TIFFStripSize(tif);
+  if (size < 0 || size > full)
+    size = full;
+  
+  if (TIFFGetStrileByteCount(tif, c) == 0) {
+    std::memset(buf, 0, size);
+    return size;
+  }
+
+  return tiled ? TIFFReadEncodedTile(tif, c, buf, size) :
+    TIFFReadEncodedStrip(tif, c, buf, size);
+}
+
 static void __gray8assert(TIFF* in) {
   
   uint16_t bps, photo;
@@ -133,237 +154,242 @@ static void __gray8assert(TIFF* in) {
   
 }
 
-int Compress(TIFF* in, TIFF* out) {
+// true if tiles can be moved from in to out still compressed, which
+// needs the same codec, predictor and byte order on both sides. JPEG
+// tiles also depend on tables stored in the directory, so they are not
+static bool __raw_copy_ok(TIFF* in, TIFF* out) {
+
+  uint16_t c_in = 0, c_out = 0;
+  TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &c_in);
+  TIFFGetFieldDefaulted(out, TIFFTAG_COMPRESSION, &c_out);
+  if (c_in != c_out || c_in == COMPRESSION_JPEG || c_in == COMPRESSION_OJPEG)
+    return false;
+
+  uint16_t p_in = 0, p_out = 0;
+  TIFFGetField(in, TIFFTAG_PREDICTOR, &p_in);
+  TIFFGetField(out, TIFFTAG_PREDICTOR, &p_out);
+  if (p_in != p_out)
+    return false;
+  
+  return TIFFIsByteSwapped(in) == TIFFIsByteSwapped(out);
+}
+
+// copy tile t from in to out without decoding it. buf is grown as
+// needed and reused between calls. Empty (sparse) tiles stay empty
+static int __copy_raw_tile(TIFF* in, TIFF* out, ttile_t t, std::vector<uint8_t>& buf) {
 
+  uint64_t bc = TIFFGetStrileByteCount(in, t);
+  if (bc == 0)
+    return 0;
+  
+  if (buf.size() < bc)
+    buf.resize(bc);
+  if (TIFFReadRawTile(in, t, buf.data(), bc) < 0)
+    return 1;
+  if (TIFFWriteRawTile(out, t, buf.data(), bc) < 0)
+    return 1;
+  return 0;
+}
+
+int ResolveThreads(int threads) {
+  return threads > 0 ? threads : std::max(omp_get_num_procs(), 1);
+}
+
+int LevelOffsets(TIFF* in, int level, std::vector<uint64_t>& offsets) {
+
+  if (level < 0) {
+    fprintf(stderr, "Error: level must be 0 or more, not %d\n", level);
+    return 1;
+  }
+  
+  TiffReader reader(TIFFFileName(in));
+  if (reader.get() == NULL)
+    return 1;
+  return reader.LevelOffsets(level, offsets);
+}
+
+int Compress(TIFF* in, TIFF* out, bool sparse, bool verbose, int threads, int level,
+	     const CodecOptions& codec) {
+
+  // the channels, at the requested resolution level, so that the
+  // reader handles for each channel can jump straight to it
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, level, offsets))
+    return 1;
+  
   // display number of directories / channels
-  int num_dir = TIFFNumberOfDirectories(in);
-  std::cerr << "Number of channels in image: " << num_dir << std::endl;
+  int num_dir = offsets.size();
+  if (verbose)
+    std::cerr << "Number of channels in image: " << num_dir << std::endl;
 
-  // vector index is channel num
-  std::vector<std::unordered_set<Point>> xy_to_keep;
+  tmsize_t max_ts = 0;
+  for (int n = 0; n < num_dir; n++) {
+    if (!TIFFSetSubDirectory(in, offsets[n])) {
+      fprintf(stderr, "Error: unable to read directory %d\n", n);
+      return 1;
+    }
+    if (!TIFFIsTiled(in)) {
+      fprintf(stderr, "Error: compress requires a tiled TIFF, channel %d is not\n", n);
+      return 1;
+    }
+    max_ts = std::max(max_ts, TIFFTileSize(in));
+    uint16_t bps = 0, spp = 1;
+    TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    if (bps != 16 || spp != 1) {
+      fprintf(stderr, "Error: compress requires single-sample 16-bit channels, channel %d is %d x %d-bit\n",
+	      n, spp, bps);
+      return 1;
+    }
+  }
+
+  if (threads < 1)
+    threads = 1;
+
+  // keep[n][t] is 1 if tile t of channel n has signal
+  std::vector<std::vector<uint8_t>> keep(num_dir);
+
+  // a histogram per thread for the tile summaries, and one tile for
+  // writing, for every channel
+  TileBufferPool hists(threads, 1, U16_HIST_BINS * sizeof(uint32_t));
+  TileBufferPool tiles(1, 1, max_ts);
+  if (!hists.ok() || !tiles.ok())
+    return 1;
   
   // loop each channel
   for (int n = 0; n < num_dir; n++) {
 
-    // drop factor
-    float drop = 0;
+    TIFFSetSubDirectory(in, offsets[n]);
     
-    TIFFSetDirectory(in, n);
+    const ttile_t num_tiles = TIFFNumberOfTiles(in);
+    const tmsize_t ts = TIFFTileSize(in);
+    const size_t arrSize = ts / sizeof(uint16_t);
+    keep[n].assign(num_tiles, 0);
+
+    // the tiles of this channel, split over the threads
+    TileExec exec;
+    exec.threads = threads;
+    TileLoop loop(TIFFFileName(in), {offsets[n]}, exec);
+    if (!loop.ok()) {
+      std::cerr << "Error: unable to open reader handles for compress" << std::endl;
+      return 1;
+    }
 
-#ifdef WRITEOUT
-    
-    // Create a new directory for the output file
-    if (n > 0) {  // No need to create the first directory, it's automatically created
-      // Finalize the previous directory and create new one
-      if (!TIFFWriteDirectory(out)) {
-	std::cerr << "Error: Could not write output directory " << n << std::endl;
-	return 1;
-      }
+    std::vector<size_t> drops(threads, 0);
+    const int err = loop.run([&](TileView& v) {
+
+	// tile mean and 5th / 95th percentiles in one pass, over the
+	// whole tile
+	uint64_t sum = 0;
+	uint16_t percentile_5 = 0, percentile_95 = 0;
+	TileSummaryU16(v.as<uint16_t>(0), arrSize, 0.05, 0.95, hists.as<uint32_t>(v.thread, 0),
+		       sum, percentile_5, percentile_95);
+	uint16_t diff = percentile_95 - percentile_5;
+	
+	// if mean or spread is above threshold, then this is a GOOD tile
+	if ( (sum / arrSize) >= MEAN_THRESHOLD || diff > DIFF_THRESHOLD)
+	  keep[n][v.chunk] = 1;
+	else
+	  drops[v.thread]++;
+	return 0;
+      });
+    const size_t drop = std::accumulate(drops.begin(), drops.end(), size_t(0));
+
+    if (err) {
+      fprintf(stderr, "Error reading input channel %d tiles\n", n);
+      return 1;
     }
     
-    // copy fields
-    tiffcpjw(in, out);
+    if (verbose)
+      std::cerr << "...finished channel " << n << " - " << num_tiles <<
+	" tiles, drop rate " << (num_tiles ? (double)drop / num_tiles : 0) << std::endl;
+  } // end channel loop
 
-    assert(TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_LZW));
-#else
-    // get image dimensions
-    uint64_t m_height = 0;
-    uint64_t m_width = 0;
-    TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &m_width);
-    TIFFGetField(in, TIFFTAG_IMAGELENGTH, &m_height);
-#endif
-    
-    if (TIFFIsTiled(in)) {
+  ///////
+  // write the image
+  ///////
 
-      // copy tile info
-     uint64_t tileheight = 0, tilewidth = 0;
-#ifdef WRITEOUT      
-      COPY_TIFF_TAG(in, out, TIFFTAG_TILEWIDTH, tilewidth);
-      COPY_TIFF_TAG(in, out, TIFFTAG_TILELENGTH, tileheight);
-#else
-      TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth);
-      TIFFGetField(in, TIFFTAG_TILELENGTH, &tileheight);
-#endif
-      
-      // tile calculation
-      assert(tileheight);
-      assert(tilewidth);      
-      uint32_t tiles_across = (m_width + tilewidth - 1) / tilewidth;
-      uint32_t tiles_down   = (m_height + tileheight - 1) / tileheight;
-      uint32_t tiles_per_image = tiles_across * tiles_down;
-
-      uint64_t ts = TIFFTileSize(in);
-      
-      // allocate memory for a single tile
-      uint16_t* itile = (uint16_t*)calloc(ts/ 2, sizeof(uint16_t));
-      if (itile == nullptr) {
-	std::cerr << "Memory allocation for channels failed." << std::endl;
-	assert(false);
-      }
-      
-      // loop through the tiles
-      uint64_t x, y;
-      uint64_t m_pix = 0;
-      size_t num_tiles = 0;
-      for (y = 0; y < m_height; y += tileheight) {
-	for (x = 0; x < m_width; x += tilewidth) {
-	  
-	  num_tiles++;
-	  // Read the input tile
-	  if (TIFFReadTile(in, itile, x, y, 0, 0) < 0) {
-	    fprintf(stderr, "Error reading input channel %d tile at (%llu, %llu)\n", n, x, y);
-	    return 1;
-	  }
+  std::vector<uint8_t> raw_tile;
+  for (int n = 0; n < num_dir; n++) {
 
-	  // sort a copy of this array to get quantiles
-	  int arrSize = ts / 2;
-	  //uint16_t arrCopy[arrSize];
-	  uint16_t* arrCopy = new uint16_t[arrSize];
-	  std::memcpy(arrCopy, itile, arrSize * sizeof(uint16_t)); 
-	  std::sort(arrCopy, arrCopy + arrSize);
+    // copy the tifftags
+    TIFFSetSubDirectory(in, offsets[n]);
+    tiffcpjw(in, out);
 
-	  uint16_t percentile_95 = arrCopy[static_cast<int>(0.95 * arrSize)];
-	  uint16_t percentile_5 = arrCopy[static_cast<int>(0.05 * arrSize)];
-	  uint16_t diff = percentile_95 - percentile_5;
+    // a reduced resolution level is written out as an image of its own
+    if (level > 0)
+      TIFFSetField(out, TIFFTAG_SUBFILETYPE, 0);
 
-	  delete[] arrCopy;
-	  
-	  // get the mean for the tile
-	  uint64_t sum = 0;
-	  for (size_t i = 0; i < arrSize; i++) {
-	    sum += itile[i];
-	  }
+    // get tile sizes
+    uint32_t tileheight = 0, tilewidth = 0;
+    COPY_TIFF_TAG(in, out, TIFFTAG_TILEWIDTH, tilewidth);
+    COPY_TIFF_TAG(in, out, TIFFTAG_TILELENGTH, tileheight);
 
-	  // if mean is above threshold, then copy data
-	  if ( (sum / arrSize) >= MEAN_THRESHOLD || diff > DIFF_THRESHOLD) {
-	    //memcpy(otile, itile, (arrSize) * sizeof(uint16_t));
-	    // OLD // std::fill_n(otile, arrSize, static_cast<uint8_t>(255));
-
-	    //Note that std::memset sets every byte to the specified value.
-	    // If otile actually points to an array of uint16_t,
-	    // and you use std::memset(otile, 255, arrSize * sizeof(uint16_t));
-	    //each byte is set to 0xFF, meaning that each uint16_t element will
-	    //be 0xFFFF because memset works on a byte level.
-	    
-	    Point p;
-	    p.x = x;
-	    p.y = y;
-	    
-	    // this is a GOOD tile
-	    if (n == xy_to_keep.size()) {
-	      std::unordered_set<Point> pair;
-	      pair.insert(p);
-	      xy_to_keep.push_back(pair);
-	    } else {
-	      xy_to_keep[n].insert(p);
-	    }
-
-	    std::cerr << " keeping " << x << "," << y << " Mean " <<
-	      (sum / arrSize) << " diff " << diff << std::endl;
-	  } else {
-	    std::cerr << " mean: " << (sum / arrSize)  << " 5% " <<
-	    percentile_5 << " 9% " << percentile_95 <<  " diff " <<
-	    diff << std::endl;
-#ifdef WRITEOUT	    
-	    std::memset(otile, 255, arrSize * sizeof(uint8_t));
-#endif	    
-	    drop++;
-	  }
+    const ttile_t num_tiles = keep[n].size();
+    
+    // sparse: signal tiles go through as they are, and background
+    // tiles are never written, so they end up with a zero offset and
+    // byte count. They take no space, need no decoding, and read
+    // back as zeros (see ReadEncodedChunk)
+    if (sparse) {
+
+      // keep the predictor too, so that tiles can be copied over
+      // still compressed
+      uint16_t predictor = 0;
+      COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_PREDICTOR, predictor);
+      if (SetCodec(out, codec))
+	return 1;
 
-	  // x2 is because two bytes
-	  //std::cout << (sum / ts * 2) << std::endl;
-	  
-	  // Write the tile to the TIFF file
-	  // this function will automatically calculate memory size from TIFF tags
-#ifdef WRITEOUT	  
-	  if (TIFFWriteTile(out, otile, x, y, 0, 0) < 0) { 
-	    fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
+      // an explicit level means re-encoding, even with the same codec
+      const bool raw = codec.level < 0 && __raw_copy_ok(in, out);
+      const tmsize_t ts = TIFFTileSize(in);
+      uint8_t* tile = tiles.get(0, 0);
+      
+      for (ttile_t t = 0; t < num_tiles; t++) {
+	if (!keep[n][t])
+	  continue;
+	if (raw) {
+	  if (__copy_raw_tile(in, out, t, raw_tile)) {
+	    fprintf(stderr, "Error copying raw channel %d tile %u\n", n, t);
 	    return 1;
 	  }
-#endif	  
-	} // end x loop
-      } // end y loop
-
-#ifdef WRITEOUT      
-      std::cerr << "...finished channel " << n << " - " <<
-	m_height << " x " << m_width << 
-	" drop rate " << (drop/num_tiles) << std::endl;
-      free(otile);
-#endif      
-      free(itile);
-      
-    } // end tiff tiled?
-    
-    // not implemented yet, but this is TIFF is row
-    else {
-#ifdef WRITEOUT      
-      // strip offsets
-      uint32_t rows_per_strip = 0;    
-      COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
-      uint32_t strips_per_image = 0;
-      if (rows_per_strip)
-	strips_per_image = std::floor((m_height + rows_per_strip - 1) / rows_per_strip);
-#endif      
-      // missing STRIPOFFSETS
-      // missing STRIPBYTECOUNTS
-    }
-    break; // debug
-  } // end channel loop
-
-  // loop
-
-  ///////
-  // write the image
-  ///////
+	  continue;
+	}
+	if (ReadEncodedChunk(in, t, tile, ts) < 0 ||
+	    TIFFWriteEncodedTile(out, t, tile, ts) < 0) {
+	  fprintf(stderr, "Error copying channel %d tile %u\n", n, t);
+	  return 1;
+	}
+      }
 
-  // copy the tifftags
-  TIFFSetDirectory(in, 0);
-  tiffcpjw(in, out);
+    // mask: one 8-bit image per channel, 255 on kept tiles
+    } else {
 
-  TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-  TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-  TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-  TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
-  TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);
-
-  // get image dimensions
-  uint64_t m_height = 0;
-  uint64_t m_width = 0;
-  TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &m_width);
-  TIFFGetField(in, TIFFTAG_IMAGELENGTH, &m_height);
-  
-  // get tile sizes
-  uint64_t ts = TIFFTileSize(in);
-  uint64_t tileheight = 0, tilewidth = 0;
-  COPY_TIFF_TAG(in, out, TIFFTAG_TILEWIDTH, tilewidth);
-  COPY_TIFF_TAG(in, out, TIFFTAG_TILELENGTH, tileheight);
-  
-  // loop through the tiles
-  uint64_t x, y;
-  uint64_t m_pix = 0;
-  size_t num_tiles = 0;
-  for (y = 0; y < m_height; y += tileheight) {
-    for (x = 0; x < m_width; x += tilewidth) {
+      TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+      TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+      TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+      TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
+      TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);
+      if (SetCodec(out, codec))
+	return 1;
       
-      // allocated the output tile
-      void* otile = (void*)calloc(ts / 2, sizeof(uint8_t));  // div by 2 because uint16
+      // the two possible output tiles
+      const size_t ots = TIFFTileSize(out);
+      std::vector<uint8_t> on(ots, 255), off(ots, 0);
       
-      Point p;
-      p.x = x;
-      p.y = y;
-      if (xy_to_keep[0].find(p) != xy_to_keep[0].end()) {
-	std::memset(otile, 255, ts /2 * sizeof(uint8_t));	
-      }
-      if (TIFFWriteTile(out, otile, x, y, 0, 0) < 0) { 
-	fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
-	return 1;
+      for (ttile_t t = 0; t < num_tiles; t++) {
+	void* otile = keep[n][t] ? on.data() : off.data();
+	if (TIFFWriteEncodedTile(out, t, otile, ots) < 0) { 
+	  fprintf(stderr, "Error writing channel %d tile %u\n", n, t);
+	  return 1;
+	}
       }
     }
-  }
   
-  if (!TIFFWriteDirectory(out)) {
-    std::cerr << "Could not write final output directory " << std::endl;
-    return 1;
+    if (!TIFFWriteDirectory(out)) {
+      std::cerr << "Could not write output directory " << n << std::endl;
+      return 1;
+    }
   }
   
   return 0;
@@ -371,26 +397,28 @@ int Compress(TIFF* in, TIFF* out) {
 
 int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
 	     const std::vector<int>& channels_to_run,
-	     bool verbose) {
+	     bool verbose, int threads, int level, const CodecOptions& codec,
+	     bool sequential) {
 
-  // set compression
+  // set compression, LZW unless asked for something else
   TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+  if (SetCodec(out, codec))
+    return 1;
+
+  // the channels, at the requested resolution level
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, level, offsets))
+    return 1;
   
   // display number of directories / channels
-  int num_dir = TIFFNumberOfDirectories(in);
+  int num_dir = offsets.size();
   if (verbose)
     std::cerr << "Number of channels in image: " << num_dir << std::endl;
 
   ////// READ THE PALETTE
   ChannelVector channels;
-  std::ifstream file(palette_file);
-  std::string line; 
-  std::vector<std::string> headerItems; 
-  while (std::getline(file, line)) {
-    if (!line.empty() || line.at(0) == '#') {
-      channels.emplace_back(line); 
-    }
-  }
+  if (ReadPalette(palette_file, channels))
+    return 1;
 
   // input checking
   if (channels_to_run.size() == 0) {
@@ -398,13 +426,12 @@ int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
     return 0;
   }
 
-  // subset to just the channels that we want to colorize
-  ChannelVector channels_to_run_map;
-  for (auto n : channels_to_run) {
-    channels_to_run_map.push_back(channels.at(n));
-  }
-
   // error checking
+  int channel_min = *std::min_element(channels_to_run.begin(), channels_to_run.end());
+  if (channel_min < 0) {
+    fprintf(stderr, "Error: channel %d is not a channel number\n", channel_min);
+    return -1;
+  }
   int channel_max = *std::max_element(channels_to_run.begin(), channels_to_run.end());
   if (channel_max >= channels.size()) {
     fprintf(stderr, "Error: Max channel %d is larger than number of channels in the palette %zu\n", channel_max, channels.size());
@@ -417,6 +444,12 @@ int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
     return -1;
   }
 
+  // subset to just the channels that we want to colorize
+  ChannelVector channels_to_run_map;
+  for (auto n : channels_to_run) {
+    channels_to_run_map.push_back(channels.at(n));
+  }
+
   // print
   if (verbose)
     for (const auto& i : channels_to_run)
@@ -425,112 +458,81 @@ int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
 
   if (TIFFIsTiled(in)) {
     
-    // check that all of the tile sizes are the same
-    TIFFSetDirectory(in, channels_to_run[0]);
-    uint64_t ts = TIFFTileSize(in);
-    for (int i = 1; i < channels_to_run.size(); i++) {
-      TIFFSetDirectory(in, channels_to_run[i]);
-      assert(TIFFTileSize(in) == ts);
-    }
-
-    // get the image data for this
-    uint32_t tileheight = 0;
-    uint32_t tilewidth = 0;
-    uint32_t m_height = 0;
-    uint32_t m_width = 0;
-    
-    if (!TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &m_width)) {
-      std::cerr << " ERROR getting image width " << std::endl;
+    if (threads < 1)
+      threads = 1;
+
+    // The tiles go through a TileLoop over the selected channels: the
+    // channel tiles of each output tile are decoded on the workers,
+    // which blend them to RGB and compress the result, and the tiles
+    // are appended in order as they finish. With sequential, the input
+    // tiles are read in file order, with prefetch
+    std::vector<uint64_t> run_offsets;
+    for (auto n : channels_to_run)
+      run_offsets.push_back(offsets[n]);
+    TileExec exec;
+    exec.threads = threads;
+    exec.sequential = sequential;
+    TileLoop loop(TIFFFileName(in), run_offsets, exec);
+    if (!loop.ok()) {
+      std::cerr << "Error: unable to read the channels to colorize" << std::endl;
       return 1;
     }
-    if (!TIFFGetField(in, TIFFTAG_IMAGELENGTH, &m_height)) {
-      std::cerr << " ERROR getting image height " << std::endl;
+    if (loop.BitsPerSample() != 16 || loop.SamplesPerPixel() != 1) {
+      fprintf(stderr, "Error: colorize requires single-sample 16-bit channels\n");
       return 1;
     }
     
-    if (!TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth)) {
-      std::cerr << " ERROR getting tile width " << std::endl;
-      return 1;
-    }
-    if (!TIFFGetField(in, TIFFTAG_TILELENGTH, &tileheight)) {
-      std::cerr << " ERROR getting tile height " << std::endl;
-      return 1;
-    }
-    
-    // allocate memory for a single tile
-    uint16_t** channels = allocateChannels(channels_to_run.size(), ts / 2);
-    if (channels == nullptr) {
-      std::cerr << "Memory allocation for channels failed." << std::endl;
-      assert(false);
-    }
-
-    // allocated the RGB tile
-    void*     o_tile = (void*)calloc(ts / 2 * 3, sizeof(uint8_t));  // div by 2 because uint16 -> uint8, then *3 because R, G, B
+    const size_t num_channels = channels_to_run.size();
+    const uint32_t tiles_across = (loop.width() + loop.ChunkWidth() - 1) / loop.ChunkWidth();
+    const uint32_t tiles_down = (loop.height() + loop.ChunkHeight() - 1) / loop.ChunkHeight();
+    const size_t px = loop.ChunkBytes() / 2;
     
-    // storage for pixel values
-    std::vector<uint16_t> pixel_values;
-    pixel_values.resize(channels_to_run.size());
-    
-    // loop through the tiles
-    uint64_t x, y;
-    uint64_t m_pix = 0;
-    size_t tile_num = 1;
-
-    // num tiles, using divisor trick to round up
-    int num_tiles = ((m_height + tileheight - 1) / tileheight) * ((m_width + tilewidth - 1) / tilewidth);
+    // window and colour tables for each channel, built once up front
+    std::vector<ChannelLUT> luts;
+    for (const auto& c : channels_to_run_map)
+      luts.push_back(__channel_lut(c));
+
+    // compress in the workers when the output codec allows it
+    TiffTileEncoder encoder(out);
+    const bool raw = encoder.ok();
     
-    for (y = 0; y < m_height; y += tileheight) {
-      if (verbose)
-	std::cerr << "...working on tile " << tile_num << " of " << num_tiles << std::endl;
-      for (x = 0; x < m_width; x += tilewidth) {
-	tile_num++;
-	// copy in the 3tiles from channels
-	size_t channel_num = 0;
-	for (const auto& m : channels_to_run) {
-	  
-	  // Read the red tile
-	  TIFFSetDirectory(in, m);
-	  if (TIFFReadTile(in, channels[channel_num], x, y, 0, 0) < 0) {
-	    fprintf(stderr, "Error reading channel %d tile at (%llu, %llu)\n", m, x, y);
-	    return 1;
-	  }
-	  channel_num++;
-	}
-	
-	// copy the tile to the RGB, pixel by pixel
-	for (size_t i = 0; i < (ts / 2); ++i) {
-	  
-	  // copy the channel number + values to a map
-	  int n = 0;
-	  for (const auto& m : channels_to_run) {
-	    pixel_values[n] = channels[n][i];
-	    n++;
-	  }
-
-	  //RGBColor rgb = RGBColor(0,0,0);
-	  RGBColor rgb =
-	    combineChannelsToRGB(pixel_values, channels_to_run_map);
-	  
-	  static_cast<uint8_t*>(o_tile)[i*3    ] = rgb.r;
-	  static_cast<uint8_t*>(o_tile)[i*3 + 1] = rgb.g; //affineTransformUint8(g_tile[i], 200, 1500);
-	  static_cast<uint8_t*>(o_tile)[i*3 + 2] = rgb.b; //ffineTransformUint8(b_tile[i], 400, 1500);
+    // per slot: the RGB tile, and the compressed tile if raw. Blend
+    // scratch is per worker
+    TileBufferPool rgbs(loop.NumSlots(), 1, px * 3);
+    if (!rgbs.ok())
+      return 1;
+    std::vector<std::vector<uint8_t>> encoded(loop.NumSlots());
+    std::vector<ColorizeScratch> scratch(threads);
+    std::vector<std::vector<const uint16_t*>> src(threads, std::vector<const uint16_t*>(num_channels));
+
+    uint32_t written = 0;
+    const int err = loop.run([&](TileView& v) {
+	for (size_t k = 0; k < num_channels; k++)
+	  src[v.thread][k] = v.as<uint16_t>(k);
+	uint8_t* rgb = rgbs.get(v.slot, 0);
+	ColorizeU16(src[v.thread].data(), luts, px, rgb, scratch[v.thread]);
+	if (raw && encoder.encode(rgb, px * 3, encoded[v.slot])) {
+	  fprintf(stderr, "Error compressing tile %u\n", v.chunk);
+	  return 1;
 	}
+	return 0;
+      }, [&](TileView& v) {
+	if (verbose && written % tiles_across == 0)
+	  std::cerr << "...working on tile row " << (written / tiles_across + 1) << " of " << tiles_down << std::endl;
+	written++;
 	
-	// Write the tile to the TIFF file
-	// this function will automatically calculate memory size from TIFF tags
-	if (TIFFWriteTile(out, o_tile, x, y, 0, 0) < 0) { 
-	  fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
+	tmsize_t rc = raw ?
+	  TIFFWriteRawTile(out, v.chunk, encoded[v.slot].data(), encoded[v.slot].size()) :
+	  TIFFWriteEncodedTile(out, v.chunk, rgbs.get(v.slot, 0), px * 3);
+	if (rc < 0) {
+	  fprintf(stderr, "Error writing tile %u\n", v.chunk);
 	  return 1;
 	}
-	
-      } // end x loop
-    } // end y loop
-
-    // Free the allocated memory
-    freeChannels(channels, channels_to_run.size());
-    
-    free(o_tile);
+	return 0;
+      });
 
+    if (err)
+      return 1;
   }
 
   return 0;
@@ -541,27 +543,37 @@ int Mask(TIFF* in, TIFF* out,
 	 int xlim1,
 	 int ylim1,
 	 int xlim2,
-	 int ylim2) {
-
+	 int ylim2,
+	 int threads,
+	 int level,
+	 const CodecOptions& codec,
+	 bool sequential) {
+
+  // the channels, at the requested resolution level. The other levels
+  // of a pyramid are not channels, and are left out of the output
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, level, offsets))
+    return 1;
   
   // display number of directories / channels
-  int num_dir = TIFFNumberOfDirectories(in);
+  int num_dir = offsets.size();
   std::cerr << "Number of channels in image: " << num_dir << std::endl;
 
-  uint64_t prior_image_height = 0;
+  if (threads < 1)
+    threads = 1;
   
+  // one raw buffer for every channel
+  std::vector<uint8_t> raw_tile;
+
   // loop each channel
   for (int n = 0; n < num_dir; n++) {
 
     std::cerr << "...masking channel: " << n << std::endl;
-    assert(TIFFSetDirectory(in, n));
+    if (!TIFFSetSubDirectory(in, offsets[n])) {
+      fprintf(stderr, "Error: unable to read directory %d\n", n);
+      return 1;
+    }
 
-    // debug
-    uint32_t number_of_sub_IFDs = 0;
-    void *ptr;
-    TIFFGetField(in, TIFFTAG_SUBIFD, &number_of_sub_IFDs, &ptr);
-    std::cerr << " Num sub IFDs " << number_of_sub_IFDs << std::endl;
-    
     // get width and height
     uint64_t m_height = 0;
     uint64_t m_width = 0;
@@ -574,16 +586,6 @@ int Mask(TIFF* in, TIFF* out,
       return 1;
     }
 
-    // don't do subfields of a pyramid image
-    std::cerr << "prior height " << prior_image_height << " current " << m_height << std::endl;    
-    if (n == 0) {
-      prior_image_height = m_height;
-    } else if (prior_image_height != m_height) {
-      std::cerr << "...attempting channel " << n << " but image height is " <<
-	m_height << " compared with prior of " << prior_image_height << " suggesting pyramid, skipping all remaining channels" << std::endl;
-      return 0;
-    }
- 
     // Create a new directory for the output file
     if (n > 0) {  // No need to create the first directory, it's automatically created
       // Finalize the previous directory and create new one
@@ -595,98 +597,152 @@ int Mask(TIFF* in, TIFF* out,
     
     // copy fields
     tiffcpjw(in, out);
+    if (level > 0)
+      TIFFSetField(out, TIFFTAG_SUBFILETYPE, 0);
 
-    // set compression
-    //assert(TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE));
-    //assert(TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL));
+    // keep the predictor too, so that untouched tiles can be
+    // copied over still compressed
+    uint16_t predictor = 0;
+    COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_PREDICTOR, predictor);
+
+    // unless the codec is changed
+    if (SetCodec(out, codec))
+      return 1;
     
     // for tiled images
-    assert(TIFFSetDirectory(in, n));    
     if (TIFFIsTiled(in)) {
 
-
       uint64_t tileheight = 0;
       uint64_t tilewidth = 0;
 
       COPY_TIFF_TAG(in, out, TIFFTAG_TILEWIDTH, tilewidth);
       COPY_TIFF_TAG(in, out, TIFFTAG_TILELENGTH, tileheight);
       
-      uint64_t ts = TIFFTileSize(in);
-      uint64_t arr_size = ts / 2; // this is num pixels, /2 is assuming 16 bits per pixel
+      const tmsize_t ts = TIFFTileSize(in);
+
+      // can tiles be moved byte-for-byte, with no decode / re-encode
+      const bool raw = codec.level < 0 && __raw_copy_ok(in, out);
+      
+      // the masked pixels are those strictly inside the limits, so as
+      // half-open ranges that is [xlim1 + 1, xlim2), clipped to the image
+      const int64_t mx0 = std::max<int64_t>(static_cast<int64_t>(xlim1) + 1, 0);
+      const int64_t mx1 = std::min<int64_t>(xlim2, m_width);
+      const int64_t my0 = std::max<int64_t>(static_cast<int64_t>(ylim1) + 1, 0);
+      const int64_t my1 = std::min<int64_t>(ylim2, m_height);
+      const bool any = mx0 < mx1 && my0 < my1;
       
-      // loop through the tiles
-      uint64_t x, y;
-      uint64_t m_pix = 0;
-      size_t num_tiles = 0;
-      //omp_set_num_threads(8);
-      //      #pragma omp parallel for private(x, y) shared(num_tiles, m_pix)
-      for (y = 0; y < m_height; y += tileheight) {
-	for (x = 0; x < m_width; x += tilewidth) {
-
-	  // allocate memory for a single tile
-	  // assuming 16 bit image
-	  uint16_t* itile = (uint16_t*)calloc(arr_size, sizeof(uint16_t));
-	  if (itile == nullptr) {
-	    std::cerr << "Memory allocation for channels failed." << std::endl;
-	    assert(false);
-	  }
+      // Tiles can be written in any order, so they are taken in raster
+      // order, or if sequential in the order they sit in the file, with
+      // the ones coming up prefetched
+      const uint32_t tiles_across = (m_width + tilewidth - 1) / tilewidth;
+      const uint32_t num_tiles = tiles_across * ((m_height + tileheight - 1) / tileheight);
+      size_t num_raw = 0, num_masked = 0;
+
+      // tiles outside the mask are copied still compressed, so only
+      // those under it go through the tile loop below
+      if (raw) {
+	std::vector<uint32_t> order(num_tiles);
+	std::iota(order.begin(), order.end(), 0);
+	ChunkSchedule sched(in, sequential ? std::vector<uint64_t>{offsets[n]} : std::vector<uint64_t>());
+	if (sequential) {
+	  if (!sched.ok())
+	    return 1;
+	  order = sched.FileOrder(0);
+	  order.erase(std::remove_if(order.begin(), order.end(),
+				     [num_tiles](uint32_t t) { return t >= num_tiles; }),
+		      order.end());
+	  std::vector<ChunkRef> refs;
+	  for (const auto& t : order)
+	    refs.push_back({0, t});
+	  sched.SetOrder(refs);
+	}
+      
+	for (uint32_t i = 0; i < num_tiles; i++) {
+	  
+	  if (sequential)
+	    sched.reached(i);
+	  const int64_t x = static_cast<int64_t>(order[i] % tiles_across) * tilewidth;
+	  const int64_t y = static_cast<int64_t>(order[i] / tiles_across) * tileheight;
+	  if (any && x < mx1 && x + static_cast<int64_t>(tilewidth) > mx0 &&
+	      y < my1 && y + static_cast<int64_t>(tileheight) > my0)
+	    continue;
 	  
-	  // and for the output tile
-	  // allocate memory for a single tile
-	  // assuming 16 bit image
-	  uint16_t* otile = (uint16_t*)calloc(arr_size, sizeof(uint16_t));
-	  if (otile == nullptr) {
-	    std::cerr << "Memory allocation for channels failed." << std::endl;
-	    assert(false);
+	  if (__copy_raw_tile(in, out, order[i], raw_tile)) {
+	    fprintf(stderr, "Error copying raw tile at (%llu, %llu)\n",
+		    (unsigned long long)x, (unsigned long long)y);
+	    return 1;
 	  }
+	  num_raw++;
+	}
+      }
 
-	  //	  #pragma omp atomic
-	  num_tiles++;
-	  // Read the input tile
-	  if (TIFFReadTile(in, itile, x, y, 0, 0) < 0) {
-	    fprintf(stderr, "Error reading input channel %d tile at (%llu, %llu)\n", n, x, y);
-	    assert(false);
+      // the rest are decoded, masked and compressed on the threads, and
+      // written as they come
+      TileExec exec;
+      exec.threads = threads;
+      exec.sequential = sequential;
+      TileRegion region;
+      if (raw) {
+	region.x = mx0;
+	region.y = my0;
+	region.w = any ? mx1 - mx0 : 0;
+	region.h = any ? my1 - my0 : 0;
+      }
+      TileLoop loop(TIFFFileName(in), {offsets[n]}, exec, region);
+      if (!loop.ok())
+	return 1;
+      
+      TiffTileEncoder encoder(out);
+      std::vector<std::vector<uint8_t>> encoded(loop.NumSlots());
+      std::vector<uint8_t> hit(loop.NumSlots(), 0);
+      
+      const int err = loop.run([&](TileView& v) {
+
+	  // clear the part of each row that falls inside the mask
+	  const int64_t cx0 = std::max<int64_t>(mx0, v.x);
+	  const int64_t cx1 = std::min<int64_t>(mx1, v.x + v.w);
+	  const int64_t cy0 = std::max<int64_t>(my0, v.y);
+	  const int64_t cy1 = std::min<int64_t>(my1, v.y + v.h);
+	  hit[v.slot] = cx0 < cx1 && cy0 < cy1;
+	  if (hit[v.slot])
+	    for (int64_t r = cy0; r < cy1; r++)
+	      std::memset(v.at(0, cx0, r), 0, (cx1 - cx0) * v.pixel_bytes);
+
+	  if (encoder.ok() && encoder.encode(v.get(0), ts, encoded[v.slot])) {
+	    fprintf(stderr, "Error compressing tile %u\n", v.chunk);
+	    return 1;
 	  }
-
-	  // write the pixels back and apply the mask
-	  for (uint32_t ty = 0; ty < tileheight; ty++) {
-	    for (uint32_t tx = 0; tx < tilewidth; tx++) {
-
-	      // if tile is in the mask boundaries, zero it
-	      if (y + ty > ylim1 && y + ty < ylim2 &&
-		  x + tx > xlim1 && x + tx < xlim2) {
-		otile[ty * tilewidth + tx] = 0;
-		// otherwise copy it
-	      } else {
-		otile[ty * tilewidth + tx] = itile[ty * tilewidth + tx];
-	      }
-	      
-	    }
+	  return 0;
+	}, [&](TileView& v) {
+	  num_masked += hit[v.slot];
+	  const tmsize_t rc = encoder.ok() ?
+	    TIFFWriteRawTile(out, v.chunk, encoded[v.slot].data(), encoded[v.slot].size()) :
+	    TIFFWriteEncodedTile(out, v.chunk, v.get(0), ts);
+	  if (rc < 0) {
+	    fprintf(stderr, "Error writing tile at (%llu, %llu)\n",
+		    (unsigned long long)v.x0, (unsigned long long)v.y0);
+	    return 1;
 	  }
+	  return 0;
+	});
+      if (err)
+	return 1;
 
-	  // Write the tile to the TIFF file
-	  // this function will automatically calculate memory size from TIFF tags
-          #pragma omp critical
-	  if (TIFFWriteTile(out, otile, x, y, 0, 0) < 0) { 
-	    fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
-	    assert(false);
-	  }
-	  
-	  free(itile);
-	  free(otile);
-	  
-	}// end tile x loop
-      } // end tile y loop
+      std::cerr << "...copied " << num_raw << " tiles raw, masked " << num_masked << std::endl;
     } // end if tiled
   } // end dir/channel loop
   return 0;
 }
 
-int MergeGrayToRGB(TIFF* in, TIFF* out) {
+int MergeGrayToRGB(TIFF* in, TIFF* out, int level, int threads,
+		   const CodecOptions& codec) {
 
-  int dircount = TIFFNumberOfDirectories(in);
+  // the channels, at the requested resolution level
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, level, offsets))
+    return 1;
   
-  if (dircount < 3) {
+  if (offsets.size() < 3) {
     std::cerr << "Error: Need at least three image IFDs" << std::endl;
     return 1;
   }
@@ -694,178 +750,915 @@ int MergeGrayToRGB(TIFF* in, TIFF* out) {
   // assert that they are 8 bit images
   // assert that they are grayscale
   for (size_t i = 0; i < 3; ++i) {
-    TIFFSetDirectory(in, i);
+    TIFFSetSubDirectory(in, offsets[i]);
     __gray8assert(in);
   }
+
+  return Interleave(in, out, {0, 1, 2}, level, threads, codec);
+}
+
+int MergeGrayToRGB(const std::string& red, const std::string& green,
+		   const std::string& blue, TIFF* out, int level, int threads,
+		   const CodecOptions& codec) {
+
+  // the first channel of each file, at the requested level
+  const std::vector<std::string> files = {red, green, blue};
+  std::vector<uint64_t> dirs;
+  for (const auto& f : files) {
+    TiffReader reader(f.c_str());
+    std::vector<uint64_t> offsets;
+    if (reader.get() == NULL || reader.LevelOffsets(level, offsets))
+      return 1;
+    TIFFSetSubDirectory(reader.get(), offsets[0]);
+    __gray8assert(reader.get());
+    dirs.push_back(offsets[0]);
+  }
+
+  return Interleave(files, dirs, out, threads, codec);
+}
+
+int Interleave(TIFF* in, TIFF* out, const std::vector<int>& channels,
+	       int level, int threads, const CodecOptions& codec) {
+
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, level, offsets))
+    return 1;
+
+  // the IFDs to pack, in sample order
+  std::vector<uint64_t> run_offsets;
+  for (const auto& c : channels) {
+    if (c < 0 || c >= static_cast<int>(offsets.size())) {
+      fprintf(stderr, "Error: channel %d out of range, image has %zu channels\n",
+	      c, offsets.size());
+      return 1;
+    }
+    run_offsets.push_back(offsets[c]);
+  }
+
+  const std::vector<std::string> files(channels.size(), TIFFFileName(in));
+  return Interleave(files, run_offsets, out, threads, codec);
+}
+
+int Interleave(const std::vector<std::string>& files, const std::vector<uint64_t>& dirs,
+	       TIFF* out, int threads, const CodecOptions& codec) {
+
+  if (dirs.empty() || dirs.size() > 0xFFFF || files.size() != dirs.size()) {
+    fprintf(stderr, "Error: need between 1 and 65535 images to interleave, not %zu\n",
+	    dirs.size());
+    return 1;
+  }
+  const size_t num_planes = dirs.size();
+  
+  if (threads < 1)
+    threads = 1;
+  
+  // the loop checks that every plane has the same size and layout as
+  // the first, so that chunk c of each covers the same pixels
+  TileExec exec;
+  exec.threads = threads;
+  TileLoop loop(files, dirs, exec);
+  if (!loop.ok())
+    return 1;
+
+  const uint16_t bps = loop.BitsPerSample();
+  if (loop.SamplesPerPixel() != 1 || (bps != 8 && bps != 16 && bps != 32)) {
+    fprintf(stderr, "Error: interleave needs single-sample 8, 16 or 32-bit images, not %d x %d-bit\n",
+	    loop.SamplesPerPixel(), bps);
+    return 1;
+  }
+  uint16_t sampleformat = SAMPLEFORMAT_UINT;
+  for (size_t k = 0; k < num_planes; k++) {
+    uint16_t sf = SAMPLEFORMAT_UINT;
+    TIFFGetFieldDefaulted(loop.handle(k), TIFFTAG_SAMPLEFORMAT, &sf);
+    if (k == 0) {
+      sampleformat = sf;
+    } else if (sf != sampleformat) {
+      fprintf(stderr, "Error: input %zu does not match the sample format of input 0\n", k);
+      return 1;
+    }
+  }
+  const bool tiled = loop.tiled();
+  
+  // the output: one pixel-interleaved image, in the layout of the input
+  TIFFSetField(out, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(loop.width()));
+  TIFFSetField(out, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(loop.height()));
+  TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, static_cast<uint16_t>(num_planes));
+  TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bps);
+  TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, sampleformat);
+  TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  if (num_planes == 3 && bps == 8) {
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+  } else {
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+    if (num_planes > 1) {
+      std::vector<uint16_t> extra(num_planes - 1, EXTRASAMPLE_UNSPECIFIED);
+      TIFFSetField(out, TIFFTAG_EXTRASAMPLES, static_cast<uint16_t>(extra.size()), extra.data());
+    }
+  }
+  if (tiled) {
+    TIFFSetField(out, TIFFTAG_TILEWIDTH, loop.ChunkWidth());
+    TIFFSetField(out, TIFFTAG_TILELENGTH, loop.ChunkHeight());
+  } else {
+    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, loop.ChunkHeight());
+  }
+  if (SetCodec(out, codec))
+    return 1;
+
+  // sizes of the chunks, worked out once
+  const tmsize_t in_size = loop.ChunkBytes();
+  const size_t sample_bytes = bps / 8;
+  const size_t chunk_pixels = in_size / sample_bytes;
+  const tmsize_t out_size = in_size * num_planes;
   
-  uint32_t m_height = 0;
-  uint32_t m_width = 0;
+  // tiles can be compressed on the workers. Strips (and JPEG) are
+  // compressed by libtiff as they are written
+  TiffTileEncoder encoder(out);
+  const bool encode = tiled && encoder.ok();
+
+  // an interleaved chunk per slot of the loop, kept until it is written
+  const size_t slots = loop.NumSlots();
+  TileBufferPool outs(slots, 1, out_size);
+  if (!outs.ok())
+    return 1;
+  std::vector<std::vector<uint8_t>> encoded(slots);
+  std::vector<const uint8_t*> planes(slots * num_planes);
+
+  // the chunks of every plane are decoded together, then interleaved
+  // (and compressed) in parallel, and written in order
+  return loop.run([&](TileView& v) {
+      const uint8_t** p = &planes[v.slot * num_planes];
+      for (size_t k = 0; k < num_planes; k++)
+	p[k] = v.get(k);
+      InterleavePlanes(p, num_planes, chunk_pixels, sample_bytes, outs.get(v.slot, 0));
+      if (encode && encoder.encode(outs.get(v.slot, 0), out_size, encoded[v.slot])) {
+	fprintf(stderr, "Error compressing tile %u\n", v.chunk);
+	return 1;
+      }
+      return 0;
+    }, [&](TileView& v) {
+      tmsize_t rc = 0;
+      if (encode) {
+	rc = TIFFWriteRawTile(out, v.chunk, encoded[v.slot].data(), encoded[v.slot].size());
+      } else if (tiled) {
+	rc = TIFFWriteEncodedTile(out, v.chunk, outs.get(v.slot, 0), out_size);
+      } else {
+	// the last strip only has the rows left in the image
+	rc = TIFFWriteEncodedStrip(out, v.chunk, outs.get(v.slot, 0), v.h * v.stride * num_planes);
+      }
+      if (rc < 0) {
+	fprintf(stderr, "Error writing %s %u\n", tiled ? "tile" : "strip", v.chunk);
+	return 1;
+      }
+      return 0;
+    });
+}
+
+// decode the IFD at offset and write it to out with the codec, with
+// the tiles split over threads: each worker decodes and re-encodes
+// whole tiles, which are appended in order (see TileLoop). Sparse
+// tiles stay sparse. num_subifds reduced levels are to follow as SubIFDs
+static int __recompress_ifd(TIFF* in, uint64_t offset, TIFF* out,
+			    const CodecOptions& codec, int threads,
+			    int num_subifds) {
+
+  if (!TIFFSetSubDirectory(in, offset)) {
+    fprintf(stderr, "Error: unable to read directory at offset %llu\n", (unsigned long long)offset);
+    return 1;
+  }
+  if (!TIFFIsTiled(in)) {
+    fprintf(stderr, "Error: recompress requires a tiled TIFF\n");
+    return 1;
+  }
+
+  tiffcpjw(in, out);
+  uint32_t tilewidth = 0, tileheight = 0;
+  COPY_TIFF_TAG(in, out, TIFFTAG_TILEWIDTH, tilewidth);
+  COPY_TIFF_TAG(in, out, TIFFTAG_TILELENGTH, tileheight);
+  if (num_subifds > 0) {
+    std::vector<uint64_t> sub(num_subifds, 0);
+    TIFFSetField(out, TIFFTAG_SUBIFD, static_cast<uint16_t>(num_subifds), sub.data());
+  }
+  if (SetCodec(out, codec))
+    return 1;
+
+  TiffTileEncoder encoder(out);
+  if (!encoder.ok()) {
+    fprintf(stderr, "Error: unable to encode tiles with compression %d\n", codec.compression);
+    return 1;
+  }
   
-  // I'm going to assume here that all three sub-images have same tile size
-  if (!TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &m_width)) {
-    std::cerr << " ERROR getting image width " << std::endl;
+  TileExec exec;
+  exec.threads = threads;
+  TileLoop loop(TIFFFileName(in), {offset}, exec);
+  if (!loop.ok())
     return 1;
+  
+  const tmsize_t ts = loop.ChunkBytes();
+
+  // a tile per slot, left empty for a sparse tile
+  std::vector<std::vector<uint8_t>> encoded(loop.NumSlots());
+  return loop.run([&](TileView& v) {
+      encoded[v.slot].clear();
+      if (!v.sparse(0) && encoder.encode(v.get(0), ts, encoded[v.slot])) {
+	fprintf(stderr, "Error recompressing tile %u\n", v.chunk);
+	return 1;
+      }
+      return 0;
+    }, [&](TileView& v) {
+      std::vector<uint8_t>& e = encoded[v.slot];
+      if (!e.empty() && TIFFWriteRawTile(out, v.chunk, e.data(), e.size()) < 0) {
+	fprintf(stderr, "Error writing tile %u\n", v.chunk);
+	return 1;
+      }
+      return 0;
+    });
+}
+
+int Recompress(TIFF* in, TIFF* out, const CodecOptions& codec,
+	       bool verbose, int threads) {
+
+  TiffReader reader(TIFFFileName(in));
+  if (reader.get() == NULL)
+    return 1;
+  
+  if (verbose)
+    std::cerr << "Number of channels in image: " << reader.NumChannels() << std::endl;
+
+  if (threads < 1)
+    threads = 1;
+  
+  for (size_t n = 0; n < reader.NumChannels(); n++) {
+
+    // each channel, followed by its reduced levels as SubIFDs
+    const size_t num_levels = reader.NumLevels(n);
+    for (size_t l = 0; l < num_levels; l++) {
+      if ((n > 0 || l > 0) && !TIFFWriteDirectory(out)) {
+	std::cerr << "Could not write output directory " << n << std::endl;
+	return 1;
+      }
+      if (__recompress_ifd(in, reader.LevelOffset(n, l), out, codec, threads,
+			   l == 0 ? num_levels - 1 : 0))
+	return 1;
+      if (l > 0)
+	TIFFSetField(out, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+    }
+    
+    if (verbose)
+      std::cerr << "...finished channel " << n << " with " << num_levels << " levels" << std::endl;
   }
-  if (!TIFFGetField(in, TIFFTAG_IMAGELENGTH, &m_height)) {
-    std::cerr << " ERROR getting image height " << std::endl;
+
+  return 0;
+}
+
+int CodecBenchmark(TIFF* in, int tiles_per_channel, bool verbose) {
+
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, 0, offsets))
     return 1;
+  if (tiles_per_channel < 1)
+    tiles_per_channel = 1;
+  
+  // the settings to try. Those that libtiff was built without are skipped
+  struct Setting { uint16_t compression; int level; };
+  const std::vector<Setting> settings = {
+    {COMPRESSION_NONE, -1},
+    {COMPRESSION_LZW, -1},
+    {COMPRESSION_ADOBE_DEFLATE, 1}, {COMPRESSION_ADOBE_DEFLATE, 6}, {COMPRESSION_ADOBE_DEFLATE, 9},
+    {COMPRESSION_ZSTD, 1}, {COMPRESSION_ZSTD, 9}, {COMPRESSION_ZSTD, 19}
+  };
+  
+  // the sampled tiles of each channel
+  std::vector<std::vector<std::vector<uint8_t>>> samples(offsets.size());
+  uint16_t format = SAMPLEFORMAT_UINT;
+  for (size_t n = 0; n < offsets.size(); n++) {
+
+    if (!TIFFSetSubDirectory(in, offsets[n])) {
+      fprintf(stderr, "Error: unable to read directory %zu\n", n);
+      return 1;
+    }
+    if (!TIFFIsTiled(in)) {
+      fprintf(stderr, "Error: codec-bench requires a tiled TIFF, channel %zu is not\n", n);
+      return 1;
+    }
+    TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLEFORMAT, &format);
+    
+    // spread the samples evenly over the tiles that hold data, so
+    // that background and tissue both show up as often as they do
+    // in the image
+    std::vector<ttile_t> written;
+    const ttile_t num_tiles = TIFFNumberOfTiles(in);
+    for (ttile_t t = 0; t < num_tiles; t++)
+      if (TIFFGetStrileByteCount(in, t) > 0)
+	written.push_back(t);
+    const size_t k = std::min<size_t>(tiles_per_channel, written.size());
+    const tmsize_t ts = TIFFTileSize(in);
+    for (size_t i = 0; i < k; i++) {
+      const ttile_t t = written[i * written.size() / k];
+      samples[n].emplace_back(ts);
+      if (ReadEncodedChunk(in, t, samples[n].back().data(), ts) < 0) {
+	fprintf(stderr, "Error reading channel %zu tile %u\n", n, t);
+	return 1;
+      }
+    }
+    if (verbose)
+      std::cerr << "...sampled " << k << " of " << num_tiles << " tiles of channel " << n << std::endl;
   }
+
+  // floating point data has its own predictor
+  const uint16_t diff = format == SAMPLEFORMAT_IEEEFP ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL;
   
-  // for tiled images
-  TIFFSetDirectory(in, 0);
-  if (TIFFIsTiled(in)) {
+  std::cout << "codec\tlevel\tpredictor\tbytes\tratio\tencode_MBps\tdecode_MBps" << std::endl;
+  for (const auto& s : settings) {
+    if (!TIFFIsCODECConfigured(s.compression))
+      continue;
+    for (uint16_t predictor : {static_cast<uint16_t>(PREDICTOR_NONE), diff}) {
+      if (s.compression == COMPRESSION_NONE && predictor != PREDICTOR_NONE)
+	continue;
+      
+      CodecOptions c;
+      c.compression = s.compression;
+      c.level = s.level;
+      c.predictor = predictor;
+
+      // totals over all of the channels
+      CodecBench total;
+      for (size_t n = 0; n < offsets.size(); n++) {
+	CodecBench b;
+	TIFFSetSubDirectory(in, offsets[n]);
+	if (BenchCodec(in, samples[n], c, b)) {
+	  fprintf(stderr, "Error benchmarking %s on channel %zu\n", CodecName(c.compression).c_str(), n);
+	  return 1;
+	}
+	total.raw_bytes += b.raw_bytes;
+	total.encoded_bytes += b.encoded_bytes;
+	total.encode_seconds += b.encode_seconds;
+	total.decode_seconds += b.decode_seconds;
+      }
+
+      const double mb = total.raw_bytes / 1e6;
+      std::cout << CodecName(c.compression) << "\t" <<
+	(c.level < 0 ? std::string("-") : std::to_string(c.level)) << "\t" <<
+	predictor << "\t" << total.encoded_bytes << "\t" <<
+	(total.encoded_bytes ? (double)total.raw_bytes / total.encoded_bytes : 0) << "\t" <<
+	(total.encode_seconds > 0 ? mb / total.encode_seconds : 0) << "\t" <<
+	(total.decode_seconds > 0 ? mb / total.decode_seconds : 0) << std::endl;
+    }
+  }
+  
+  return 0;
+}
+
+// one reduced resolution level while a pyramid is being streamed out
+struct PyramidLevel {
+
+  uint64_t width = 0;
+  uint64_t height = 0;
+  uint64_t tiles_across = 0;
+
+  // rows of this level received so far
+  uint64_t seen = 0;
+
+  // the tile row being filled (not used for level 0) and how many of
+  // its rows are in. It is as wide as the tile grid, so the padding
+  // past the image edge stays zero
+  std::vector<uint8_t> band;
+  uint64_t filled = 0;
+
+  // a row waiting for its partner, to make one row of the next level
+  std::vector<uint8_t> pending;
+  bool has_pending = false;
+
+  // the row of the next level made from a pair of these rows
+  std::vector<uint8_t> down;
+
+  // the tiles of the band once encoded, reused for every band
+  std::vector<std::vector<uint8_t>> encoded;
+
+  // where each encoded tile of this level is in the spool file
+  std::vector<std::pair<uint64_t, uint64_t>> spooled;
+  
+};
+
+struct PyramidState {
+  std::vector<PyramidLevel> levels;
+  uint32_t tilewidth = 0;
+  uint32_t tileheight = 0;
+  uint64_t pixel_bytes = 0;
+  uint16_t bps = 0;
+  uint16_t spp = 1;
+  const TiffTileEncoder* encoder = nullptr;
+  const TileBufferPool* tiles = nullptr;  // one tile per thread
+  FILE* spool = nullptr;
+  uint64_t spool_size = 0;
+  int threads = 1;
+};
+
+// 2x2 box average of rows a and b (of width w) into out, which is
+// (w + 1) / 2 wide. An odd last column is averaged with itself
+template <typename T, typename A>
+static void __downsample_rows(const uint8_t* a, const uint8_t* b, uint64_t w, int spp,
+			      uint8_t* out) {
+
+  const T* ra = reinterpret_cast<const T*>(a);
+  const T* rb = reinterpret_cast<const T*>(b);
+  T* o = reinterpret_cast<T*>(out);
+  const uint64_t ow = (w + 1) / 2;
+  for (uint64_t x = 0; x < ow; x++) {
+    const uint64_t x0 = 2 * x * spp;
+    const uint64_t x1 = std::min(2 * x + 1, w - 1) * spp;
+    for (int s = 0; s < spp; s++) {
+      const A sum = static_cast<A>(ra[x0 + s]) + ra[x1 + s] + rb[x0 + s] + rb[x1 + s];
+      o[x * spp + s] = static_cast<T>((sum + 2) >> 2);
+    }
+  }
+}
+
+// encode the filled tile row of level l (l > 0), split across threads,
+// and append the tiles to the spool in order
+static int __pyramid_flush(PyramidState& st, size_t l) {
+
+  PyramidLevel& lv = st.levels[l];
+  const uint64_t band_row = lv.tiles_across * st.tilewidth * st.pixel_bytes;
+  const uint64_t tile_row = st.tilewidth * st.pixel_bytes;
+  const tmsize_t ts = tile_row * st.tileheight;
+
+  // rows below the image edge are zero
+  std::memset(lv.band.data() + lv.filled * band_row, 0,
+	      (st.tileheight - lv.filled) * band_row);
+  
+  std::vector<std::vector<uint8_t>>& encoded = lv.encoded;
+  int err = 0;
+#pragma omp parallel for num_threads(st.threads) schedule(dynamic)
+  for (int64_t k = 0; k < static_cast<int64_t>(lv.tiles_across); k++) {
+    uint8_t* tile = st.tiles->get(omp_get_thread_num(), 0);
+    for (uint32_t r = 0; r < st.tileheight; r++)
+      std::memcpy(tile + r * tile_row,
+		  lv.band.data() + r * band_row + k * tile_row, tile_row);
+    if (st.encoder->encode(tile, ts, encoded[k])) {
+#pragma omp atomic write
+      err = 1;
+    }
+  }
+  if (err)
+    return 1;
+
+  for (const auto& e : encoded) {
+    if (fwrite(e.data(), 1, e.size(), st.spool) != e.size()) {
+      fprintf(stderr, "Error writing to the pyramid spool file\n");
+      return 1;
+    }
+    lv.spooled.push_back({st.spool_size, e.size()});
+    st.spool_size += e.size();
+  }
+  
+  lv.filled = 0;
+  return 0;
+}
+
+// hand one row of level l to the pyramid. Level l stores it (for
+// l > 0) and pairs it with the previous row to make a row of level l + 1
+static int __pyramid_push_row(PyramidState& st, size_t l, const uint8_t* row) {
+
+  PyramidLevel& lv = st.levels[l];
+  const uint64_t row_bytes = lv.width * st.pixel_bytes;
+  lv.seen++;
+  
+  if (l > 0) {
+    const uint64_t band_row = lv.tiles_across * st.tilewidth * st.pixel_bytes;
+    std::memcpy(lv.band.data() + lv.filled * band_row, row, row_bytes);
+    lv.filled++;
+    if ((lv.filled == st.tileheight || lv.seen == lv.height) && __pyramid_flush(st, l))
+      return 1;
+  }
+
+  if (l + 1 == st.levels.size())
+    return 0;
+
+  // rows are paired up, and an odd last row is paired with itself
+  const uint8_t* first = row;
+  if (lv.has_pending) {
+    first = lv.pending.data();
+  } else if (lv.seen < lv.height) {
+    std::memcpy(lv.pending.data(), row, row_bytes);
+    lv.has_pending = true;
+    return 0;
+  }
+  lv.has_pending = false;
+
+  std::vector<uint8_t>& down = lv.down;
+  switch (st.bps) {
+  case 8:
+    __downsample_rows<uint8_t, uint32_t>(first, row, lv.width, st.spp, down.data());
+    break;
+  case 16:
+    __downsample_rows<uint16_t, uint32_t>(first, row, lv.width, st.spp, down.data());
+    break;
+  case 32:
+    __downsample_rows<uint32_t, uint64_t>(first, row, lv.width, st.spp, down.data());
+    break;
+  }
+  return __pyramid_push_row(st, l + 1, down.data());
+}
+
+int Pyramid(TIFF* in, TIFF* out, int num_levels, bool verbose, int threads,
+	    const CodecOptions& codec) {
+
+  // the full resolution channels. Any levels already there are
+  // replaced by the new ones
+  std::vector<uint64_t> offsets;
+  if (LevelOffsets(in, 0, offsets))
+    return 1;
+  
+  const int num_dir = offsets.size();
+  if (verbose)
+    std::cerr << "Number of channels in image: " << num_dir << std::endl;
+
+  if (threads < 1)
+    threads = 1;
+  
+  for (int n = 0; n < num_dir; n++) {
 
-    uint32_t tileheight = 0;
-    uint32_t tilewidth = 0;
+    if (!TIFFSetSubDirectory(in, offsets[n])) {
+      fprintf(stderr, "Error: unable to read directory %d\n", n);
+      return 1;
+    }
+    if (!TIFFIsTiled(in)) {
+      fprintf(stderr, "Error: pyramid requires a tiled TIFF, channel %d is not\n", n);
+      return 1;
+    }
     
-    // I'm going to assume here that all three sub-images have same tile size
-    if (!TIFFGetField(in, TIFFTAG_TILEWIDTH, &tilewidth)) {
-      std::cerr << " ERROR getting tile width " << std::endl;
+    PyramidState st;
+    st.threads = threads;
+    uint32_t width = 0, height = 0;
+    uint16_t planar = PLANARCONFIG_CONTIG, format = SAMPLEFORMAT_UINT;
+    TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(in, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &st.bps);
+    TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLESPERPIXEL, &st.spp);
+    TIFFGetFieldDefaulted(in, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(in, TIFFTAG_SAMPLEFORMAT, &format);
+    TIFFGetField(in, TIFFTAG_TILEWIDTH, &st.tilewidth);
+    TIFFGetField(in, TIFFTAG_TILELENGTH, &st.tileheight);
+    if ((st.bps != 8 && st.bps != 16 && st.bps != 32) || format != SAMPLEFORMAT_UINT ||
+	(planar != PLANARCONFIG_CONTIG && st.spp > 1)) {
+      fprintf(stderr, "Error: pyramid needs unsigned 8, 16 or 32-bit interleaved samples, channel %d is not\n", n);
       return 1;
     }
-    if (!TIFFGetField(in, TIFFTAG_TILELENGTH, &tileheight)) {
-      std::cerr << " ERROR getting tile height " << std::endl;
+    st.pixel_bytes = st.bps / 8 * st.spp;
+
+    // halve until the level fits in one tile, unless told how many
+    int L = num_levels;
+    if (L < 0) {
+      L = 0;
+      for (uint64_t w = width, h = height; w > st.tilewidth || h > st.tileheight; L++) {
+	w = (w + 1) / 2;
+	h = (h + 1) / 2;
+      }
+    }
+    
+    st.levels.resize(L + 1);
+    for (int l = 0; l <= L; l++) {
+      PyramidLevel& lv = st.levels[l];
+      lv.width = l == 0 ? width : (st.levels[l - 1].width + 1) / 2;
+      lv.height = l == 0 ? height : (st.levels[l - 1].height + 1) / 2;
+      lv.tiles_across = (lv.width + st.tilewidth - 1) / st.tilewidth;
+      if (l > 0) {
+	lv.band.assign(lv.tiles_across * st.tilewidth * st.pixel_bytes * st.tileheight, 0);
+	lv.encoded.resize(lv.tiles_across);
+      }
+      if (l < L) {
+	lv.pending.resize(lv.width * st.pixel_bytes);
+	lv.down.resize((lv.width + 1) / 2 * st.pixel_bytes);
+      }
+    }
+    if (verbose)
+      std::cerr << "...channel " << n << " " << PAIRSTRING(width, height) <<
+	" with " << L << " reduced levels" << std::endl;
+
+    // the full resolution IFD, with room for the SubIFD offsets
+    if (n > 0 && !TIFFWriteDirectory(out)) {
+      std::cerr << "Could not write output directory " << n << std::endl;
+      return 1;
+    }
+    tiffcpjw(in, out);
+    uint32_t tw = 0, th = 0;
+    COPY_TIFF_TAG(in, out, TIFFTAG_TILEWIDTH, tw);
+    COPY_TIFF_TAG(in, out, TIFFTAG_TILELENGTH, th);
+    uint16_t predictor = 0;
+    COPY_TIFF_TAG_QUIET(in, out, TIFFTAG_PREDICTOR, predictor);
+    TIFFSetField(out, TIFFTAG_SUBFILETYPE, 0);
+    if (L > 0) {
+      std::vector<uint64_t> sub(L, 0);
+      TIFFSetField(out, TIFFTAG_SUBIFD, static_cast<uint16_t>(L), sub.data());
+    }
+    if (SetCodec(out, codec))
       return 1;
+    TIFFGetField(out, TIFFTAG_PREDICTOR, &predictor);
+
+    // the reduced levels are encoded with the same settings. JPEG
+    // tiles can not be encoded on their own, so those go out as LZW
+    TiffTileEncoder encoder(out);
+    if (!encoder.ok()) {
+      TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+      encoder = TiffTileEncoder(out);
     }
+    st.encoder = &encoder;
+    const bool raw = codec.level < 0 && __raw_copy_ok(in, out);
     
-    uint64_t ts = TIFFTileSize(in);
-    for (int i = 1; i < 3; i++) {
-      TIFFSetDirectory(in, 1);
-      assert(TIFFTileSize(in) == ts);
+    // the encoded reduced levels wait here until the full resolution
+    // IFD is done, since libtiff writes one directory at a time
+    std::unique_ptr<FILE, int(*)(FILE*)> spool(tmpfile(), fclose);
+    if (!spool) {
+      fprintf(stderr, "Error: unable to open a temporary file for the pyramid\n");
+      return 1;
     }
+    st.spool = spool.get();
     
-    // allocate memory for a single tile
-    uint8_t* r_tile = (uint8_t*)calloc(ts, sizeof(uint8_t));
-    uint8_t* g_tile = (uint8_t*)calloc(ts, sizeof(uint8_t));
-    uint8_t* b_tile = (uint8_t*)calloc(ts, sizeof(uint8_t));
-    void*    o_tile = (void*)calloc(ts* 3, sizeof(uint8_t));  
-
-    // loop through the tiles
-    uint64_t x, y;
-    uint64_t m_pix = 0;
-    for (y = 0; y < m_height; y += tileheight) {
-      for (x = 0; x < m_width; x += tilewidth) {
-	
-	// Read the red tile
-	TIFFSetDirectory(in, 0);
-	if (TIFFReadTile(in, r_tile, x, y, 0, 0) < 0) {
-	  fprintf(stderr, "Error reading red tile at (%llu, %llu)\n", x, y);
-	  return 1;
+    TiffHandlePool pool(TIFFFileName(in), threads, std::vector<uint64_t>{offsets[n]});
+    if (!pool.ok())
+      return 1;
+
+    // stream the full resolution image one tile row at a time
+    const PyramidLevel& base = st.levels[0];
+    const tmsize_t ts = TIFFTileSize(in);
+    const uint64_t tile_row = st.tilewidth * st.pixel_bytes;
+    TileBufferPool tiles(base.tiles_across, 1, ts);
+    TileBufferPool level_tiles(threads, 1, ts);
+    if (!tiles.ok() || !level_tiles.ok())
+      return 1;
+    st.tiles = &level_tiles;
+    std::vector<std::vector<uint8_t>> encoded(raw ? 0 : base.tiles_across);
+    std::vector<uint8_t> raw_tile;
+    std::vector<uint8_t> row(base.tiles_across * tile_row);
+    for (uint64_t y = 0; y < height; y += st.tileheight) {
+
+      // decode (and if need be, re-encode) the row of tiles
+      const ttile_t t0 = TIFFComputeTile(in, 0, y, 0, 0);
+      int err = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+      for (int64_t k = 0; k < static_cast<int64_t>(base.tiles_across); k++) {
+	TIFF* tif = pool.get(omp_get_thread_num(), 0);
+	if (ReadEncodedChunk(tif, t0 + k, tiles.get(k, 0), ts) < 0 ||
+	    (!raw && encoder.encode(tiles.get(k, 0), ts, encoded[k]))) {
+#pragma omp atomic write
+	  err = 1;
 	}
-	
-	// Read the green tile
-	TIFFSetDirectory(in, 1);	
-	if (TIFFReadTile(in, g_tile, x, y, 0, 0) < 0) {
-	  fprintf(stderr, "Error reading green tile at (%llu, %llu)\n", x, y);
+      }
+      if (err) {
+	fprintf(stderr, "Error reading channel %d tile row at %llu\n", n, (unsigned long long)y);
+	return 1;
+      }
+      
+      for (uint64_t k = 0; k < base.tiles_across; k++) {
+	const int bad = raw ? __copy_raw_tile(in, out, t0 + k, raw_tile) :
+	  TIFFWriteRawTile(out, t0 + k, encoded[k].data(), encoded[k].size()) < 0;
+	if (bad) {
+	  fprintf(stderr, "Error writing channel %d tile %llu\n", n, (unsigned long long)(t0 + k));
 	  return 1;
 	}
-	
-	// Read the blue tile
-	TIFFSetDirectory(in, 2);
-	if (TIFFReadTile(in, b_tile, x, y, 0, 0) < 0) {
-	  fprintf(stderr, "Error reading blue tile at (%llu, %llu)\n", x, y);
+      }
+
+      // and feed its rows down the pyramid
+      const uint64_t rows = std::min<uint64_t>(st.tileheight, height - y);
+      for (uint64_t r = 0; r < rows; r++) {
+	for (uint64_t k = 0; k < base.tiles_across; k++)
+	  std::memcpy(row.data() + k * tile_row, tiles.get(k, 0) + r * tile_row, tile_row);
+	if (__pyramid_push_row(st, 0, row.data()))
 	  return 1;
-	}
-	
-	// copy the tile
-	for (size_t i = 0; i < TIFFTileSize(in); ++i) {
+      }
+    }
 
-	  //++m_pix;
-	  //if (verbose && m_pix % static_cast<uint64_t>(1e9) == 0)
-	  //  std::cerr << "...working on pixel: " <<
-	  //    AddCommas(static_cast<uint64_t>(m_pix)) << std::endl;
-	  
-	  static_cast<uint8_t*>(o_tile)[i*3    ] = r_tile[i];
-	  static_cast<uint8_t*>(o_tile)[i*3 + 1] = g_tile[i];
-	  static_cast<uint8_t*>(o_tile)[i*3 + 2] = b_tile[i];
-	}
-	
-	// Write the tile to the TIFF file
-	// this function will automatically calculate memory size from TIFF tags
-	if (TIFFWriteTile(out, o_tile, x, y, 0, 0) < 0) { 
-	  fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
+    // then the reduced levels, as SubIFDs of this one
+    uint16_t compression = COMPRESSION_NONE;
+    TIFFGetFieldDefaulted(out, TIFFTAG_COMPRESSION, &compression);
+    uint16_t photometric = PHOTOMETRIC_MINISBLACK;
+    TIFFGetFieldDefaulted(out, TIFFTAG_PHOTOMETRIC, &photometric);
+    for (int l = 1; l <= L; l++) {
+      
+      if (!TIFFWriteDirectory(out)) {
+	std::cerr << "Could not write output directory for channel " << n << " level " << l - 1 << std::endl;
+	return 1;
+      }
+      const PyramidLevel& lv = st.levels[l];
+      TIFFSetField(out, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+      TIFFSetField(out, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(lv.width));
+      TIFFSetField(out, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(lv.height));
+      TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, st.bps);
+      TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, st.spp);
+      TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+      TIFFSetField(out, TIFFTAG_PHOTOMETRIC, photometric);
+      TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+      TIFFSetField(out, TIFFTAG_TILEWIDTH, st.tilewidth);
+      TIFFSetField(out, TIFFTAG_TILELENGTH, st.tileheight);
+      TIFFSetField(out, TIFFTAG_COMPRESSION, compression);
+      if (predictor)
+	TIFFSetField(out, TIFFTAG_PREDICTOR, predictor);
+
+      for (size_t t = 0; t < lv.spooled.size(); t++) {
+	raw_tile.resize(lv.spooled[t].second);
+	if (fseeko(st.spool, lv.spooled[t].first, SEEK_SET) ||
+	    fread(raw_tile.data(), 1, raw_tile.size(), st.spool) != raw_tile.size() ||
+	    TIFFWriteRawTile(out, t, raw_tile.data(), raw_tile.size()) < 0) {
+	  fprintf(stderr, "Error writing channel %d level %d tile %zu\n", n, l, t);
 	  return 1;
 	}
-	
-      } // end x loop
-    } // end y loop
-    
-    free(o_tile);
-    free(r_tile);
-    free(g_tile);
-    free(b_tile);
+      }
+    }
+  }
+
+  return 0;
+}
 
+// crops whose R, G and B means are all below this (as a percent
+// of 255) are treated as empty
+#define CROP_EMPTY_LIMIT 20
+
+// read the window [x, x + w) x [y, y + h) of ifd into buf. With
+// cache_mb, through a TiledRaster that holds at most that many MB of
+// decoded tiles, with bands of tile rows split over the threads
+static int __read_window(const std::string& infile, const TiffIFD& ifd,
+			 uint64_t x, uint64_t y, uint64_t w, uint64_t h,
+			 void* buf, int threads, uint64_t cache_mb, bool verbose) {
+
+  if (cache_mb == 0)
+    return ifd.ReadRegion(x, y, w, h, 0, buf, threads);
+
+  TiledRaster raster(infile, ifd, cache_mb << 20);
+  if (!raster.ok())
+    return 1;
+  
+  const uint64_t ch = raster.ChunkHeight();
+  const size_t px = PixelBytes(raster.GetPixelType());
+  const int64_t bands = static_cast<int64_t>((y + h - 1) / ch - y / ch + 1);
+  int err = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+  for (int64_t b = 0; b < bands; b++) {
+    const uint64_t y0 = std::max(y, (y / ch + b) * ch);
+    const uint64_t y1 = std::min(y + h, (y / ch + b + 1) * ch);
+    uint8_t* dst = static_cast<uint8_t*>(buf) + (y0 - y) * w * px;
+    if (raster.ReadRegion(x, y0, w, y1 - y0, dst, w)) {
+#pragma omp atomic write
+      err = 1;
+    }
   }
+  
+  if (verbose)
+    std::cerr << "...tile cache: " << raster.hits() << " hits, " << raster.misses() <<
+      " misses, peak " << AddCommas(raster.PeakBytes()) << " bytes" << std::endl;
+  return err;
+}
 
-  // lined image
-  else {
+int Crop(const std::string& infile, const std::string& outfile,
+	 const std::string& palette_file,
+	 const std::vector<int>& channels_to_run,
+	 int64_t x, int64_t y, uint32_t w, uint32_t h,
+	 double microns_per_pixel, int quality,
+	 bool verbose, int threads, int level, uint64_t cache_mb) {
 
-    // assert that all of the image scanlines are the same
-    TIFFSetDirectory(in, 0);
-    uint64_t ls = TIFFScanlineSize(in);
+  TiffReader reader(infile.c_str());
+  if (reader.get() == NULL || reader.NumChannels() == 0)
+    return 1;
+  if (level < 0 || level >= (int)reader.NumLevels(0)) {
+    fprintf(stderr, "Error: level %d requested, but the image has %zu levels\n",
+	    level, reader.NumLevels(0));
+    return 1;
+  }
+  
+  // an already colorized TIFF is cropped as is
+  const TiffIFD& first = reader.Level(0, level);
 
-    for (int i = 1; i < 3; i++) {
-      TIFFSetDirectory(in, i);
-      assert(TIFFScanlineSize(in) == ls);
+  // pixels of a reduced level cover more of the slide
+  if (level > 0 && first.width > 0)
+    microns_per_pixel *= static_cast<double>(reader.Level(0, 0).width) / first.width;
+  const bool is_rgb = first.samples_per_pixel == 3 && first.bits_per_sample == 8;
+
+  // the palette is needed to colorize, and is optional for the legend
+  ChannelVector channels;
+  if (!palette_file.empty() && ReadPalette(palette_file, channels))
+    return 1;
+  for (auto n : channels_to_run) {
+    if (n < 0 || n >= (int)channels.size()) {
+      fprintf(stderr, "Error: channel %d is not in the palette (%zu channels)\n", n, channels.size());
+      return 1;
     }
-    
-    // allocate memory for a single line
-    uint8_t* rbuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in));
-    uint8_t* gbuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in));
-    uint8_t* bbuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in));
-    uint8_t* obuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in) * 3);
-
-    uint64_t m_pix = 0;
-    for (uint64_t y = 0; y < m_height; y++) {
-      
-      // Read the red line
-      TIFFSetDirectory(in, 0);
-      if (TIFFReadScanline(in, rbuf, y) < 0) {
-	fprintf(stderr, "Error reading red line at row %llu\n", y);
+  }
+  if (!is_rgb) {
+    if (channels_to_run.empty()) {
+      std::cerr << "Error: no channels selected" << std::endl;
+      return 1;
+    }
+    for (auto n : channels_to_run) {
+      if (n >= (int)reader.NumChannels()) {
+	fprintf(stderr, "Error: channel %d is past the last channel of the image (%zu)\n", n, reader.NumChannels());
 	return 1;
       }
-
-      // Read the green line
-      TIFFSetDirectory(in, 1);      
-      if (TIFFReadScanline(in, gbuf, y) < 0) {
-	fprintf(stderr, "Error reading green line at row %llu\n", y);
+      if (level >= (int)reader.NumLevels(n)) {
+	fprintf(stderr, "Error: channel %d has no level %d\n", n, level);
 	return 1;
       }
+    }
+  }
+  
+  // pick the window
+  const uint64_t W = first.width, H = first.height;
+  if (w == 0 || h == 0 || w > W || h > H) {
+    fprintf(stderr, "Error: crop of %u x %u does not fit in the %llu x %llu image\n",
+	    w, h, (unsigned long long)W, (unsigned long long)H);
+    return 1;
+  }
+  std::mt19937_64 rng(std::random_device{}());
+  if (x < 0)
+    x = rng() % (W - w + 1);
+  if (y < 0)
+    y = rng() % (H - h + 1);
+  if (static_cast<uint64_t>(x) >= W || static_cast<uint64_t>(y) >= H ||
+      static_cast<uint64_t>(x) + w > W || static_cast<uint64_t>(y) + h > H) {
+    fprintf(stderr, "Error: crop of %u x %u at (%lld, %lld) runs outside the %llu x %llu image\n",
+	    w, h, (long long)x, (long long)y, (unsigned long long)W, (unsigned long long)H);
+    return 1;
+  }
+  if (verbose)
+    std::cerr << "...cropping " << w << " x " << h << " at " << PAIRSTRING(x, y) << std::endl;
+  
+  const size_t px = static_cast<size_t>(w) * h;
+  std::vector<uint8_t> rgb(px * 3);
+  
+  if (is_rgb) {
+    if (__read_window(infile, first, x, y, w, h, rgb.data(), threads, cache_mb, verbose))
+      return 1;
+  } else {
 
-      // Read the blue line
-      TIFFSetDirectory(in, 2);
-      if (TIFFReadScanline(in, bbuf, y) < 0) {
-	fprintf(stderr, "Error reading blue line at row %llu\n", y);
+    // decode just the window of each channel, then blend
+    std::vector<std::vector<uint16_t>> values(channels_to_run.size());
+    std::vector<const uint16_t*> src;
+    std::vector<ChannelLUT> luts;
+    for (size_t k = 0; k < channels_to_run.size(); k++) {
+      const TiffIFD& ifd = reader.Level(channels_to_run[k], level);
+      if (ifd.bits_per_sample != 16 || ifd.samples_per_pixel != 1 ||
+	  ifd.width != W || ifd.height != H) {
+	fprintf(stderr, "Error: channel %d is not a %llu x %llu 16-bit gray image\n",
+		channels_to_run[k], (unsigned long long)W, (unsigned long long)H);
 	return 1;
       }
-
-      // copy the line
-      for (size_t i = 0; i < TIFFScanlineSize(in); ++i) {
-	
-	//		++m_pix;
-	//		if (verbose && m_pix % static_cast<uint64_t>(1e9) == 0)
-	//std::cerr << "...working on pixel: " <<
-	//  AddCommas(static_cast<uint64_t>(m_pix)) << std::endl;
-	
-	static_cast<uint8_t*>(obuf)[i*3  ] = rbuf[i];
-	static_cast<uint8_t*>(obuf)[i*3+1] = gbuf[i];
-	static_cast<uint8_t*>(obuf)[i*3+2] = bbuf[i];
-      }
-      
-      // Write the tile to the TIFF file
-      // this function will automatically calculate memory size from TIFF tags
-      if (TIFFWriteScanline(out, obuf, y) < 0) { 
-	fprintf(stderr, "Error writing line row %llu\n", y);
+      values[k].resize(px);
+      if (__read_window(infile, ifd, x, y, w, h, values[k].data(), threads, cache_mb, verbose))
 	return 1;
-      }
-    } // end row loop
+      src.push_back(values[k].data());
+      luts.push_back(__channel_lut(channels.at(channels_to_run[k])));
+    }
 
-    free(obuf);
-    free(rbuf);
-    free(gbuf);
-    free(bbuf);
+    ColorizeScratch scratch;
+    ColorizeU16(src.data(), luts, px, rgb.data(), scratch);
+  }
 
-    
+  // skip crops that missed the tissue
+  uint64_t sum[3] = {0, 0, 0};
+  for (size_t i = 0; i < px; i++)
+    for (int c = 0; c < 3; c++)
+      sum[c] += rgb[i * 3 + c];
+  double mean[3];
+  for (int c = 0; c < 3; c++)
+    mean[c] = 100.0 * sum[c] / px / 255;
+  if (mean[0] < CROP_EMPTY_LIMIT && mean[1] < CROP_EMPTY_LIMIT && mean[2] < CROP_EMPTY_LIMIT) {
+    fprintf(stderr, "Cropped to an empty region with mean RGB: %.2f, %.2f, %.2f. Skipping\n",
+	    mean[0], mean[1], mean[2]);
+    return 0;
   }
-  return 0;
+
+  const int iw = w, ih = h;
+  const RGBColor white(255, 255, 255);
+
+  // 100 um scale bar, in from the bottom right corner by 5%, with
+  // its label centered above it
+  if (microns_per_pixel > 0) {
+    const int bar_len = std::lround(100 / microns_per_pixel);
+    const int bar_h = 20;
+    const int bar_x = iw - bar_len - iw / 20;
+    const int bar_y = ih - bar_h - ih / 20;
+    if (bar_x > 0 && bar_y > 0) {
+      FillRect(rgb.data(), iw, ih, bar_x, bar_y, bar_x + bar_len, bar_y + bar_h, white);
+      const std::string label = "100 um";
+      const int scale = 3;
+      DrawText(rgb.data(), iw, ih,
+	       bar_x + (bar_len - TextWidth(label, scale)) / 2,
+	       bar_y - 10 - TextHeight(scale), label, scale, white);
+    }
+  }
+
+  // legend: channel names in their colours, on a black band
+  // across the top 10% of the crop
+  if (!channels_to_run.empty() && !channels.empty()) {
+    const int band = ih / 10;
+    FillRect(rgb.data(), iw, ih, 0, 0, iw, band, RGBColor(0, 0, 0));
+    const int scale = std::max(1, std::min(6, band / 2 / TextHeight(1)));
+    int tx = 10;
+    for (auto n : channels_to_run) {
+      const Channel& c = channels.at(n);
+      DrawText(rgb.data(), iw, ih, tx, (band - TextHeight(scale)) / 2,
+	       c.channelName, scale, c.color);
+      tx += TextWidth(c.channelName, scale) + 10 + TextWidth(" ", scale);
+    }
+  }
+
+  return WriteImage(outfile, rgb.data(), w, h, quality);
 }
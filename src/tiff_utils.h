@@ -12,21 +12,108 @@
 #include <vector>
 
 #include "tiffio.h"
+#include "tiff_encoder.h"
 
 using funcmm_t = double (*)(uint8_t*, size_t); // mean vs mode function object
 
 #define PAIRSTRING(X_, Y_) "(" + std::to_string(X_) + ", " + std::to_string(Y_) +  ")"
 
-int MergeGrayToRGB(TIFF* in, TIFF* out);
-int Compress(TIFF* in, TIFF* out);
+// Read tile or strip c (whichever the current directory uses) into
+// buf, like TIFFReadEncodedTile / TIFFReadEncodedStrip. A chunk with a
+// zero byte count was never written (a sparse tile, e.g. from cytif
+// compress), which libtiff rejects, so it is returned as all zeros
+tmsize_t ReadEncodedChunk(TIFF* tif, uint32_t c, void* buf, tmsize_t size);
+
+// The worker count for a --threads value. Every module runs its tile
+// work on the one OpenMP thread team (mostly through a TileLoop), so
+// this is the whole of its parallelism. 0 or less means every CPU the process may run on, which follows
+// taskset and cgroup limits. Workers are placed by the OpenMP runtime,
+// so OMP_PROC_BIND and OMP_PLACES pin them
+int ResolveThreads(int threads);
+
+// file offset of resolution level `level` (0 is full resolution) of
+// every channel of in, see TiffReader::Level. The modules below take
+// a level and work on just those IFDs. Returns non-zero if any
+// channel has no such level
+int LevelOffsets(TIFF* in, int level, std::vector<uint64_t>& offsets);
+
+// The modules that write a TIFF take a CodecOptions, which overrides
+// the codec, level and predictor they would otherwise write with
+//
+// Colorize and Mask (and TiffReader::print_stats) also take
+// `sequential`, which reads tiles in file offset order with prefetch
+// (see ChunkSchedule) for files on NFS or spinning disks. It changes
+// only the I/O pattern, not the pixels written
+int MergeGrayToRGB(TIFF* in, TIFF* out, int level = 0, int threads = 1,
+		   const CodecOptions& codec = CodecOptions());
+// Pack the given channels (all the same size, tiling and sample type,
+// single-sample 8, 16 or 32-bit) into one pixel-interleaved image of
+// channels.size() samples per pixel, in the tile or strip layout of
+// the input. Three 8-bit channels are written as RGB, anything else as
+// MINISBLACK with the rest as extra samples. Chunks are decoded,
+// interleaved and compressed on `threads` workers, and written in
+// order. MergeGrayToRGB is this on channels 0, 1 and 2
+int Interleave(TIFF* in, TIFF* out, const std::vector<int>& channels,
+	       int level = 0, int threads = 1,
+	       const CodecOptions& codec = CodecOptions());
+// Same, with sample k taken from the IFD at offset dirs[k] of
+// files[k], so the planes can come from separate files. Matching
+// tiles of every plane are decoded at the same time
+int Interleave(const std::vector<std::string>& files, const std::vector<uint64_t>& dirs,
+	       TIFF* out, int threads = 1, const CodecOptions& codec = CodecOptions());
+// gray2rgb on three single-channel files (the first IFD of each, at
+// the level), each read by its own handles. threads >= 3 decodes the
+// red, green and blue tiles together
+int MergeGrayToRGB(const std::string& red, const std::string& green,
+		   const std::string& blue, TIFF* out, int level = 0,
+		   int threads = 3, const CodecOptions& codec = CodecOptions());
+int Compress(TIFF* in, TIFF* out, bool sparse, bool verbose, int threads = 1,
+	     int level = 0, const CodecOptions& codec = CodecOptions());
 int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
 	     const std::vector<int>& channels_to_run,
-	     bool verbose);
+	     bool verbose, int threads = 1, int level = 0,
+	     const CodecOptions& codec = CodecOptions(),
+	     bool sequential = false);
+// Cut a w x h window at (x, y) out of infile, colorize it with the
+// palette (unless the TIFF is already RGB), annotate it with a 100 um
+// scale bar and a channel legend, and save it as PNG or JPEG. A
+// negative x or y picks a random origin. Crops whose mean R, G and B
+// are all under 20% are reported and not written. At a reduced
+// resolution level, x, y, w and h are in that level's pixels
+int Crop(const std::string& infile, const std::string& outfile,
+	 const std::string& palette_file,
+	 const std::vector<int>& channels_to_run,
+	 int64_t x, int64_t y, uint32_t w, uint32_t h,
+	 double microns_per_pixel, int quality,
+	 bool verbose, int threads = 1, int level = 0, uint64_t cache_mb = 0);
+// Re-encode every tile of in (channels and their reduced levels) with
+// the codec, level and predictor in codec, keeping all of the tags.
+// Tiles are decoded and compressed on `threads` workers, and written
+// raw and in order
+int Recompress(TIFF* in, TIFF* out, const CodecOptions& codec,
+	       bool verbose, int threads = 1);
+
+// Sample tiles_per_channel tiles with data from each channel, and print
+// the compressed size and the encode and decode speed of each codec,
+// level and predictor on them to stdout
+int CodecBenchmark(TIFF* in, int tiles_per_channel, bool verbose);
+
+// Write every channel of in to out with a pyramid of 2x reduced
+// levels as its SubIFDs (OME-TIFF style). The full resolution image is
+// read once, a tile row at a time, and all of the levels are built from
+// it as it streams past. num_levels < 0 keeps halving until a level
+// fits in one tile
+int Pyramid(TIFF* in, TIFF* out, int num_levels, bool verbose, int threads = 1,
+	    const CodecOptions& codec = CodecOptions());
 int Mask(TIFF* in, TIFF* out,
 	 int xlim1,
 	 int ylim1,
 	 int xlim2,
-	 int ylim2);
+	 int ylim2,
+	 int threads = 1,
+	 int level = 0,
+	 const CodecOptions& codec = CodecOptions(),
+	 bool sequential = false);
 static int cnt = 0; 
 #define DEBUGP do { std::cerr << "DEBUGP: " << cnt++ << std::endl; } while(0)
 
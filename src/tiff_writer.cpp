@@ -1,5 +1,12 @@
 #include "tiff_writer.h"
 
+#include <algorithm>
+#include <cstring>
+
+#include "tile_buffer.h"
+
+#include <omp.h>
+
 int TiffWriter::SetTag(uint32_t tag, ...) {
 
   va_list ap;
@@ -24,18 +31,27 @@ TiffWriter::TiffWriter(const char* c) {
 
   m_filename = std::string(c);
 
-  // only no compression currently supported
-  TIFFSetField(m_tif.get(), TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  // uncompressed unless SetCodec says otherwise
+  m_codec.compression = COMPRESSION_NONE;
+  ::SetCodec(m_tif.get(), m_codec);
   
 }
 
+int TiffWriter::SetCodec(const CodecOptions& codec) {
+
+  m_codec = codec;
+  if (!m_codec.compression)
+    m_codec.compression = COMPRESSION_NONE;
+  return ::SetCodec(m_tif.get(), m_codec);
+}
+
 void TiffWriter::CopyFromReader(const TiffReader& tr) {
 
   // copy the tags from reader tif to writer tif
   tiffcp(tr.m_tif.get(), m_tif.get(), false);
 
-  // only no compression currently supported
-  TIFFSetField(m_tif.get(), TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  // the writer's own codec, not the one that was copied over
+  ::SetCodec(m_tif.get(), m_codec);
   
 }
 
@@ -96,17 +112,19 @@ void TiffWriter::UpdateDims(const TiffImage& ti) {
 
 int TiffWriter::__tiled_write(const TiffImage& ti) const {
 
+  TIFF* tif = m_tif.get();
+  
   // sanity check
-  assert(TIFFIsTiled(m_tif.get()));
-  assert(TIFFTileSize(m_tif.get()));
+  assert(TIFFIsTiled(tif));
+  assert(TIFFTileSize(tif));
   
   // pull tile and image dims directly from libtiff writer
   uint32_t o_tile_width, o_tile_height;
-  assert(TIFFGetField(m_tif.get(), TIFFTAG_TILEWIDTH, &o_tile_width));
-  assert(TIFFGetField(m_tif.get(), TIFFTAG_TILELENGTH, &o_tile_height));  
+  assert(TIFFGetField(tif, TIFFTAG_TILEWIDTH, &o_tile_width));
+  assert(TIFFGetField(tif, TIFFTAG_TILELENGTH, &o_tile_height));  
   uint32_t m_width, m_height;
-  assert(TIFFGetField(m_tif.get(), TIFFTAG_IMAGEWIDTH, &m_width));
-  assert(TIFFGetField(m_tif.get(), TIFFTAG_IMAGELENGTH, &m_height));  
+  assert(TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &m_width));
+  assert(TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &m_height));  
 
   uint8_t mode = GetMode(); 
 
@@ -125,56 +143,79 @@ int TiffWriter::__tiled_write(const TiffImage& ti) const {
     return 1;
   }
 
-  // Allocate a buffer for the output tiles
-  void* buf = _TIFFmalloc(TIFFTileSize(m_tif.get()));
-  if (buf == NULL) {
-    fprintf(stderr, "Error allocating memory for tiles\n");
+  if (!ti.__has_pixels())
+    return 1;
+  
+  // the raster rows are copied straight into the tiles, so the
+  // pixels have to be the same size on both sides
+  const PixelType pt = ti.GetPixelType();
+  const uint64_t px = TIFFTileRowSize(tif) / o_tile_width;
+  if (px != PixelBytes(pt)) {
+    fprintf(stderr, "ERROR: writer has %llu bytes per pixel, image mode %d has %llu\n",
+	    (unsigned long long)px, ti.GetMode(), (unsigned long long)PixelBytes(pt));
     return 1;
   }
 
-  // loop through the output image tiles and write the pixels
-  // from the raster
-  uint64_t x, y;
-
-  for (y = 0; y < m_height; y += o_tile_height) {
-    for (x = 0; x < m_width; x += o_tile_width) {
-      // Fill the tile buffer with data
-      for (uint64_t ty = 0; ty < o_tile_height; ty++) {
-	for (uint64_t tx = 0; tx < o_tile_width; tx++) {
-	  uint64_t xp = x + tx; // want 64 bits to be able to store really big d_pos, since this is the nth pixel
-	  uint64_t yp = y + ty;
-	  uint64_t d_pos = yp * m_width + xp; // index of pixel in the entire image
-	  uint64_t t_pos = ty * o_tile_width + tx; // index of pixel in this particular tile
-	  if (xp < m_width && yp < m_height) {
-	    switch(mode) {
-	    case 8:
-	      static_cast<uint8_t*>(buf)[t_pos] = ti.pixel(xp, yp, PIXEL_GRAY);
-	      break;
-	      //case 32:
-	      //static_cast<uint32_t*>(buf)[t_pos] = ti.pixel<uint32_t>(xp, yp, PIXEL_GRAY);
-	      //break;
-	    case 3:
-	      t_pos = t_pos * 3;
-	      static_cast<uint8_t*>(buf)[t_pos]     = ti.pixel(xp, yp, PIXEL_RED);
-	      static_cast<uint8_t*>(buf)[t_pos + 1] = ti.pixel(xp, yp, PIXEL_GREEN);
-	      static_cast<uint8_t*>(buf)[t_pos + 2] = ti.pixel(xp, yp, PIXEL_BLUE);
-	      break;
-	    }
-	  }
-	}
+  // only the part of the raster inside both the writer and image
+  // dims is copied, the rest of the tile stays zero
+  const uint64_t width = std::min(m_width, ti.m_width);
+  const uint64_t height = std::min(m_height, ti.m_height);
+  const tmsize_t ts = TIFFTileSize(tif);
+  
+  // tiles are filled and compressed on threads, a row of tiles at a
+  // time, and written in order from here
+  TiffTileEncoder encoder(tif);
+  const int threads = std::max<size_t>(m_threads, 1);
+  const uint64_t tiles_across = (m_width + o_tile_width - 1) / o_tile_width;
+  std::vector<std::vector<uint8_t>> tiles(tiles_across);
+  TileBufferPool fill(tiles_across, 1, ts);
+  if (!fill.ok())
+    return 1;
+
+  for (uint64_t y = 0; y < m_height; y += o_tile_height) {
+
+    const uint64_t rows = y < height ? std::min<uint64_t>(o_tile_height, height - y) : 0;
+    int err = 0;
+    
+#pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (int64_t k = 0; k < static_cast<int64_t>(tiles_across); k++) {
+
+      const uint64_t x = k * o_tile_width;
+      const uint64_t cols = x < width ? std::min<uint64_t>(o_tile_width, width - x) : 0;
+      
+      // only tiles on the image edge have padding left to clear
+      uint8_t* buf = fill.get(k, 0);
+      if (rows < o_tile_height || cols < o_tile_width)
+	std::memset(buf, 0, ts);
+      if (rows && cols && ti.__read_region(x, y, cols, rows, buf, o_tile_width)) {
+#pragma omp atomic write
+	err = 1;
+	continue;
       }
 
-      // Write the tile to the TIFF file
-      // this function will automatically calculate memory size from TIFF tags
-      if (TIFFWriteTile(m_tif.get(), buf, x, y, 0, 0) < 0) { 
-	fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
+      if (encoder.ok() && encoder.encode(buf, ts, tiles[k])) {
+#pragma omp atomic write
+	err = 1;
+      }
+    }
+    if (err) {
+      fprintf(stderr, "Error filling or compressing tile row at %llu\n", (unsigned long long)y);
+      return 1;
+    }
+
+    // Write the tiles to the TIFF file
+    for (uint64_t k = 0; k < tiles_across; k++) {
+      const ttile_t t = TIFFComputeTile(tif, k * o_tile_width, y, 0, 0);
+      const tmsize_t w = encoder.ok() ?
+	TIFFWriteRawTile(tif, t, tiles[k].data(), tiles[k].size()) :
+	TIFFWriteEncodedTile(tif, t, fill.get(k, 0), ts);
+      if (w < 0) {
+	fprintf(stderr, "Error writing tile at (%llu, %llu)\n",
+		(unsigned long long)(k * o_tile_width), (unsigned long long)y);
 	return 1;
       }
     }
   }
-
-  // Clean up
-  _TIFFfree(buf);
   
   return 0;
 }
@@ -212,6 +253,24 @@ int TiffWriter::__lined_write(const TiffImage& ti) const {
   // for ease
   //uint8_t* buf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(otif));
 
+  // an image opened with OpenTiled is pulled out a line at a time
+  if (ti.m_data == NULL && ti.m_tiled) {
+    if (ls != ti.m_width * PixelBytes(ti.GetPixelType())) {
+      fprintf(stderr, "ERROR: scanline of %llu bytes does not match the image\n",
+	      (unsigned long long)ls);
+      return 1;
+    }
+    std::vector<uint8_t> line(ls);
+    for (uint64_t y = 0; y < std::min<uint64_t>(m_height, ti.m_height); y++) {
+      if (ti.__read_region(0, y, ti.m_width, 1, line.data(), ti.m_width) ||
+	  TIFFWriteScanline(m_tif.get(), line.data(), y, 0) < 0) {
+	fprintf(stderr, "Error writing line row %llu\n", y);
+	return 1;
+      }
+    }
+    return 0;
+  }
+
   for (uint64_t y = 0; y < m_height; y++) {
 
     // copy directly from m_data since the order of writing
@@ -244,6 +303,18 @@ int TiffWriter::__lined_write(const TiffImage& ti) const {
   }*/
 
 
+PixelType TiffWriter::GetPixelType() const {
+
+  uint16_t samples_per_pixel, bits_per_sample, sample_format;
+
+  assert(TIFFGetField(m_tif.get(), TIFFTAG_BITSPERSAMPLE, &bits_per_sample));
+  assert(TIFFGetField(m_tif.get(), TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel));
+  TIFFGetFieldDefaulted(m_tif.get(), TIFFTAG_SAMPLEFORMAT, &sample_format);
+
+  return ::GetPixelType(samples_per_pixel, bits_per_sample, sample_format);
+  
+}
+
 uint8_t TiffWriter::GetMode() const {
 
   uint16_t samples_per_pixel, bits_per_sample;
@@ -6,6 +6,7 @@
 #include "tiffio.h"
 #include "tiff_reader.h"
 #include "tiff_image.h"
+#include "tiff_encoder.h"
 
 class TiffWriter {
 
@@ -28,6 +29,15 @@ class TiffWriter {
   
   void SetTile(int h, int w);
 
+  // codec, level and predictor for the pixels written from now on.
+  // Without this, images are written uncompressed
+  int SetCodec(const CodecOptions& codec);
+
+  const CodecOptions& Codec() const { return m_codec; }
+
+  // number of threads to fill and compress tiles on
+  void setthreads(size_t threads) { m_threads = threads; }
+
   int Write(const TiffImage& ti);
 
   void MatchTagsToRaster(const TiffImage& ti);
@@ -35,6 +45,9 @@ class TiffWriter {
   void CopyFromReader(const TiffReader& tr);
 
   uint8_t GetMode() const;
+
+  // typed pixel layout from the tags set so far, see tiff_pixel.h
+  PixelType GetPixelType() const;
   
   void UpdateDims(const TiffImage& ti);
 
@@ -48,6 +61,10 @@ class TiffWriter {
 
   bool m_verbose = true;
 
+  CodecOptions m_codec;
+
+  size_t m_threads = 1;
+
   int __tiled_write(const TiffImage& ti) const;
   int __lined_write(const TiffImage& ti) const;  
 
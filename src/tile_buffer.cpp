@@ -0,0 +1,61 @@
+#include "tile_buffer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// arenas at least this big are aligned to it, and advised as huge pages
+#define HUGE_PAGE_BYTES (2UL << 20)
+
+static size_t __round_up(size_t n, size_t a) {
+  return (n + a - 1) / a * a;
+}
+
+TileBufferPool::TileBufferPool(size_t rows, size_t per_row, size_t bytes) {
+
+  m_rows = rows;
+  m_sizes.assign(per_row, bytes);
+  __alloc();
+}
+
+TileBufferPool::TileBufferPool(size_t rows, const std::vector<size_t>& sizes) {
+
+  m_rows = rows;
+  m_sizes = sizes;
+  __alloc();
+}
+
+void TileBufferPool::__alloc() {
+
+  for (const auto& s : m_sizes) {
+    m_offsets.push_back(m_row_bytes);
+    m_row_bytes += __round_up(s, TILE_BUFFER_ALIGN);
+  }
+
+  // always hand back something, even for an empty pool
+  const size_t total = std::max<size_t>(m_rows * m_row_bytes, TILE_BUFFER_ALIGN);
+  const size_t align = total >= HUGE_PAGE_BYTES ? HUGE_PAGE_BYTES : TILE_BUFFER_ALIGN;
+
+  void* p = NULL;
+  if (posix_memalign(&p, align, __round_up(total, align))) {
+    fprintf(stderr, "ERROR: unable to allocate %zu bytes of tile buffers\n", total);
+    return;
+  }
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (align == HUGE_PAGE_BYTES)
+    madvise(p, __round_up(total, align), MADV_HUGEPAGE);
+#endif
+
+  std::memset(p, 0, total);
+  m_arena = static_cast<uint8_t*>(p);
+}
+
+TileBufferPool::~TileBufferPool() {
+  free(m_arena);
+}
@@ -0,0 +1,74 @@
+#ifndef TILE_BUFFER_H
+#define TILE_BUFFER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// alignment of every buffer in a TileBufferPool, enough for any SIMD load
+#define TILE_BUFFER_ALIGN 64
+
+// Tile buffers for a loop, set up once before it and reused for every
+// tile, so that the loop itself never allocates. The pool is `rows`
+// rows of the same set of buffers (buffer k of each row is sizes[k]
+// bytes). A row is usually a worker thread, or a slot of a window of
+// tiles in flight, the same way TiffHandlePool hands out one row of
+// handles per thread.
+//
+// All of the buffers are cut from one arena, each starting on a
+// TILE_BUFFER_ALIGN boundary, and start out zeroed. On Linux an arena
+// of 2MB or more is aligned to 2MB and marked for transparent huge
+// pages, which cuts TLB misses when many large tiles are in use
+class TileBufferPool {
+
+ public:
+
+  // an empty pool
+  TileBufferPool() {}
+
+  // rows x per_row buffers, each of `bytes`
+  TileBufferPool(size_t rows, size_t per_row, size_t bytes);
+
+  // rows of buffers of the given sizes
+  TileBufferPool(size_t rows, const std::vector<size_t>& sizes);
+
+  ~TileBufferPool();
+
+  // owns the arena, so no copying
+  TileBufferPool(const TileBufferPool&) = delete;
+  TileBufferPool& operator=(const TileBufferPool&) = delete;
+
+  // buffer k of row r
+  uint8_t* get(size_t r, size_t k) const {
+    return m_arena + r * m_row_bytes + m_offsets[k];
+  }
+
+  // same, as an array of T
+  template <typename T>
+  T* as(size_t r, size_t k) const { return reinterpret_cast<T*>(get(r, k)); }
+
+  // size in bytes of buffer k (of any row)
+  size_t size(size_t k) const { return m_sizes[k]; }
+
+  size_t NumRows() const { return m_rows; }
+
+  // false if the arena could not be allocated
+  bool ok() const { return m_arena != NULL; }
+
+ private:
+
+  uint8_t* m_arena = NULL;
+
+  size_t m_rows = 0;
+
+  // bytes from the start of one row to the next
+  size_t m_row_bytes = 0;
+
+  // start of each buffer within a row, and its size
+  std::vector<size_t> m_offsets;
+  std::vector<size_t> m_sizes;
+
+  void __alloc();
+};
+
+#endif